@@ -0,0 +1,487 @@
+// replays a log corpus through omzstd over the omprog protocol and reports throughput, acknowledgement latency,
+// CPU per GB and compression ratio for every THREADS x LEVEL combination
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define LOG(...)                          \
+    do                                    \
+    {                                     \
+        fprintf(stderr, "omzstd-bench: "); \
+        fprintf(stderr, __VA_ARGS__);     \
+        fprintf(stderr, "\n");            \
+    } while (0)
+
+typedef struct bench_t_
+{
+    const char *binary;
+    const char *dir;
+    // lines per second, 0 = as fast as omzstd takes them
+    double rate;
+    char **extraArgs;
+    int extraCount;
+
+    const char *corpus;
+    size_t corpusSize;
+    // offset of the end of every line
+    size_t *lineEnds;
+    size_t lineCount;
+
+    uint64_t *sentAt;
+    uint64_t *latencies;
+} bench_t;
+
+static bench_t bench = {
+    .binary = "./omzstd",
+    .dir = NULL,
+    .rate = 0,
+    .extraArgs = NULL,
+    .extraCount = 0,
+    .corpus = NULL,
+    .corpusSize = 0,
+    .lineEnds = NULL,
+    .lineCount = 0,
+    .sentAt = NULL,
+    .latencies = NULL};
+
+typedef struct result_t_
+{
+    double seconds;
+    double cpuSeconds;
+    size_t outputBytes;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+} result_t;
+
+static inline uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec) * 1000000 + (uint64_t)(ts.tv_nsec) / 1000;
+}
+
+static inline int load_corpus(const char *path)
+{
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        LOG("error opening corpus '%s': %s", path, fd == -1 ? strerror(errno) : "empty");
+        return -1;
+    }
+
+    bench.corpusSize = (size_t)(st.st_size);
+    void *data = mmap(NULL, bench.corpusSize, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        LOG("error mapping corpus '%s': %s", path, strerror(errno));
+        return -1;
+    }
+    bench.corpus = (const char *)data;
+
+    // a last line without newline would never be acknowledged
+    if (bench.corpus[bench.corpusSize - 1] != '\n')
+    {
+        LOG("corpus '%s' does not end with a newline", path);
+        return -1;
+    }
+
+    size_t capacity = 0;
+    for (size_t pos = 0; pos < bench.corpusSize;)
+    {
+        const char *nl = (const char *)memchr(bench.corpus + pos, '\n', bench.corpusSize - pos);
+        if (bench.lineCount == capacity)
+        {
+            capacity = capacity == 0 ? 65536 : capacity * 2;
+            size_t *ends = (size_t *)realloc(bench.lineEnds, capacity * sizeof(size_t));
+            if (ends == NULL)
+            {
+                LOG("error allocating line index");
+                return -1;
+            }
+            bench.lineEnds = ends;
+        }
+        pos = (size_t)(nl - bench.corpus) + 1;
+        bench.lineEnds[bench.lineCount++] = pos;
+    }
+
+    bench.sentAt = (uint64_t *)malloc(bench.lineCount * sizeof(uint64_t));
+    bench.latencies = (uint64_t *)malloc(bench.lineCount * sizeof(uint64_t));
+    if (bench.sentAt == NULL || bench.latencies == NULL)
+    {
+        LOG("error allocating latency buffers");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static inline uint64_t percentile(double p)
+{
+    size_t index = (size_t)(p * (double)(bench.lineCount));
+    return bench.latencies[index < bench.lineCount ? index : bench.lineCount - 1];
+}
+
+// adds up and removes what omzstd wrote into the bench directory
+static inline size_t collect_output()
+{
+    DIR *dir = opendir(bench.dir);
+    if (dir == NULL)
+    {
+        LOG("error opening '%s': %s", bench.dir, strerror(errno));
+        return 0;
+    }
+
+    size_t total = 0;
+    struct dirent *entry = NULL;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "bench.", 6) != 0)
+        {
+            continue;
+        }
+
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, 0) == 0)
+        {
+            total += (size_t)(st.st_size);
+        }
+        unlinkat(dirfd(dir), entry->d_name, 0);
+    }
+    closedir(dir);
+
+    return total;
+}
+
+static inline pid_t spawn(const char *threads, const char *level, int *toChild, int *fromChild)
+{
+    char prefix[4096];
+    snprintf(prefix, sizeof prefix, "%s/bench", bench.dir);
+
+    char **argv = (char **)calloc((size_t)(bench.extraCount) + 5, sizeof(char *));
+    if (argv == NULL)
+    {
+        return -1;
+    }
+    int argc = 0;
+    argv[argc++] = (char *)(uintptr_t)(bench.binary);
+    for (int i = 0; i < bench.extraCount; i++)
+    {
+        argv[argc++] = bench.extraArgs[i];
+    }
+    argv[argc++] = (char *)(uintptr_t)(threads);
+    argv[argc++] = (char *)(uintptr_t)(level);
+    argv[argc++] = prefix;
+
+    int in[2];
+    int out[2];
+    if (pipe2(in, O_CLOEXEC) != 0 || pipe2(out, O_CLOEXEC) != 0)
+    {
+        LOG("error creating pipes: %s", strerror(errno));
+        free(argv);
+        return -1;
+    }
+
+    const pid_t pid = fork();
+    if (pid == 0)
+    {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        execv(bench.binary, argv);
+        LOG("error running '%s': %s", bench.binary, strerror(errno));
+        _exit(127);
+    }
+    free(argv);
+    close(in[0]);
+    close(out[1]);
+
+    if (pid == -1)
+    {
+        LOG("error forking: %s", strerror(errno));
+        close(in[1]);
+        close(out[0]);
+        return -1;
+    }
+
+    fcntl(in[1], F_SETFL, O_NONBLOCK);
+    *toChild = in[1];
+    *fromChild = out[0];
+    return pid;
+}
+
+// sends the corpus and waits for the acknowledgement of every line
+static inline int run(const char *threads, const char *level, result_t *result)
+{
+    int toChild = -1;
+    int fromChild = -1;
+    const pid_t pid = spawn(threads, level, &toChild, &fromChild);
+    if (pid == -1)
+    {
+        return -1;
+    }
+
+    size_t sentLines = 0;
+    size_t sentBytes = 0;
+    size_t acked = 0;
+    // the first OK only says omzstd is ready
+    bool ready = false;
+    uint64_t start = 0;
+    int ret = 0;
+
+    while (acked < bench.lineCount)
+    {
+        const uint64_t now = now_us();
+
+        // lines that are due, everything while running flat out
+        size_t due = bench.lineCount;
+        if (ready && bench.rate > 0)
+        {
+            due = (size_t)((double)(now - start) * bench.rate / 1e6) + 1;
+            due = due < bench.lineCount ? due : bench.lineCount;
+        }
+
+        struct pollfd pfds[2] = {
+            {.fd = fromChild, .events = POLLIN, .revents = 0},
+            {.fd = toChild, .events = POLLOUT, .revents = 0}};
+        const bool sending = ready && sentLines < due;
+        const int timeout = ready && sentLines < bench.lineCount && !sending ? 1 : -1;
+        if (poll(pfds, sending ? 2 : 1, timeout) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            LOG("error polling: %s", strerror(errno));
+            ret = -1;
+            break;
+        }
+
+        if (sending && (pfds[1].revents & POLLOUT))
+        {
+            const size_t upTo = bench.lineEnds[due - 1];
+            const ssize_t n = write(toChild, bench.corpus + sentBytes, upTo - sentBytes);
+            if (n == -1 && errno != EAGAIN)
+            {
+                LOG("error writing to omzstd: %s", strerror(errno));
+                ret = -1;
+                break;
+            }
+
+            if (n > 0)
+            {
+                sentBytes += (size_t)(n);
+                const uint64_t sentAt = now_us();
+                while (sentLines < bench.lineCount && bench.lineEnds[sentLines] <= sentBytes)
+                {
+                    bench.sentAt[sentLines++] = sentAt;
+                }
+            }
+        }
+
+        if (pfds[0].revents & (POLLIN | POLLHUP))
+        {
+            char buf[65536];
+            const ssize_t n = read(fromChild, buf, sizeof buf);
+            if (n <= 0)
+            {
+                LOG("omzstd exited after %zu of %zu lines", acked, bench.lineCount);
+                ret = -1;
+                break;
+            }
+
+            const uint64_t ackedAt = now_us();
+            for (ssize_t i = 0; i < n; i++)
+            {
+                if (buf[i] != '\n')
+                {
+                    continue;
+                }
+                if (!ready)
+                {
+                    ready = true;
+                    start = ackedAt;
+                }
+                else if (acked < sentLines)
+                {
+                    bench.latencies[acked] = ackedAt - bench.sentAt[acked];
+                    acked++;
+                }
+            }
+        }
+    }
+
+    const uint64_t end = now_us();
+    close(toChild);
+    close(fromChild);
+
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        LOG("omzstd did not exit cleanly");
+        ret = -1;
+    }
+
+    if (ret != 0)
+    {
+        collect_output();
+        return -1;
+    }
+
+    result->seconds = (double)(end - start) / 1e6;
+    result->cpuSeconds = (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+                         (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    result->outputBytes = collect_output();
+
+    qsort(bench.latencies, bench.lineCount, sizeof(uint64_t), compare_u64);
+    result->p50 = percentile(0.5);
+    result->p90 = percentile(0.9);
+    result->p99 = percentile(0.99);
+    result->p999 = percentile(0.999);
+    result->max = bench.latencies[bench.lineCount - 1];
+    return 0;
+}
+
+static inline void usage()
+{
+    LOG("usage: omzstd-bench [-b OMZSTD] [-d DIR] [-t THREADS,...] [-l LEVEL,...] [-r LINES_PER_SECOND] [-n RUNS] "
+        "CORPUS [-- OMZSTD_OPTIONS...]");
+}
+
+int main(int argc, char **argv)
+{
+    char *threadList = NULL;
+    char *levelList = NULL;
+    long runs = 1;
+    char dirTemplate[] = "/tmp/omzstd-bench.XXXXXX";
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "b:d:t:l:r:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            bench.binary = optarg;
+            break;
+        case 'd':
+            bench.dir = optarg;
+            break;
+        case 't':
+            threadList = optarg;
+            break;
+        case 'l':
+            levelList = optarg;
+            break;
+        case 'r':
+            bench.rate = strtod(optarg, NULL);
+            break;
+        case 'n':
+            runs = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+
+    if (optind >= argc || runs < 1 || bench.rate < 0)
+    {
+        usage();
+        exit(1);
+    }
+    const char *corpusPath = argv[optind++];
+    bench.extraArgs = argv + optind;
+    bench.extraCount = argc - optind;
+
+    threadList = strdup(threadList != NULL ? threadList : "1,2,4");
+    levelList = strdup(levelList != NULL ? levelList : "1,3,9");
+    if (threadList == NULL || levelList == NULL || load_corpus(corpusPath) != 0)
+    {
+        exit(1);
+    }
+
+    bool tempDir = false;
+    if (bench.dir == NULL)
+    {
+        bench.dir = mkdtemp(dirTemplate);
+        if (bench.dir == NULL)
+        {
+            LOG("error creating a temporary directory: %s", strerror(errno));
+            exit(1);
+        }
+        tempDir = true;
+    }
+
+    // omzstd exiting early must not take us down while writing to it
+    signal(SIGPIPE, SIG_IGN);
+
+    const double gigabytes = (double)(bench.corpusSize) / (1024.0 * 1024 * 1024);
+    printf("corpus %s: %zu lines, %.1f MiB, rate %s\n", corpusPath, bench.lineCount,
+           (double)(bench.corpusSize) / (1024.0 * 1024), bench.rate > 0 ? "limited" : "unlimited");
+    printf("%7s %5s %9s %11s %7s %9s %9s %9s %9s %9s %10s\n", "threads", "level", "MiB/s", "lines/s", "ratio",
+           "p50 us", "p90 us", "p99 us", "p99.9 us", "max us", "cpu s/GiB");
+
+    int failed = 0;
+    char *threadSave = NULL;
+    for (char *threads = strtok_r(threadList, ",", &threadSave); threads != NULL; threads = strtok_r(NULL, ",", &threadSave))
+    {
+        char *levels = strdup(levelList);
+        char *levelSave = NULL;
+        for (char *level = strtok_r(levels, ",", &levelSave); level != NULL; level = strtok_r(NULL, ",", &levelSave))
+        {
+            for (long i = 0; i < runs; i++)
+            {
+                result_t result;
+                if (run(threads, level, &result) != 0)
+                {
+                    failed = 1;
+                    continue;
+                }
+
+                printf("%7s %5s %9.1f %11.0f %7.2f %9lu %9lu %9lu %9lu %9lu %10.2f\n", threads, level,
+                       (double)(bench.corpusSize) / (1024.0 * 1024) / result.seconds,
+                       (double)(bench.lineCount) / result.seconds,
+                       result.outputBytes > 0 ? (double)(bench.corpusSize) / (double)(result.outputBytes) : 0.0,
+                       (unsigned long)(result.p50), (unsigned long)(result.p90), (unsigned long)(result.p99),
+                       (unsigned long)(result.p999), (unsigned long)(result.max), result.cpuSeconds / gigabytes);
+                fflush(stdout);
+            }
+        }
+        free(levels);
+    }
+
+    if (tempDir)
+    {
+        rmdir(bench.dir);
+    }
+    free(threadList);
+    free(levelList);
+
+    return failed;
+}
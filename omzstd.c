@@ -9,12 +9,60 @@
 #include <stdbool.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/signalfd.h>
+#include <dirent.h>
+#include <sys/eventfd.h>
+// shared worker pools (ZSTD_createThreadPool) are still behind the experimental API
+#define ZSTD_STATIC_LINKING_ONLY
 #include <zstd.h>
+#include <zdict.h>
 #include <pthread.h>
+#include <getopt.h>
+#include <linux/mempolicy.h>
+#include <netdb.h>
+#include <poll.h>
+#include <regex.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <spawn.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #define LIKELY(x) __builtin_expect((x), 1)
 #define UNLIKELY(x) __builtin_expect((x), 0)
 
+// USDT probes for bpftrace & co, a single nop each until a tracer attaches (bpftrace -l 'usdt:./omzstd:*'):
+//   read(bytes)                         a read from stdin
+//   line(length)                        every line, marks included
+//   compress__start(input, mode)        around ZSTD_compressStream2, input is what is left to feed
+//   compress__end(consumed, output, remaining)
+//   write__start(bytes, offset)         around the write of an output buffer
+//   write__end(bytes)
+//   frame__end(compressed, uncompressed)
+//   ack(lines, latency_us)              OKs written to stdout, latency counted from the read of the oldest of their lines
+//   rotate__start(bytes, input)         the file being rotated away from
+//   rotate__end(duration_us)
+// they need <sys/sdt.h> (systemtap-sdt-dev) at build time and compile to nothing without it or with -DNO_PROBES
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE(...) STAP_PROBEV(omzstd, __VA_ARGS__)
+#endif
+#endif
+#ifndef PROBE
+#define PROBE(...) \
+    do             \
+    {              \
+    } while (0)
+#endif
+
 #define LOG(...) _log_impl(__FILE__, __LINE__, __func__, __VA_ARGS__)
 
 static pid_t myPid = 0;
@@ -49,319 +97,9605 @@ static inline bool stdin_is_closed()
 
 ////////////////////////////////////////////////////////////////////////
 
-typedef struct stream_t_
+typedef struct config_t_
 {
-    size_t inputBufferSize;
-    char *inputBuffer;
+    // speak the omprog transaction protocol (rsyslog: useTransactions="on")
+    bool transactions;
+    const char *beginMark;
+    size_t beginMarkLen;
+    const char *commitMark;
+    size_t commitMarkLen;
 
-    size_t outputBufferSize;
-    char *outputBuffer;
+    // rotate once the current file reaches this many compressed bytes or milliseconds, 0 = never
+    size_t rotateSize;
+    uint64_t rotateInterval;
 
-    ZSTD_CCtx *zctx;
-    ZSTD_inBuffer zInBuf;
-    ZSTD_outBuffer zOutBuf;
+    // flush zstd once unflushed input gets this many milliseconds old, 0 = only at frame ends
+    uint64_t maxFlushLatency;
 
-    FILE *outFile;
-    const char *outFileName;
-} stream_t;
+    // --checkpoint-interval: end the frame once it has been open this many milliseconds, so after a crash the file
+    // decodes cleanly up to the last frame end and `omzstd recover` only has to cut off the rest. 0 = never
+    uint64_t checkpointInterval;
 
-static stream_t stream = {
-    .inputBufferSize = 1024 * 1024 * 8,
-    .inputBuffer = NULL,
-    .outputBufferSize = 1024 * 1024 * 8,
-    .outputBuffer = NULL,
-    .zctx = NULL,
-    .zInBuf = {
-        .src = NULL,
-        .size = 0,
-        .pos = 0},
-    .zOutBuf = {.dst = NULL, .size = 0, .pos = 0},
-    .outFile = NULL,
-    .outFileName = NULL};
+    // end a frame and record it in a seek table every this many uncompressed bytes, 0 = one frame per file
+    size_t seekableFrameSize;
+    // --accumulate: frames are gathered in a stage of this size and only then handed to zstd, which reads them in
+    // place instead of copying them into a window of its own. 0 = lines go to zstd as they come
+    size_t accumulate;
+
+    // poll timeout for idle stdin, 0 = block in read()
+    int tickMs;
+
+    // --preallocate: reserve the expected size of every file up front, given back on close
+    bool preallocate;
+    // --drop-cache: written output is pushed out of the page cache instead of crowding out other data
+    bool dropCache;
+    // --mmap: zstd compresses straight into a shared mapping of the output file instead of a buffer that is copied
+    // by fwrite. the file is extended a window ahead, so a crash can leave zeroes behind the last frame
+    bool mmap;
+    // --shards: input blocks are dealt out round robin to this many compressor threads, each with its own context.
+    // every one writes a file of its own, or with --shard-output interleaved whole frames into the same one
+    size_t shards;
+    bool interleaved;
+    // --transform: lines are coded before zstd sees them, see transform_encode. such files are read with
+    // `omzstd cat` or `omzstd grep`
+    bool transform;
+    // --part: files are written as FINAL.part, opened ahead of the rotation that needs them and renamed once durable
+    bool part;
+
+    // THREADS and LEVEL, every stream is set up with them. --adaptive moves the level at runtime
+    int workers;
+    int level;
+} config_t;
+
+static config_t config = {
+    .transactions = false,
+    .beginMark = "BEGIN TRANSACTION",
+    .beginMarkLen = sizeof("BEGIN TRANSACTION") - 1,
+    .commitMark = "COMMIT TRANSACTION",
+    .commitMarkLen = sizeof("COMMIT TRANSACTION") - 1,
+    .rotateSize = 0,
+    .rotateInterval = 0,
+    .maxFlushLatency = 0,
+    .checkpointInterval = 0,
+    .seekableFrameSize = 0,
+    .accumulate = 0,
+    .tickMs = 0,
+    .preallocate = false,
+    .dropCache = false,
+    .mmap = false,
+    .shards = 1,
+    .interleaved = false,
+    .transform = false,
+    .part = false,
+    .workers = 1,
+    .level = 3};
 
-static inline int flush_zstd()
+static inline uint64_t now_ms()
 {
-    const ZSTD_EndDirective mode = ZSTD_e_end;
-    ZSTD_inBuffer input = {"", 0, 0};
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec) * 1000 + (uint64_t)(ts.tv_nsec) / 1000000;
+}
 
-    size_t remaining = 0;
-    do
+static inline uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec) * 1000000 + (uint64_t)(ts.tv_nsec) / 1000;
+}
+
+// parses a byte count with an optional K, M or G suffix (powers of 1024)
+static inline int parse_size(const char *arg, size_t *out)
+{
+    char *end = NULL;
+    errno = 0;
+    const unsigned long long value = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg || arg[0] == '-')
     {
-        remaining = ZSTD_compressStream2(stream.zctx, &stream.zOutBuf, &input, mode);
-        if (ZSTD_isError(remaining))
-        {
-            LOG("error flushing ZSTD buffer: %s", ZSTD_getErrorName(remaining));
-            return -1;
-        }
-        // TODO: add an upper limit of how often we try to flush
-    } while (remaining != 0);
+        return -1;
+    }
 
-    if (stream.zOutBuf.pos != fwrite(stream.outputBuffer, 1, stream.zOutBuf.pos, stream.outFile))
+    unsigned shift = 0;
+    switch (*end)
+    {
+    case '\0':
+        break;
+    case 'k':
+    case 'K':
+        shift = 10;
+        break;
+    case 'm':
+    case 'M':
+        shift = 20;
+        break;
+    case 'g':
+    case 'G':
+        shift = 30;
+        break;
+    default:
+        return -1;
+    }
+
+    if (shift != 0 && end[1] != '\0')
+    {
+        return -1;
+    }
+
+    if (value > (SIZE_MAX >> shift))
+    {
+        return -1;
+    }
+
+    *out = (size_t)(value << shift);
+    return 0;
+}
+
+// parses a duration in milliseconds, plain numbers are seconds, ms, s, m, h and d are accepted as suffixes
+static inline int parse_duration(const char *arg, uint64_t *out)
+{
+    char *end = NULL;
+    errno = 0;
+    const unsigned long long value = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg || arg[0] == '-')
+    {
+        return -1;
+    }
+
+    uint64_t unit = 0;
+    if (strcmp(end, "ms") == 0)
+    {
+        unit = 1;
+    }
+    else if (strcmp(end, "") == 0 || strcmp(end, "s") == 0)
+    {
+        unit = 1000;
+    }
+    else if (strcmp(end, "m") == 0)
+    {
+        unit = 60 * 1000;
+    }
+    else if (strcmp(end, "h") == 0)
+    {
+        unit = 60 * 60 * 1000;
+    }
+    else if (strcmp(end, "d") == 0)
+    {
+        unit = 24 * 60 * 60 * 1000;
+    }
+    else
     {
-        LOG("error writing compressed buffer to file, exiting");
         return -1;
     }
 
+    if (value > UINT64_MAX / unit)
+    {
+        return -1;
+    }
+
+    *out = value * unit;
     return 0;
 }
 
-static inline int reopen_file()
+// compares a line read from stdin (including its newline) against a transaction mark
+static inline bool is_mark(const char *line, size_t len, const char *mark, size_t markLen)
+{
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+    {
+        len--;
+    }
+
+    return len == markLen && memcmp(line, mark, markLen) == 0;
+}
+
+// finds the start of field n (1-based) of a line. with ' ' as delimiter runs of spaces are collapsed like awk does,
+// other delimiters separate (possibly empty) fields one by one
+static inline const char *find_field(const char *line, size_t len, size_t n, char delimiter)
 {
-    if (stream.outFile != NULL)
+    const char *end = line + len;
+    const char *field = line;
+    for (size_t i = 1;; i++)
     {
-        const int fn = fileno(stream.outFile);
-        if (fn == -1)
+        while (delimiter == ' ' && field < end && *field == ' ')
         {
-            LOG("error getting file number for output file: %s", strerror(errno));
-            return -1;
+            field++;
         }
-        else
+        if (i == n)
         {
-            if (fsync(fn) == -1)
-            {
-                LOG("error syncing output file to disk: %s", strerror(errno));
-                return -1;
-            }
+            return field;
         }
-
-        if (fclose(stream.outFile) != 0)
+        const char *next = (const char *)memchr(field, delimiter, (size_t)(end - field));
+        if (next == NULL)
         {
-            LOG("error closing output file: %s", strerror(errno));
-            return -1;
+            return NULL;
         }
+        field = next + 1;
+    }
+}
 
-        stream.outFile = NULL;
+////////////////////////////////////////////////////////////////////////
 
-        char outFileFullName[2048] = {0};
-        snprintf(outFileFullName, 2048, "%s.%d.%lu", stream.outFileName, myPid, (unsigned long)time(NULL));
+// bucket i counts observations below 2^i microseconds, the last one everything above ~4s
+#define HISTOGRAM_BUCKETS 24
 
-        stream.outFile = fopen(outFileFullName, "wb");
-        if (stream.outFile == NULL)
-        {
-            LOG("error reopening file: %s", strerror(errno));
-            return -1;
-        }
+typedef struct histogram_t_
+{
+    _Atomic uint64_t buckets[HISTOGRAM_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+} histogram_t;
 
-        return 0;
+// every thread only adds to its own counters, so relaxed atomics are all the synchronization needed
+typedef struct stats_t_
+{
+    uint64_t startedAt;
+
+    // reader
+    _Atomic uint64_t lines;
+    _Atomic uint64_t inputBytes;
+    histogram_t ackLatency;
+
+    // compressor
+    _Atomic uint64_t compressedBytes;
+    _Atomic uint64_t rotations;
+    // --part rotations that had to open their file themselves because the pre-opened one was not ready
+    _Atomic uint64_t unpreparedRotations;
+    // frames ended by --checkpoint-interval
+    _Atomic uint64_t checkpoints;
+    _Atomic int level;
+    _Atomic size_t routes;
+    // with --stats-socket only, timing every call is not free
+    histogram_t compressTime;
+    histogram_t rotationTime;
+    // zstd's progression of the frames in progress, summed over all streams. printing the stats asks for it, the
+    // thread compressing reads it at its next block
+    _Atomic bool progressWanted;
+    _Atomic uint64_t zstdIngested;
+    _Atomic uint64_t zstdConsumed;
+    _Atomic uint64_t zstdProduced;
+    _Atomic uint64_t zstdFlushed;
+    _Atomic unsigned zstdActiveWorkers;
+    // --memory-limit: zstd allocations that did not fit the arena of their stream and went to malloc
+    _Atomic uint64_t arenaOverflows;
+
+    // I/O
+    _Atomic uint64_t writtenBytes;
+    histogram_t writeTime;
+    histogram_t syncTime;
+    // --sink: compressed bytes that reached it, and object parts uploaded
+    _Atomic uint64_t sinkBytes;
+    _Atomic uint64_t sinkParts;
+
+    // --stats-socket
+    const char *socketPath;
+    int socketFd;
+    pthread_t thread;
+    bool running;
+} stats_t;
+
+static stats_t stats = {
+    .startedAt = 0,
+    .socketPath = NULL,
+    .socketFd = -1,
+    .running = false};
+
+static inline void stats_add(_Atomic uint64_t *counter, uint64_t value)
+{
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+// records n observations of us microseconds
+static inline void observe(histogram_t *histogram, uint64_t us, uint64_t n)
+{
+    size_t bucket = us == 0 ? 0 : (size_t)(64 - __builtin_clzll(us));
+    bucket = bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+    stats_add(&histogram->buckets[bucket], n);
+    stats_add(&histogram->count, n);
+    stats_add(&histogram->sum, us * n);
+}
+
+static inline void print_histogram(FILE *out, const char *name, const char *help, histogram_t *histogram)
+{
+    fprintf(out, "# HELP omzstd_%s %s\n# TYPE omzstd_%s histogram\n", name, help, name);
+
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS - 1; i++)
+    {
+        cumulative += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        fprintf(out, "omzstd_%s_bucket{le=\"%g\"} %lu\n", name, (double)(1ull << i) / 1e6, (unsigned long)(cumulative));
     }
+    cumulative += atomic_load_explicit(&histogram->buckets[HISTOGRAM_BUCKETS - 1], memory_order_relaxed);
+    fprintf(out, "omzstd_%s_bucket{le=\"+Inf\"} %lu\n", name, (unsigned long)(cumulative));
+    fprintf(out, "omzstd_%s_sum %.6f\n", name, (double)(atomic_load_explicit(&histogram->sum, memory_order_relaxed)) / 1e6);
+    fprintf(out, "omzstd_%s_count %lu\n", name, (unsigned long)(atomic_load_explicit(&histogram->count, memory_order_relaxed)));
+}
 
-    return -1;
+static inline void print_value(FILE *out, const char *name, const char *type, const char *help, double value)
+{
+    fprintf(out, "# HELP omzstd_%s %s\n# TYPE omzstd_%s %s\nomzstd_%s %.15g\n", name, help, name, type, name, value);
+}
+
+// writes all statistics in the Prometheus text format
+static inline void print_stats(FILE *out)
+{
+    atomic_store_explicit(&stats.progressWanted, true, memory_order_relaxed);
+
+    const double uptime = (double)(now_ms() - stats.startedAt) / 1000;
+    const double lines = (double)(atomic_load_explicit(&stats.lines, memory_order_relaxed));
+    const double input = (double)(atomic_load_explicit(&stats.inputBytes, memory_order_relaxed));
+    const double compressed = (double)(atomic_load_explicit(&stats.compressedBytes, memory_order_relaxed));
+
+    print_value(out, "uptime_seconds", "gauge", "Seconds since start.", uptime);
+    print_value(out, "lines_total", "counter", "Lines received.", lines);
+    print_value(out, "lines_per_second", "gauge", "Lines received per second since start.", uptime > 0 ? lines / uptime : 0);
+    print_value(out, "input_bytes_total", "counter", "Uncompressed bytes received.", input);
+    print_value(out, "output_bytes_total", "counter", "Compressed bytes produced.", compressed);
+    print_value(out, "written_bytes_total", "counter", "Compressed bytes written to files.",
+                (double)(atomic_load_explicit(&stats.writtenBytes, memory_order_relaxed)));
+    print_value(out, "sink_bytes_total", "counter", "Compressed bytes delivered to the output sink.",
+                (double)(atomic_load_explicit(&stats.sinkBytes, memory_order_relaxed)));
+    print_value(out, "sink_parts_total", "counter", "Parts uploaded to the object sink.",
+                (double)(atomic_load_explicit(&stats.sinkParts, memory_order_relaxed)));
+    print_value(out, "compression_ratio", "gauge", "Input bytes per output byte.", compressed > 0 ? input / compressed : 0);
+    print_value(out, "compression_level", "gauge", "Live compression level.", atomic_load_explicit(&stats.level, memory_order_relaxed));
+    print_value(out, "routes", "gauge", "Open output streams.", (double)(atomic_load_explicit(&stats.routes, memory_order_relaxed)));
+    print_value(out, "rotations_total", "counter", "Files rotated.", (double)(atomic_load_explicit(&stats.rotations, memory_order_relaxed)));
+    print_value(out, "unprepared_rotations_total", "counter", "Rotations that opened their next file inline.",
+                (double)(atomic_load_explicit(&stats.unpreparedRotations, memory_order_relaxed)));
+    print_value(out, "checkpoints_total", "counter", "Frames ended by the checkpoint interval.",
+                (double)(atomic_load_explicit(&stats.checkpoints, memory_order_relaxed)));
+    print_value(out, "zstd_ingested_bytes", "gauge", "Input zstd took in for the frames in progress.",
+                (double)(atomic_load_explicit(&stats.zstdIngested, memory_order_relaxed)));
+    print_value(out, "zstd_consumed_bytes", "gauge", "Input zstd compressed for the frames in progress.",
+                (double)(atomic_load_explicit(&stats.zstdConsumed, memory_order_relaxed)));
+    print_value(out, "zstd_produced_bytes", "gauge", "Output zstd produced for the frames in progress.",
+                (double)(atomic_load_explicit(&stats.zstdProduced, memory_order_relaxed)));
+    print_value(out, "zstd_flushed_bytes", "gauge", "Output zstd flushed for the frames in progress.",
+                (double)(atomic_load_explicit(&stats.zstdFlushed, memory_order_relaxed)));
+    print_value(out, "zstd_active_workers", "gauge", "zstd workers with a job.",
+                atomic_load_explicit(&stats.zstdActiveWorkers, memory_order_relaxed));
+    print_value(out, "arena_overflows_total", "counter", "zstd allocations that did not fit the memory limit.",
+                (double)(atomic_load_explicit(&stats.arenaOverflows, memory_order_relaxed)));
+    print_histogram(out, "ack_latency_seconds", "Time from reading a line to acknowledging it.", &stats.ackLatency);
+    print_histogram(out, "compress_seconds", "Time spent in ZSTD_compressStream2, with --stats-socket.", &stats.compressTime);
+    print_histogram(out, "write_seconds", "Time spent writing output files.", &stats.writeTime);
+    print_histogram(out, "sync_seconds", "Time spent in fdatasync and fsync.", &stats.syncTime);
+    print_histogram(out, "rotation_seconds", "Time spent rotating a file.", &stats.rotationTime);
 }
 
-void handle_signal(int signum)
+// SIGUSR1
+static inline void dump_stats()
 {
-    if (signum == SIGHUP)
+    LOG("statistics:");
+    print_stats(stderr);
+    fflush(stderr);
+}
+
+// answers every connection with the statistics, as an HTTP response so Prometheus can scrape it directly
+static void *stats_main(void *arg)
+{
+    (void)arg;
+
+    while (1)
     {
-        if (flush_zstd() != 0)
+        const int fd = accept4(stats.socketFd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1)
         {
-            // we can't flush zstd, exiting
-            LOG("can not flush ZSTD buffer, exiting");
-            exit(1);
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            // the listening socket was shut down
+            break;
         }
-        if (reopen_file() != 0)
+
+        // the request does not matter, it is only drained so the client sees a clean response
+        char request[4096];
+        struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+        if (poll(&pfd, 1, 100) == 1)
         {
-            // we can't reopen the file for writing, exiting
-            LOG("can not reopen file, exiting");
-            exit(1);
+            ssize_t unused = read(fd, request, sizeof request);
+            (void)unused;
+        }
+
+        char *body = NULL;
+        size_t bodyLen = 0;
+        FILE *out = open_memstream(&body, &bodyLen);
+        if (out != NULL)
+        {
+            fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+            print_stats(out);
+            fclose(out);
+
+            for (size_t done = 0; done < bodyLen;)
+            {
+                const ssize_t ret = send(fd, body + done, bodyLen - done, MSG_NOSIGNAL);
+                if (ret == -1 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (ret <= 0)
+                {
+                    break;
+                }
+                done += (size_t)(ret);
+            }
+            free(body);
         }
+
+        close(fd);
     }
+
+    return NULL;
 }
 
-int main(int argc, char **argv)
+static inline int stats_start()
 {
-    myPid = getpid();
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(stats.socketPath) >= sizeof addr.sun_path)
+    {
+        LOG("stats socket path too long ('%s')", stats.socketPath);
+        return -1;
+    }
+    strcpy(addr.sun_path, stats.socketPath);
 
-    if (argc != 4)
+    // a socket left behind by an earlier run is replaced, anything else is not touched
+    struct stat st;
+    if (lstat(stats.socketPath, &st) == 0 && S_ISSOCK(st.st_mode))
     {
-        LOG("usage: omzstd THREADS LEVEL PATH_PREFIX");
-        exit(1);
+        unlink(stats.socketPath);
     }
 
-    const long workers = strtol(argv[1], NULL, 10);
-    if (workers < 1)
+    stats.socketFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (stats.socketFd == -1 || bind(stats.socketFd, (const struct sockaddr *)&addr, sizeof addr) != 0 ||
+        listen(stats.socketFd, 16) != 0)
     {
-        LOG("invalid threads count");
-        exit(1);
+        LOG("error listening on stats socket ('%s'): %s", stats.socketPath, strerror(errno));
+        return -1;
     }
 
-    const long level = strtol(argv[2], NULL, 10);
-    if (level < 1)
+    const int err = pthread_create(&stats.thread, NULL, stats_main, NULL);
+    if (err != 0)
     {
-        LOG("invalid compression level (1-19, default: 3)");
-        exit(1);
+        LOG("error creating stats thread: %s", strerror(err));
+        return -1;
     }
+    stats.running = true;
 
-    stream.outFileName = argv[3];
+    return 0;
+}
 
-    stream.inputBuffer = (char *)malloc(stream.inputBufferSize);
-    if (stream.inputBuffer == NULL)
+static inline void stats_stop()
+{
+    if (stats.running)
     {
-        LOG("error allocating input buffer");
-        exit(1);
+        // wakes up accept()
+        shutdown(stats.socketFd, SHUT_RDWR);
+        pthread_join(stats.thread, NULL);
+        stats.running = false;
     }
 
-    stream.outputBuffer = (char *)malloc(stream.outputBufferSize);
-    if (stream.outputBuffer == NULL)
+    if (stats.socketFd != -1)
     {
-        LOG("error allocating output buffer");
-        exit(1);
+        close(stats.socketFd);
+        stats.socketFd = -1;
+        unlink(stats.socketPath);
     }
+}
+
+////////////////////////////////////////////////////////////////////////
+
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+enum
+{
+    HUGE_PAGES_NONE = 0,
+    // MADV_HUGEPAGE, khugepaged backs the buffers with huge pages when it can
+    HUGE_PAGES_TRANSPARENT,
+    // MAP_HUGETLB from the reserved pool, falls back to transparent ones once the pool is empty
+    HUGE_PAGES_EXPLICIT
+};
 
-    stream.zctx = ZSTD_createCCtx();
-    if (stream.zctx == NULL)
+typedef struct memory_t_
+{
+    // --memory-limit: budget of one stream, its buffers included. zstd parameters are chosen to fit it and zstd
+    // allocates from a preallocated arena of what the buffers leave over. 0 = no limit
+    size_t limit;
+    size_t arenaSize;
+
+    // --huge-pages: where input, output and arena memory comes from
+    int hugePages;
+    bool hugeFallback;
+} memory_t;
+
+static memory_t memory = {
+    .limit = 0,
+    .arenaSize = 0,
+    .hugePages = HUGE_PAGES_NONE,
+    .hugeFallback = false};
+
+// large buffers, released with big_free and the same size
+static inline void *big_alloc(size_t size)
+{
+    if (memory.hugePages == HUGE_PAGES_NONE)
     {
-        LOG("error creating ZSTD context");
-        exit(1);
+        return malloc(size);
     }
 
+    const size_t length = (size + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+    void *p = MAP_FAILED;
+    if (memory.hugePages == HUGE_PAGES_EXPLICIT)
     {
-        size_t const err = ZSTD_CCtx_setParameter(stream.zctx, ZSTD_c_compressionLevel, (int)(level));
-        if (UNLIKELY(ZSTD_isError(err)))
+        p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED && !memory.hugeFallback)
         {
-            LOG("error setting compression level %d: %s", level, ZSTD_getErrorName(err));
-            exit(1);
+            LOG("error allocating explicit huge pages, using transparent ones: %s", strerror(errno));
+            memory.hugeFallback = true;
         }
     }
 
+    if (p == MAP_FAILED)
     {
-        size_t const err = ZSTD_CCtx_setParameter(stream.zctx, ZSTD_c_checksumFlag, 1);
-        if (UNLIKELY(ZSTD_isError(err)))
+        p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
         {
-            LOG("error enabling ZSTD checksumming: %s", ZSTD_getErrorName(err));
-            exit(1);
+            return NULL;
         }
-    }
-
-    if (workers != 1)
-    {
-        size_t const err = ZSTD_CCtx_setParameter(stream.zctx, ZSTD_c_nbWorkers, (int)(workers));
-        if (UNLIKELY(ZSTD_isError(err)))
+        if (madvise(p, length, MADV_HUGEPAGE) != 0 && !memory.hugeFallback)
         {
-            LOG("error settings threads to %d: %s", workers, ZSTD_getErrorName(err));
-            exit(1);
+            LOG("error enabling transparent huge pages: %s", strerror(errno));
+            memory.hugeFallback = true;
         }
     }
 
-    char outFileFullName[2048] = {0};
-    snprintf(outFileFullName, 2048, "%s.%d.%lu", stream.outFileName, myPid, (unsigned long)time(NULL));
+    return p;
+}
 
-    stream.outFile = fopen(outFileFullName, "wb");
-    if (stream.outFile == NULL)
+static inline void big_free(void *p, size_t size)
+{
+    if (memory.hugePages == HUGE_PAGES_NONE)
     {
-        LOG("error opening output file ('%s'): %s", stream.outFileName, strerror(errno));
-        exit(1);
+        free(p);
     }
-
-    signal(SIGHUP, handle_signal);
-
-    if (write(STDOUT_FILENO, "OK\n", 3) == -1)
+    else if (p != NULL)
     {
-        LOG("error writing initial OK");
-        exit(1);
+        munmap(p, (size + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE);
     }
+}
 
-    while (1)
-    {
-        const ssize_t lret = getline(&stream.inputBuffer, &stream.inputBufferSize, stdin);
-        if (UNLIKELY(lret < 1))
-        {
-            if (errno == 0)
-            {
-                LOG("stdin closed, exiting");
-                goto flush;
-            }
-            LOG("error in getline: %d %d %s", lret, errno, strerror(errno));
-            break;
-        }
-
-        stream.zInBuf.src = stream.inputBuffer;
-        stream.zInBuf.size = (size_t)(lret);
-        stream.zInBuf.pos = 0;
+// first-fit allocator for zstd (ZSTD_customMem) over one preallocated region. zstd keeps its workspaces for the
+// life of a context, so there are few calls, but worker threads make them too
+typedef struct arena_block_t_
+{
+    // including this header, which keeps the memory after it 16 byte aligned
+    size_t size;
+    struct arena_block_t_ *next;
+} arena_block_t;
 
-        stream.zOutBuf.dst = stream.outputBuffer;
-        stream.zOutBuf.size = stream.outputBufferSize;
-        stream.zOutBuf.pos = 0;
+typedef struct arena_t_
+{
+    pthread_mutex_t lock;
+    char *base;
+    size_t size;
+    size_t allocated;
+    // sorted by address so neighbours can be merged
+    arena_block_t *free;
+    bool overflowed;
+} arena_t;
 
-        size_t remaining = 0;
-        do
-        {
-            remaining = ZSTD_compressStream2(stream.zctx, &stream.zOutBuf, &stream.zInBuf, ZSTD_e_continue);
-            if (ZSTD_isError(remaining))
-            {
-                LOG("error flushing ZSTD buffer: %s", ZSTD_getErrorName(remaining));
-                goto flush;
-            }
+#define ARENA_ALIGN 16
 
-            // debug
-            // LOG("remaining: %d, pos: %d, size: %d", remaining, stream.zInBuf.pos, stream.zInBuf.size);
+static void *arena_alloc(void *opaque, size_t size)
+{
+    arena_t *arena = (arena_t *)opaque;
+    const size_t need = (size + sizeof(arena_block_t) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
 
-        } while (stream.zInBuf.pos != stream.zInBuf.size);
+    pthread_mutex_lock(&arena->lock);
+    arena_block_t **link = &arena->free;
+    while (*link != NULL && (*link)->size < need)
+    {
+        link = &(*link)->next;
+    }
 
-        if (UNLIKELY(stream.zOutBuf.pos > stream.outputBufferSize))
+    arena_block_t *block = *link;
+    if (block != NULL)
+    {
+        if (block->size - need >= 4 * ARENA_ALIGN)
         {
-            LOG("buffer overflow detected");
-            goto flush;
+            arena_block_t *rest = (arena_block_t *)((char *)block + need);
+            rest->size = block->size - need;
+            rest->next = block->next;
+            *link = rest;
+            block->size = need;
         }
-
-        //debug
-        // LOG("OUT, pos: %d, size: %d", stream.zOutBuf.pos, stream.zOutBuf.size);
-
-        if (stream.zOutBuf.pos != fwrite(stream.outputBuffer, 1, stream.zOutBuf.pos, stream.outFile))
+        else
         {
-            LOG("error writing compressed buffer to file, exiting");
-            goto flush;
+            *link = block->next;
         }
+    }
+    const bool overflowed = block == NULL && !arena->overflowed;
+    arena->overflowed = arena->overflowed || block == NULL;
+    pthread_mutex_unlock(&arena->lock);
 
-        if (write(STDOUT_FILENO, "OK\n", 3) == -1)
-        {
-            LOG("error writing initial OK");
-            goto flush;
-        }
+    if (block != NULL)
+    {
+        return (char *)block + sizeof(arena_block_t);
     }
 
-flush:
-    if (flush_zstd() != 0)
+    // not fatal, the stream just uses more than it was given
+    if (overflowed)
     {
-        LOG("can not flush ZSTD buffer");
+        LOG("zstd needs more memory than --memory-limit left for it, using malloc");
     }
-cleanup:
+    stats_add(&stats.arenaOverflows, 1);
+    return malloc(size);
+}
 
-    if (stream.outFile != NULL)
+static void arena_free(void *opaque, void *address)
+{
+    arena_t *arena = (arena_t *)opaque;
+    char *p = (char *)address;
+    if (p == NULL)
     {
-        const int fn = fileno(stream.outFile);
-        if (fn == -1)
-        {
-            LOG("error getting file number for output file (%s): %s", stream.outFileName, strerror(errno));
-        }
-        else
-        {
-            if (fsync(fn) == -1)
-            {
-                LOG("error syncing output file to disk: %s", strerror(errno));
-            }
-        }
+        return;
+    }
+    if (p < arena->base || p >= arena->base + arena->size)
+    {
+        free(p);
+        return;
+    }
 
-        if (fclose(stream.outFile) != 0)
-        {
-            LOG("error closing output file (%s): %s", stream.outFileName, strerror(errno));
-        }
+    arena_block_t *block = (arena_block_t *)(p - sizeof(arena_block_t));
+
+    pthread_mutex_lock(&arena->lock);
+    arena_block_t *prev = NULL;
+    arena_block_t *next = arena->free;
+    while (next != NULL && next < block)
+    {
+        prev = next;
+        next = next->next;
+    }
 
-        stream.outFile = NULL;
+    block->next = next;
+    if (next != NULL && (char *)block + block->size == (char *)next)
+    {
+        block->size += next->size;
+        block->next = next->next;
+    }
+    if (prev != NULL && (char *)prev + prev->size == (char *)block)
+    {
+        prev->size += block->size;
+        prev->next = block->next;
+    }
+    else if (prev != NULL)
+    {
+        prev->next = block;
+    }
+    else
+    {
+        arena->free = block;
     }
+    pthread_mutex_unlock(&arena->lock);
+}
 
-    if (stream.inputBuffer != NULL)
+static inline arena_t *arena_create(size_t size)
+{
+    arena_t *arena = (arena_t *)calloc(1, sizeof(arena_t));
+    if (arena == NULL || (arena->base = (char *)big_alloc(size)) == NULL)
     {
-        free(stream.inputBuffer);
-        stream.inputBuffer = NULL;
-        stream.inputBufferSize = 0;
+        LOG("error allocating %zu bytes for the zstd arena", size);
+        free(arena);
+        return NULL;
     }
 
-    if (stream.outputBuffer != NULL)
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->allocated = size;
+    arena->size = size / ARENA_ALIGN * ARENA_ALIGN;
+    arena->free = (arena_block_t *)arena->base;
+    arena->free->size = arena->size;
+    arena->free->next = NULL;
+    arena->overflowed = false;
+    return arena;
+}
+
+static inline void arena_destroy(arena_t *arena)
+{
+    if (arena == NULL)
     {
-        free(stream.outputBuffer);
-        stream.outputBuffer = NULL;
-        stream.outputBufferSize = 0;
+        return;
     }
 
+    big_free(arena->base, arena->allocated);
+    pthread_mutex_destroy(&arena->lock);
+    free(arena);
+}
+
+// lock-free single-producer/single-consumer ring, the consumer only sleeps when it runs dry
+typedef struct ring_t_
+{
+    _Alignas(64) _Atomic size_t head;
+    _Alignas(64) _Atomic size_t tail;
+    _Alignas(64) _Atomic bool sleeping;
+    sem_t wakeup;
+
+    // power of two
+    size_t capacity;
+    void **slots;
+} ring_t;
+
+static inline int ring_init(ring_t *ring, size_t capacity)
+{
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->sleeping, false);
+    ring->capacity = capacity;
+
+    ring->slots = (void **)calloc(capacity, sizeof(void *));
+    if (ring->slots == NULL || sem_init(&ring->wakeup, 0, 0) != 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+// only meaningful on the consumer side
+static inline bool ring_empty(ring_t *ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_relaxed) == atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+// items waiting, only meaningful on the consumer side
+static inline size_t ring_count(ring_t *ring)
+{
+    return atomic_load_explicit(&ring->tail, memory_order_acquire) - atomic_load_explicit(&ring->head, memory_order_relaxed);
+}
+
+static inline void ring_destroy(ring_t *ring)
+{
+    sem_destroy(&ring->wakeup);
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+static inline size_t ring_capacity_for(size_t count)
+{
+    size_t capacity = 1;
+    while (capacity < count)
+    {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+// never blocks, rings are sized to hold every item that can be in flight
+static inline void ring_push(ring_t *ring, void *item)
+{
+    const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ring->slots[tail & (ring->capacity - 1)] = item;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    if (atomic_exchange(&ring->sleeping, false))
+    {
+        sem_post(&ring->wakeup);
+    }
+}
+
+static inline void *ring_pop(ring_t *ring)
+{
+    const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    while (head == atomic_load_explicit(&ring->tail, memory_order_acquire))
+    {
+        atomic_store(&ring->sleeping, true);
+        if (head != atomic_load(&ring->tail))
+        {
+            atomic_store(&ring->sleeping, false);
+            break;
+        }
+        // a left over post only costs us another round through the loop
+        while (sem_wait(&ring->wakeup) != 0 && errno == EINTR)
+        {
+        }
+    }
+
+    void *item = ring->slots[head & (ring->capacity - 1)];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return item;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+// --reader-cpus, --compressor-cpus, --writer-cpus: threads run on these CPUs, an empty set leaves them to the
+// scheduler. a thread starts out on the set of the one creating it, which is how the zstd workers and the helper
+// threads end up next to whoever started them. buffers are placed by the kernel on the node of the first thread
+// touching them, so the input lands with the reader and the output and zstd's tables with the compressor
+typedef struct affinity_t_
+{
+    // the main thread, it also compresses without --pipeline and then runs on the compressor CPUs if given
+    cpu_set_t reader;
+    // --pipeline lanes, and the zstd workers of every stream
+    cpu_set_t compressor;
+    cpu_set_t writer;
+
+    // --numa-node: memory is taken from this node while it has some, and threads without CPUs of their own run on
+    // the CPUs of the node. -1 = anywhere
+    int node;
+} affinity_t;
+
+static affinity_t affinity = {
+    .node = -1};
+
+// parses a CPU list like 0-3,8,10-11, the format of /sys/devices/system/node/node*/cpulist
+static inline int parse_cpus(const char *arg, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *p = arg;
+    while (*p != '\0' && *p != '\n')
+    {
+        char *end = NULL;
+        errno = 0;
+        const unsigned long first = strtoul(p, &end, 10);
+        unsigned long last = first;
+        if (errno != 0 || end == p || *p == '-')
+        {
+            return -1;
+        }
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if (errno != 0 || end == p || *p == '-' || last < first)
+            {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE)
+        {
+            return -1;
+        }
+
+        for (unsigned long cpu = first; cpu <= last; cpu++)
+        {
+            CPU_SET(cpu, set);
+        }
+
+        if (*end == ',')
+        {
+            end++;
+        }
+        else if (*end != '\0' && *end != '\n')
+        {
+            return -1;
+        }
+        p = end;
+    }
+
+    return 0;
+}
+
+// the CPUs of a NUMA node, none for a node with memory only
+static inline int node_cpus(int node, cpu_set_t *set)
+{
+    char path[64];
+    snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        LOG("error opening the CPU list of NUMA node %d ('%s'): %s", node, path, strerror(errno));
+        return -1;
+    }
+
+    char list[4096];
+    const bool ok = fgets(list, sizeof list, file) != NULL && parse_cpus(list, set) == 0;
+    fclose(file);
+    if (!ok)
+    {
+        LOG("error reading the CPU list of NUMA node %d", node);
+        return -1;
+    }
+
+    return 0;
+}
+
+// called on the main thread before any other thread is started or buffer allocated, everything inherits from it
+static inline int affinity_init(bool pipelined)
+{
+    if (affinity.node >= 0)
+    {
+        cpu_set_t cpus;
+        if (node_cpus(affinity.node, &cpus) != 0)
+        {
+            return -1;
+        }
+
+        // the kernel drops the highest bit of maxnode
+        const unsigned long nodes = 1ul << affinity.node;
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodes, 8 * sizeof nodes + 1) != 0)
+        {
+            LOG("error preferring memory of NUMA node %d: %s", affinity.node, strerror(errno));
+            return -1;
+        }
+
+        cpu_set_t *sets[] = {&affinity.reader, &affinity.compressor, &affinity.writer};
+        for (size_t i = 0; i < sizeof sets / sizeof sets[0]; i++)
+        {
+            if (CPU_COUNT(sets[i]) == 0)
+            {
+                *sets[i] = cpus;
+            }
+        }
+    }
+
+    const cpu_set_t *own = !pipelined && CPU_COUNT(&affinity.compressor) > 0 ? &affinity.compressor : &affinity.reader;
+    if (CPU_COUNT(own) > 0)
+    {
+        const int err = pthread_setaffinity_np(pthread_self(), sizeof *own, own);
+        if (err != 0)
+        {
+            LOG("error pinning the main thread: %s", strerror(err));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// starts a thread that runs on set from its first instruction
+static inline int start_thread(pthread_t *thread, const cpu_set_t *set, void *(*run)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    int err = pthread_attr_init(&attr);
+    if (err != 0)
+    {
+        return err;
+    }
+
+    if (CPU_COUNT(set) > 0)
+    {
+        err = pthread_attr_setaffinity_np(&attr, sizeof *set, set);
+    }
+    if (err == 0)
+    {
+        err = pthread_create(thread, &attr, run, arg);
+    }
+    pthread_attr_destroy(&attr);
+    return err;
+}
+
+// a zstd worker pool on the compressor CPUs: its threads are started right away by the calling thread, which
+// lends them its set for the moment
+static inline ZSTD_threadPool *create_pool(size_t workers)
+{
+    if (CPU_COUNT(&affinity.compressor) == 0)
+    {
+        return ZSTD_createThreadPool(workers);
+    }
+
+    cpu_set_t own;
+    int err = pthread_getaffinity_np(pthread_self(), sizeof own, &own);
+    if (err == 0)
+    {
+        err = pthread_setaffinity_np(pthread_self(), sizeof affinity.compressor, &affinity.compressor);
+    }
+    if (err != 0)
+    {
+        LOG("error pinning the ZSTD thread pool: %s", strerror(err));
+        return NULL;
+    }
+
+    ZSTD_threadPool *pool = ZSTD_createThreadPool(workers);
+    err = pthread_setaffinity_np(pthread_self(), sizeof own, &own);
+    if (err != 0)
+    {
+        LOG("error moving back to the reader CPUs: %s", strerror(err));
+        ZSTD_freeThreadPool(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+// --sink: output goes somewhere else than local files. an output file of a sink is a FILE made with fopencookie,
+// so rotation, the writer and the reaper handle it like any other. every write is copied and handed to a
+// background thread, the stream only waits once --sink-in-flight writes (or parts) are still on their way
+enum
+{
+    SINK_FILE = 0,
+    // every output file is a connection of its own, sent as it is written
+    SINK_TCP,
+    SINK_UNIX,
+    // every output file is a multipart upload run through COMMAND, see upload_run
+    SINK_OBJECT,
+};
+
+// writes to a connection are cut into pieces of this size
+#define SINK_CHUNK (1024 * 1024)
+
+typedef struct sink_chunk_t_
+{
+    char *data;
+    // 0 = end of the file, the sender stops
+    size_t size;
+} sink_chunk_t;
+
+// a job for the uploaders: the start of an upload, one of its parts or its end
+typedef struct upload_t_
+{
+    struct sink_target_t_ *target;
+    // 0 = start, the complete (or abort) job has number parts + 1
+    unsigned number;
+    char *data;
+    size_t size;
+    struct upload_t_ *next;
+} upload_t;
+
+// the destination of one output file
+typedef struct sink_target_t_
+{
+    char name[2048 + 32];
+
+    // connection: copies travel writer -> sender through queue and come back through free
+    int fd;
+    ring_t queue;
+    ring_t free;
+    sink_chunk_t *chunks;
+    pthread_t thread;
+    _Atomic bool failed;
+
+    // object: the part being filled. everything below is guarded by sink.lock
+    char *part;
+    size_t partFill;
+    unsigned parts;
+    unsigned partsDone;
+    bool started;
+    bool finished;
+    char upload[256];
+    // ETag (or whatever COMMAND printed) of every part, handed to the complete job
+    char (*replies)[128];
+    size_t replyCapacity;
+} sink_target_t;
+
+typedef struct sink_t_
+{
+    int kind;
+    const char *spec;
+    char host[256];
+    char port[32];
+    const char *path;
+    const char *command;
+    size_t inFlight;
+    size_t partSize;
+
+    // object: jobs of every upload in submission order, run by inFlight uploader threads. pending counts the
+    // queued and running ones, submitting waits while it is at inFlight
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    upload_t *head;
+    upload_t *tail;
+    size_t pending;
+    pthread_t *threads;
+    size_t threadCount;
+    bool stop;
+} sink_t;
+
+static sink_t sink = {
+    .kind = SINK_FILE,
+    .spec = NULL,
+    .path = NULL,
+    .command = NULL,
+    .inFlight = 4,
+    .partSize = 8 * 1024 * 1024,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .head = NULL,
+    .tail = NULL,
+    .pending = 0,
+    .threads = NULL,
+    .threadCount = 0,
+    .stop = false};
+
+// tcp:HOST:PORT ([HOST]:PORT for IPv6), unix:PATH or object:COMMAND
+static inline int parse_sink(const char *arg)
+{
+    sink.spec = arg;
+    if (strncmp(arg, "unix:", 5) == 0 && arg[5] != '\0' && strlen(arg + 5) < sizeof(((struct sockaddr_un *)NULL)->sun_path))
+    {
+        sink.kind = SINK_UNIX;
+        sink.path = arg + 5;
+        return 0;
+    }
+    if (strncmp(arg, "object:", 7) == 0 && arg[7] != '\0')
+    {
+        sink.kind = SINK_OBJECT;
+        sink.command = arg + 7;
+        return 0;
+    }
+    if (strncmp(arg, "tcp:", 4) != 0)
+    {
+        return -1;
+    }
+
+    const char *host = arg + 4;
+    const char *colon = strrchr(host, ':');
+    if (colon == NULL || colon == host || colon[1] == '\0' || strlen(colon + 1) >= sizeof sink.port)
+    {
+        return -1;
+    }
+    size_t hostLen = (size_t)(colon - host);
+    if (host[0] == '[' && hostLen >= 2 && host[hostLen - 1] == ']')
+    {
+        host++;
+        hostLen -= 2;
+    }
+    if (hostLen == 0 || hostLen >= sizeof sink.host)
+    {
+        return -1;
+    }
+    memcpy(sink.host, host, hostLen);
+    sink.host[hostLen] = '\0';
+    snprintf(sink.port, sizeof sink.port, "%s", colon + 1);
+    sink.kind = SINK_TCP;
+    return 0;
+}
+
+// bytes a sink holds on to for streamCount streams at most
+static inline size_t sink_memory(size_t streamCount)
+{
+    switch (sink.kind)
+    {
+    case SINK_TCP:
+    case SINK_UNIX:
+        return streamCount * sink.inFlight * SINK_CHUNK;
+    case SINK_OBJECT:
+        return (streamCount + sink.inFlight) * sink.partSize;
+    case SINK_FILE:
+    default:
+        return 0;
+    }
+}
+
+static inline void sink_target_free(sink_target_t *t)
+{
+    if (t->chunks != NULL)
+    {
+        for (size_t i = 0; i < sink.inFlight; i++)
+        {
+            free(t->chunks[i].data);
+        }
+        free(t->chunks);
+        ring_destroy(&t->queue);
+        ring_destroy(&t->free);
+    }
+    free(t->part);
+    free(t->replies);
+    free(t);
+}
+
+static inline int sink_connect()
+{
+    if (sink.kind == SINK_UNIX)
+    {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        snprintf(addr.sun_path, sizeof addr.sun_path, "%s", sink.path);
+        const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1 || connect(fd, (const struct sockaddr *)(&addr), sizeof addr) != 0)
+        {
+            LOG("error connecting to sink ('%s'): %s", sink.path, strerror(errno));
+            if (fd != -1)
+            {
+                close(fd);
+            }
+            return -1;
+        }
+        return fd;
+    }
+
+    const struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *addrs = NULL;
+    const int err = getaddrinfo(sink.host, sink.port, &hints, &addrs);
+    if (err != 0)
+    {
+        LOG("error resolving sink ('%s'): %s", sink.spec, gai_strerror(err));
+        return -1;
+    }
+
+    int fd = -1;
+    for (const struct addrinfo *a = addrs; a != NULL && fd == -1; a = a->ai_next)
+    {
+        fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd != -1 && connect(fd, a->ai_addr, a->ai_addrlen) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd == -1)
+    {
+        LOG("error connecting to sink ('%s'): %s", sink.spec, strerror(errno));
+    }
+    freeaddrinfo(addrs);
+    return fd;
+}
+
+// connects and sends until the end of the file. after an error chunks are only recycled so the writer does not
+// get stuck, its next write fails
+static void *sender_main(void *arg)
+{
+    sink_target_t *t = (sink_target_t *)arg;
+
+    t->fd = sink_connect();
+    if (t->fd == -1)
+    {
+        atomic_store(&t->failed, true);
+    }
+
+    while (1)
+    {
+        sink_chunk_t *chunk = (sink_chunk_t *)ring_pop(&t->queue);
+        if (chunk->size == 0)
+        {
+            break;
+        }
+
+        for (size_t sent = 0; !atomic_load_explicit(&t->failed, memory_order_relaxed) && sent < chunk->size;)
+        {
+            const ssize_t ret = send(t->fd, chunk->data + sent, chunk->size - sent, MSG_NOSIGNAL);
+            if (ret == -1 && errno != EINTR)
+            {
+                LOG("error sending output file (%s) to sink: %s", t->name, strerror(errno));
+                atomic_store(&t->failed, true);
+            }
+            sent += ret > 0 ? (size_t)(ret) : 0;
+        }
+        if (!atomic_load_explicit(&t->failed, memory_order_relaxed))
+        {
+            stats_add(&stats.sinkBytes, chunk->size);
+        }
+        ring_push(&t->free, chunk);
+    }
+
+    // the receiver gets a clean end of the file
+    if (t->fd != -1 && (shutdown(t->fd, SHUT_WR) != 0 || close(t->fd) != 0))
+    {
+        LOG("error closing sink connection of output file (%s): %s", t->name, strerror(errno));
+        atomic_store(&t->failed, true);
+    }
+    return NULL;
+}
+
+static ssize_t connection_write(void *cookie, const char *data, size_t size)
+{
+    sink_target_t *t = (sink_target_t *)cookie;
+
+    for (size_t done = 0; done < size;)
+    {
+        if (atomic_load_explicit(&t->failed, memory_order_relaxed))
+        {
+            errno = EPIPE;
+            return -1;
+        }
+
+        // waiting for a sent chunk is our backpressure
+        sink_chunk_t *chunk = (sink_chunk_t *)ring_pop(&t->free);
+        chunk->size = size - done < SINK_CHUNK ? size - done : SINK_CHUNK;
+        memcpy(chunk->data, data + done, chunk->size);
+        ring_push(&t->queue, chunk);
+        done += chunk->size;
+    }
+
+    return (ssize_t)(size);
+}
+
+// runs on the reaper, waits until everything is sent
+static int connection_close(void *cookie)
+{
+    sink_target_t *t = (sink_target_t *)cookie;
+
+    sink_chunk_t *end = (sink_chunk_t *)ring_pop(&t->free);
+    end->size = 0;
+    ring_push(&t->queue, end);
+
+    const int err = pthread_join(t->thread, NULL);
+    if (err != 0)
+    {
+        LOG("error joining sink sender thread: %s", strerror(err));
+    }
+    const bool failed = err != 0 || atomic_load(&t->failed);
+    sink_target_free(t);
+    return failed ? -1 : 0;
+}
+
+static inline void close_pipe_end(int fd)
+{
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+// runs COMMAND with the job described in its environment and data on stdin, what it prints ends up in reply:
+//   OMZSTD_ACTION  start, part, complete or abort
+//   OMZSTD_OBJECT  name of the output file
+//   OMZSTD_UPLOAD  what start printed
+//   OMZSTD_PART    part number from 1 on, the data of the part is on stdin
+//   OMZSTD_PARTS   number of parts, complete gets "NUMBER REPLY" lines of what every part printed on stdin
+static inline int upload_run(const sink_target_t *t, const char *action, unsigned number, const char *data, size_t size,
+                             char *reply, size_t replySize)
+{
+    char vars[5][2048 + 64];
+    snprintf(vars[0], sizeof vars[0], "OMZSTD_ACTION=%s", action);
+    snprintf(vars[1], sizeof vars[1], "OMZSTD_OBJECT=%s", t->name);
+    snprintf(vars[2], sizeof vars[2], "OMZSTD_UPLOAD=%s", t->upload);
+    snprintf(vars[3], sizeof vars[3], "OMZSTD_PART=%u", number);
+    snprintf(vars[4], sizeof vars[4], "OMZSTD_PARTS=%u", t->parts);
+
+    size_t envCount = 0;
+    while (environ[envCount] != NULL)
+    {
+        envCount++;
+    }
+    char **env = (char **)calloc(envCount + 6, sizeof(char *));
+    if (env == NULL)
+    {
+        LOG("error allocating upload environment");
+        return -1;
+    }
+    for (size_t i = 0; i < 5; i++)
+    {
+        env[i] = vars[i];
+    }
+    memcpy(env + 5, environ, envCount * sizeof(char *));
+
+    int in[2] = {-1, -1};
+    int out[2] = {-1, -1};
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    pid_t pid = -1;
+    char *const argv[] = {(char *)"sh", (char *)"-c", (char *)(uintptr_t)(sink.command), NULL};
+    int err = pipe2(in, O_CLOEXEC) != 0 || pipe2(out, O_CLOEXEC) != 0 ? errno : 0;
+    if (err == 0 && (posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO) != 0 ||
+                     posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO) != 0))
+    {
+        err = ENOMEM;
+    }
+    err = err == 0 ? posix_spawn(&pid, "/bin/sh", &actions, NULL, argv, env) : err;
+    posix_spawn_file_actions_destroy(&actions);
+    free(env);
+    // the ends the command got are closed, so its exit shows up as EOF and EPIPE here
+    close_pipe_end(in[0]);
+    close_pipe_end(out[1]);
+    if (err != 0)
+    {
+        LOG("error running upload command for %s of '%s': %s", action, t->name, strerror(err));
+        close_pipe_end(in[1]);
+        close_pipe_end(out[0]);
+        return -1;
+    }
+
+    bool failed = false;
+    for (size_t written = 0; written < size;)
+    {
+        const ssize_t ret = write(in[1], data + written, size - written);
+        if (ret == -1 && errno != EINTR)
+        {
+            LOG("error writing %s of '%s' to the upload command: %s", action, t->name, strerror(errno));
+            failed = true;
+            break;
+        }
+        written += ret > 0 ? (size_t)(ret) : 0;
+    }
+    close(in[1]);
+
+    // only the start of the output is kept, the rest is read so the command does not block on a full pipe
+    size_t got = 0;
+    char discard[4096];
+    while (1)
+    {
+        char *to = got < replySize - 1 ? reply + got : discard;
+        const size_t room = got < replySize - 1 ? replySize - 1 - got : sizeof discard;
+        const ssize_t ret = read(out[0], to, room);
+        if (ret == 0 || (ret == -1 && errno != EINTR))
+        {
+            break;
+        }
+        got += to == reply + got && ret > 0 ? (size_t)(ret) : 0;
+    }
+    close(out[0]);
+    while (got > 0 && (reply[got - 1] == '\n' || reply[got - 1] == '\r' || reply[got - 1] == ' '))
+    {
+        got--;
+    }
+    reply[got] = '\0';
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+    {
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        LOG("upload command failed for %s of '%s' (%s %d)", action, t->name, WIFEXITED(status) ? "exit status" : "signal",
+            WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+        failed = true;
+    }
+
+    return failed ? -1 : 0;
+}
+
+static inline int upload_job(upload_t *job)
+{
+    sink_target_t *t = job->target;
+    char reply[128];
+
+    if (job->number == 0)
+    {
+        const int ret = upload_run(t, "start", 0, NULL, 0, reply, sizeof reply);
+        if (ret != 0)
+        {
+            atomic_store(&t->failed, true);
+        }
+        pthread_mutex_lock(&sink.lock);
+        snprintf(t->upload, sizeof t->upload, "%s", reply);
+        t->started = true;
+        pthread_mutex_unlock(&sink.lock);
+        return ret;
+    }
+
+    // parts of an upload only go once it is started, its start job was taken before them
+    pthread_mutex_lock(&sink.lock);
+    while (!t->started)
+    {
+        pthread_cond_wait(&sink.cond, &sink.lock);
+    }
+    const bool failed = atomic_load(&t->failed);
+    const bool part = job->number <= t->parts;
+    pthread_mutex_unlock(&sink.lock);
+
+    if (part)
+    {
+        const int ret = failed ? -1 : upload_run(t, "part", job->number, job->data, job->size, reply, sizeof reply);
+        pthread_mutex_lock(&sink.lock);
+        snprintf(t->replies[job->number - 1], sizeof t->replies[0], "%s", ret == 0 ? reply : "");
+        t->partsDone++;
+        pthread_mutex_unlock(&sink.lock);
+        stats_add(&stats.sinkParts, 1);
+        stats_add(&stats.sinkBytes, ret == 0 ? job->size : 0);
+        return ret;
+    }
+
+    // the upload is over, every part is done by now
+    const int ret = failed ? upload_run(t, "abort", 0, NULL, 0, reply, sizeof reply)
+                           : upload_run(t, "complete", 0, job->data, job->size, reply, sizeof reply);
+    pthread_mutex_lock(&sink.lock);
+    t->finished = true;
+    pthread_mutex_unlock(&sink.lock);
+    return failed ? -1 : ret;
+}
+
+static void *uploader_main(void *arg)
+{
+    (void)arg;
+
+    // a command that exits early turns writes to its stdin into EPIPE instead of killing us
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_mutex_lock(&sink.lock);
+    while (1)
+    {
+        while (sink.head == NULL && !sink.stop)
+        {
+            pthread_cond_wait(&sink.cond, &sink.lock);
+        }
+        if (sink.head == NULL)
+        {
+            break;
+        }
+
+        upload_t *job = sink.head;
+        sink.head = job->next;
+        sink.tail = sink.head == NULL ? NULL : sink.tail;
+        pthread_mutex_unlock(&sink.lock);
+
+        if (upload_job(job) != 0)
+        {
+            atomic_store(&job->target->failed, true);
+        }
+        free(job->data);
+        free(job);
+
+        pthread_mutex_lock(&sink.lock);
+        sink.pending--;
+        pthread_cond_broadcast(&sink.cond);
+    }
+    pthread_mutex_unlock(&sink.lock);
+
+    return NULL;
+}
+
+// takes over data, waits while --sink-in-flight jobs are pending
+static inline int upload_submit(sink_target_t *t, unsigned number, char *data, size_t size)
+{
+    upload_t *job = (upload_t *)calloc(1, sizeof(upload_t));
+    if (job == NULL)
+    {
+        LOG("error allocating upload job");
+        free(data);
+        return -1;
+    }
+    job->target = t;
+    job->number = number;
+    job->data = data;
+    job->size = size;
+
+    pthread_mutex_lock(&sink.lock);
+    while (sink.pending >= sink.inFlight)
+    {
+        pthread_cond_wait(&sink.cond, &sink.lock);
+    }
+    sink.pending++;
+    if (sink.tail != NULL)
+    {
+        sink.tail->next = job;
+    }
+    else
+    {
+        sink.head = job;
+    }
+    sink.tail = job;
+    pthread_cond_broadcast(&sink.cond);
+    pthread_mutex_unlock(&sink.lock);
+    return 0;
+}
+
+// hands the filled part to the uploaders and starts a new one
+static inline int upload_part(sink_target_t *t)
+{
+    pthread_mutex_lock(&sink.lock);
+    if (t->parts == t->replyCapacity)
+    {
+        const size_t capacity = t->replyCapacity > 0 ? t->replyCapacity * 2 : 16;
+        char(*replies)[128] = (char(*)[128])realloc(t->replies, capacity * sizeof t->replies[0]);
+        if (replies == NULL)
+        {
+            pthread_mutex_unlock(&sink.lock);
+            LOG("error allocating upload part list");
+            return -1;
+        }
+        t->replies = replies;
+        t->replyCapacity = capacity;
+    }
+    t->parts++;
+    const unsigned number = t->parts;
+    pthread_mutex_unlock(&sink.lock);
+
+    char *part = t->part;
+    const size_t size = t->partFill;
+    t->part = NULL;
+    t->partFill = 0;
+    return upload_submit(t, number, part, size);
+}
+
+static ssize_t object_write(void *cookie, const char *data, size_t size)
+{
+    sink_target_t *t = (sink_target_t *)cookie;
+
+    for (size_t done = 0; done < size;)
+    {
+        if (atomic_load_explicit(&t->failed, memory_order_relaxed))
+        {
+            errno = EIO;
+            return -1;
+        }
+        if (t->part == NULL && (t->part = (char *)malloc(sink.partSize)) == NULL)
+        {
+            LOG("error allocating upload part");
+            errno = ENOMEM;
+            return -1;
+        }
+
+        const size_t n = size - done < sink.partSize - t->partFill ? size - done : sink.partSize - t->partFill;
+        memcpy(t->part + t->partFill, data + done, n);
+        t->partFill += n;
+        done += n;
+        if (t->partFill == sink.partSize && upload_part(t) != 0)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    return (ssize_t)(size);
+}
+
+// runs on the reaper, the last part is uploaded even if it is empty so every object has at least one
+static int object_close(void *cookie)
+{
+    sink_target_t *t = (sink_target_t *)cookie;
+
+    if ((t->partFill > 0 || t->parts == 0) && upload_part(t) != 0)
+    {
+        atomic_store(&t->failed, true);
+    }
+
+    pthread_mutex_lock(&sink.lock);
+    while (t->partsDone < t->parts)
+    {
+        pthread_cond_wait(&sink.cond, &sink.lock);
+    }
+    pthread_mutex_unlock(&sink.lock);
+
+    // a line per part: the number, a space and what the part printed (at most 127 bytes)
+    const size_t lineSize = 10 + 1 + sizeof t->replies[0] + 1;
+    char *list = (char *)malloc(t->parts * lineSize + 1);
+    size_t listSize = 0;
+    for (unsigned i = 0; list != NULL && i < t->parts; i++)
+    {
+        listSize += (size_t)(snprintf(list + listSize, lineSize + 1, "%u %s\n", i + 1, t->replies[i]));
+    }
+    if (list == NULL)
+    {
+        LOG("error allocating upload part list");
+        atomic_store(&t->failed, true);
+    }
+
+    // failed, the job aborts the upload
+    if (upload_submit(t, t->parts + 1, list, listSize) != 0)
+    {
+        atomic_store(&t->failed, true);
+        t->finished = true;
+    }
+
+    pthread_mutex_lock(&sink.lock);
+    while (!t->finished)
+    {
+        pthread_cond_wait(&sink.cond, &sink.lock);
+    }
+    pthread_mutex_unlock(&sink.lock);
+
+    const bool failed = atomic_load(&t->failed);
+    sink_target_free(t);
+    return failed ? -1 : 0;
+}
+
+// opens the output file called name on the sink, the FILE is unbuffered, the sink already copies every write
+static inline FILE *sink_open(const char *name)
+{
+    sink_target_t *t = (sink_target_t *)calloc(1, sizeof(sink_target_t));
+    if (t == NULL)
+    {
+        LOG("error allocating sink output file");
+        return NULL;
+    }
+    snprintf(t->name, sizeof t->name, "%s", name);
+    t->fd = -1;
+    atomic_init(&t->failed, false);
+
+    const bool connection = sink.kind != SINK_OBJECT;
+    if (connection)
+    {
+        t->chunks = (sink_chunk_t *)calloc(sink.inFlight, sizeof(sink_chunk_t));
+        if (t->chunks == NULL || ring_init(&t->queue, ring_capacity_for(sink.inFlight)) != 0 ||
+            ring_init(&t->free, ring_capacity_for(sink.inFlight)) != 0)
+        {
+            LOG("error allocating sink output file");
+            sink_target_free(t);
+            return NULL;
+        }
+        for (size_t i = 0; i < sink.inFlight; i++)
+        {
+            if ((t->chunks[i].data = (char *)malloc(SINK_CHUNK)) == NULL)
+            {
+                LOG("error allocating sink output file");
+                sink_target_free(t);
+                return NULL;
+            }
+            ring_push(&t->free, &t->chunks[i]);
+        }
+
+        // the connection is made by the sender, so a slow one does not hold up the rotation
+        const int err = pthread_create(&t->thread, NULL, sender_main, t);
+        if (err != 0)
+        {
+            LOG("error creating sink sender thread: %s", strerror(err));
+            sink_target_free(t);
+            return NULL;
+        }
+    }
+    else if (upload_submit(t, 0, NULL, 0) != 0)
+    {
+        sink_target_free(t);
+        return NULL;
+    }
+
+    const cookie_io_functions_t io = {
+        .read = NULL,
+        .write = connection ? connection_write : object_write,
+        .seek = NULL,
+        .close = connection ? connection_close : object_close};
+    FILE *file = fopencookie(t, "w", io);
+    if (file == NULL)
+    {
+        LOG("error opening sink output file ('%s'): %s", name, strerror(errno));
+        // the sender or the upload that is already under way is wound down like on a close
+        atomic_store(&t->failed, true);
+        io.close(t);
+        return NULL;
+    }
+    setvbuf(file, NULL, _IONBF, 0);
+
+    return file;
+}
+
+// object: the uploaders are shared by every stream
+static inline int sink_start()
+{
+    if (sink.kind != SINK_OBJECT)
+    {
+        return 0;
+    }
+
+    sink.threads = (pthread_t *)calloc(sink.inFlight, sizeof(pthread_t));
+    if (sink.threads == NULL)
+    {
+        LOG("error allocating uploader threads");
+        return -1;
+    }
+    for (; sink.threadCount < sink.inFlight; sink.threadCount++)
+    {
+        const int err = pthread_create(&sink.threads[sink.threadCount], NULL, uploader_main, NULL);
+        if (err != 0)
+        {
+            LOG("error creating uploader thread: %s", strerror(err));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// every output file is closed by now, so all that is left is the uploaders running dry
+static inline void sink_stop()
+{
+    pthread_mutex_lock(&sink.lock);
+    sink.stop = true;
+    pthread_cond_broadcast(&sink.cond);
+    pthread_mutex_unlock(&sink.lock);
+
+    for (size_t i = 0; i < sink.threadCount; i++)
+    {
+        const int err = pthread_join(sink.threads[i], NULL);
+        if (err != 0)
+        {
+            LOG("error joining uploader thread: %s", strerror(err));
+        }
+    }
+    sink.threadCount = 0;
+    free(sink.threads);
+    sink.threads = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+// flush the stdio buffer of the file after writing
+#define OUTPUT_FLUSH (1u << 0)
+// fsync and close the file after writing, done by the reaper thread
+#define OUTPUT_CLOSE (1u << 1)
+// last request, the writer stops after it
+#define OUTPUT_EOF (1u << 2)
+// make everything written to the file so far durable, syncs requested back-to-back are merged
+#define OUTPUT_SYNC (1u << 3)
+// --mmap: the data is already in the file, only the rest of the request is left
+#define OUTPUT_MAPPED (1u << 4)
+
+// --part: a file is opened under its spare name, renamed to its part name once in use and to its final name once
+// it is closed and durable
+typedef struct file_names_t_
+{
+    char spare[2048 + 32];
+    char part[2048 + 40];
+    char final[2048 + 32];
+} file_names_t;
+
+typedef struct output_t_
+{
+    char *buffer;
+    size_t size;
+    FILE *file;
+    unsigned flags;
+    // commit sequence that becomes durable with an OUTPUT_SYNC, 0 = none
+    uint64_t seq;
+    // where the buffer starts in the file
+    size_t offset;
+    // free ring of the stream the buffer belongs to, written buffers go back there
+    ring_t *home;
+    // --part: names of the file an OUTPUT_CLOSE retires
+    file_names_t *names;
+    // --drop-cache: where the page cache of the stream's file is not dropped yet, only whoever writes it touches that
+    size_t *dropped;
+} output_t;
+
+// output is dropped from the page cache in chunks of this size, one chunk behind what was just written
+#define DROP_CHUNK (8 * 1024 * 1024)
+
+static inline void drop_pages(FILE *file, off_t from, off_t to)
+{
+    if (from < to && (fflush(file) != 0 || posix_fadvise(fileno(file), from, to - from, POSIX_FADV_DONTNEED) != 0))
+    {
+        LOG("error dropping output from the page cache: %s", strerror(errno));
+    }
+}
+
+// the chunk that just ended at boundary is handed to writeback, everything before it had its turn a round ago and
+// is only waited for. DONTNEED passes over pages still under writeback, so it starts where the last round got to
+static inline void drop_behind(const output_t *out, size_t boundary)
+{
+    const int fn = fileno(out->file);
+    const size_t to = boundary - DROP_CHUNK;
+    if (fflush(out->file) != 0 || sync_file_range(fn, (off_t)to, DROP_CHUNK, SYNC_FILE_RANGE_WRITE) == -1)
+    {
+        LOG("error starting writeback of output: %s", strerror(errno));
+    }
+
+    const size_t from = *out->dropped;
+    if (from >= to)
+    {
+        return;
+    }
+    if (sync_file_range(fn, (off_t)from, (off_t)(to - from),
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == -1 ||
+        posix_fadvise(fn, (off_t)from, (off_t)(to - from), POSIX_FADV_DONTNEED) != 0)
+    {
+        // tried again from the same place next round
+        LOG("error dropping output from the page cache: %s", strerror(errno));
+        return;
+    }
+    *out->dropped = to;
+}
+
+// gives back the blocks --preallocate reserved past the end of the output
+static inline void trim_file(FILE *file)
+{
+    if (!config.preallocate)
+    {
+        return;
+    }
+
+    const off_t size = ftello(file);
+    if (size == -1 || fflush(file) != 0 || ftruncate(fileno(file), size) != 0)
+    {
+        LOG("error trimming preallocated output file: %s", strerror(errno));
+    }
+}
+
+static inline int close_file(FILE *file)
+{
+    // --sink: fclose waits until the sink has it all, there is nothing to sync
+    if (sink.kind != SINK_FILE)
+    {
+        if (fclose(file) != 0)
+        {
+            LOG("error closing output file: %s", strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    const int fn = fileno(file);
+    if (fn == -1)
+    {
+        LOG("error getting file number for output file: %s", strerror(errno));
+        return -1;
+    }
+    else
+    {
+        trim_file(file);
+        const uint64_t start = now_us();
+        if (fsync(fn) == -1)
+        {
+            LOG("error syncing output file to disk: %s", strerror(errno));
+            return -1;
+        }
+        observe(&stats.syncTime, now_us() - start, 1);
+
+        if (config.dropCache)
+        {
+            // everything is clean now
+            drop_pages(file, 0, ftello(file));
+        }
+    }
+
+    if (fclose(file) != 0)
+    {
+        LOG("error closing output file: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// makes a rename in the directory of path durable
+static inline void sync_directory(const char *path)
+{
+    char dir[2048 + 32] = {0};
+    snprintf(dir, sizeof dir, "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL)
+    {
+        snprintf(dir, sizeof dir, ".");
+    }
+    else
+    {
+        slash[slash == dir ? 1 : 0] = '\0';
+    }
+
+    const int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 || fsync(fd) == -1)
+    {
+        LOG("error syncing directory ('%s'): %s", dir, strerror(errno));
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+// --part: a file that just went into use moves from its spare name to its part name
+static inline void use_names(const file_names_t *names)
+{
+    if (renameat2(AT_FDCWD, names->spare, AT_FDCWD, names->part, RENAME_NOREPLACE) != 0)
+    {
+        // not fatal, the file keeps its spare name until it is finished
+        LOG("error renaming output file to '%s': %s", names->part, strerror(errno));
+    }
+}
+
+// --part: a closed and synced file gets its final name, nothing that is already there is replaced
+static inline void finish_names(file_names_t *names)
+{
+    if (renameat2(AT_FDCWD, names->part, AT_FDCWD, names->final, RENAME_NOREPLACE) != 0 &&
+        (errno != ENOENT || renameat2(AT_FDCWD, names->spare, AT_FDCWD, names->final, RENAME_NOREPLACE) != 0))
+    {
+        // not fatal, the data is durable under the old name
+        LOG("error renaming finished output file to '%s': %s", names->final, strerror(errno));
+    }
+    else
+    {
+        sync_directory(names->final);
+    }
+    free(names);
+}
+
+// rotated files are synced and closed in the background so ingestion does not wait for the disk.
+// with --part the reaper also renames them and opens the file for the next rotation ahead of time
+typedef struct reaper_job_t_
+{
+    // synced and closed, then renamed to its final name if names is set.
+    // without a file names are only moved to their part name
+    FILE *file;
+    file_names_t *names;
+    // or just run
+    void (*run)(void *arg);
+    void *arg;
+} reaper_job_t;
+
+typedef struct reaper_t_
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    reaper_job_t jobs[16];
+    size_t head;
+    size_t count;
+
+    pthread_t thread;
+    bool running;
+    bool stop;
+    _Atomic bool failed;
+} reaper_t;
+
+static reaper_t reaper = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .head = 0,
+    .count = 0,
+    .running = false,
+    .stop = false};
+
+static inline int reaper_perform(const reaper_job_t *job)
+{
+    if (job->run != NULL)
+    {
+        job->run(job->arg);
+        return 0;
+    }
+
+    if (job->file == NULL)
+    {
+        use_names(job->names);
+        return 0;
+    }
+
+    if (close_file(job->file) != 0)
+    {
+        // it was not made durable, so it keeps the name that says so
+        free(job->names);
+        return -1;
+    }
+
+    if (job->names != NULL)
+    {
+        finish_names(job->names);
+    }
+    return 0;
+}
+
+static void *reaper_main(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&reaper.lock);
+    while (1)
+    {
+        while (reaper.count == 0 && !reaper.stop)
+        {
+            pthread_cond_wait(&reaper.cond, &reaper.lock);
+        }
+        if (reaper.count == 0)
+        {
+            break;
+        }
+
+        const reaper_job_t job = reaper.jobs[reaper.head];
+        reaper.head = (reaper.head + 1) % (sizeof reaper.jobs / sizeof reaper.jobs[0]);
+        reaper.count--;
+        pthread_cond_broadcast(&reaper.cond);
+        pthread_mutex_unlock(&reaper.lock);
+
+        if (reaper_perform(&job) != 0)
+        {
+            atomic_store(&reaper.failed, true);
+        }
+
+        pthread_mutex_lock(&reaper.lock);
+    }
+    pthread_mutex_unlock(&reaper.lock);
+
+    return NULL;
+}
+
+static inline int reaper_start()
+{
+    atomic_init(&reaper.failed, false);
+
+    const int err = pthread_create(&reaper.thread, NULL, reaper_main, NULL);
+    if (err != 0)
+    {
+        LOG("error creating reaper thread: %s", strerror(err));
+        return -1;
+    }
+    reaper.running = true;
+
+    return 0;
+}
+
+// waits until every queued job is done
+static inline int reaper_stop()
+{
+    if (!reaper.running)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&reaper.lock);
+    reaper.stop = true;
+    pthread_cond_broadcast(&reaper.cond);
+    pthread_mutex_unlock(&reaper.lock);
+
+    const int err = pthread_join(reaper.thread, NULL);
+    if (err != 0)
+    {
+        LOG("error joining reaper thread: %s", strerror(err));
+        return -1;
+    }
+    reaper.running = false;
+
+    return atomic_load(&reaper.failed) ? -1 : 0;
+}
+
+// jobs are done in the order they were submitted
+static inline int reaper_submit(const reaper_job_t *job)
+{
+    if (!reaper.running)
+    {
+        return reaper_perform(job);
+    }
+
+    if (UNLIKELY(atomic_load_explicit(&reaper.failed, memory_order_relaxed)))
+    {
+        LOG("closing a previous output file failed, exiting");
+        reaper_perform(job);
+        return -1;
+    }
+
+    const size_t capacity = sizeof reaper.jobs / sizeof reaper.jobs[0];
+
+    pthread_mutex_lock(&reaper.lock);
+    while (reaper.count == capacity)
+    {
+        pthread_cond_wait(&reaper.cond, &reaper.lock);
+    }
+    reaper.jobs[(reaper.head + reaper.count) % capacity] = *job;
+    reaper.count++;
+    pthread_cond_broadcast(&reaper.cond);
+    pthread_mutex_unlock(&reaper.lock);
+
+    return 0;
+}
+
+static inline int reaper_close(FILE *file, file_names_t *names)
+{
+    const reaper_job_t job = {.file = file, .names = names, .run = NULL, .arg = NULL};
+    return reaper_submit(&job);
+}
+
+static inline int reaper_rename(file_names_t *names)
+{
+    const reaper_job_t job = {.file = NULL, .names = names, .run = NULL, .arg = NULL};
+    return reaper_submit(&job);
+}
+
+static inline int reaper_run(void (*run)(void *arg), void *arg)
+{
+    const reaper_job_t job = {.file = NULL, .names = NULL, .run = run, .arg = arg};
+    return reaper_submit(&job);
+}
+
+enum
+{
+    DURABILITY_NONE = 0,
+    // fdatasync at most every --sync-interval
+    DURABILITY_INTERVAL,
+    // fdatasync every --sync-bytes of output
+    DURABILITY_BYTES,
+    // an OK is only sent once the acknowledged data is synced
+    DURABILITY_COMMIT,
+};
+
+typedef struct durability_t_
+{
+    int policy;
+    uint64_t interval;
+    size_t bytes;
+
+    // owned by the thread doing the file I/O: a sync that was requested but merged into a later one,
+    // and how far dirty pages have been handed to writeback with sync_file_range
+    bool syncPending;
+    FILE *pendingFile;
+    uint64_t pendingSeq;
+    // a sync finished for one file while the same commit may still be waiting on another
+    bool publishPending;
+    off_t writebackFrom;
+    off_t written;
+    FILE *writtenFile;
+
+    // highest commit sequence known to be on disk, the reader holds back replies until it is reached.
+    // wakeFd is an eventfd signalled whenever it moves
+    _Atomic uint64_t durable;
+    _Atomic bool failed;
+    pthread_mutex_t lock;
+    int wakeFd;
+} durability_t;
+
+static durability_t durability = {
+    .policy = DURABILITY_NONE,
+    .interval = 1000,
+    .bytes = 1024 * 1024 * 4,
+    .syncPending = false,
+    .pendingFile = NULL,
+    .pendingSeq = 0,
+    .publishPending = false,
+    .writebackFrom = 0,
+    .written = 0,
+    .writtenFile = NULL,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wakeFd = -1};
+
+// dirty pages are pushed to writeback in chunks of this size, so a later fdatasync has little left to do
+#define WRITEBACK_CHUNK (1024 * 1024)
+
+static inline void publish_durable(uint64_t seq, bool failed)
+{
+    pthread_mutex_lock(&durability.lock);
+    if (seq > atomic_load_explicit(&durability.durable, memory_order_relaxed))
+    {
+        atomic_store(&durability.durable, seq);
+    }
+    if (failed)
+    {
+        atomic_store(&durability.failed, true);
+    }
+    pthread_mutex_unlock(&durability.lock);
+
+    if (durability.wakeFd != -1)
+    {
+        const uint64_t one = 1;
+        // only fails once the counter is full, and then the reader is woken anyway
+        ssize_t unused = write(durability.wakeFd, &one, sizeof one);
+        (void)unused;
+    }
+}
+
+static inline int sync_file(FILE *file)
+{
+    const uint64_t start = now_us();
+    if (fflush(file) != 0 || fdatasync(fileno(file)) == -1)
+    {
+        LOG("error syncing output file to disk: %s", strerror(errno));
+        return -1;
+    }
+    observe(&stats.syncTime, now_us() - start, 1);
+
+    return 0;
+}
+
+// a commit is only published once the file really holds everything written up to it
+static inline int check_written(FILE *file, off_t written)
+{
+    struct stat st;
+    if (fstat(fileno(file), &st) == -1)
+    {
+        LOG("error checking synced output file: %s", strerror(errno));
+        return -1;
+    }
+    if (st.st_size < written)
+    {
+        LOG("synced output file has %lld bytes, %lld were written", (long long)(st.st_size), (long long)(written));
+        return -1;
+    }
+
+    return 0;
+}
+
+// runs after every write on the I/O side. a requested sync is delayed while more requests are queued behind it,
+// so commits arriving together share a single fdatasync
+static inline int update_durability(const output_t *out, bool moreQueued)
+{
+    if (durability.syncPending && out->file != durability.pendingFile)
+    {
+        // routed streams interleave, the delayed sync belongs to another file
+        durability.syncPending = false;
+        if (sync_file(durability.pendingFile) != 0)
+        {
+            publish_durable(0, true);
+            return -1;
+        }
+        durability.publishPending = true;
+    }
+
+    if (out->file != durability.writtenFile)
+    {
+        durability.writtenFile = out->file;
+        durability.writebackFrom = (off_t)(out->offset);
+    }
+    durability.written = (off_t)(out->offset + out->size);
+
+    if (out->flags & OUTPUT_SYNC)
+    {
+        durability.syncPending = true;
+        durability.pendingFile = out->file;
+        durability.pendingSeq = out->seq > durability.pendingSeq ? out->seq : durability.pendingSeq;
+    }
+
+    if (durability.syncPending && (!moreQueued || (out->flags & OUTPUT_CLOSE)))
+    {
+        durability.syncPending = false;
+        if (sync_file(out->file) != 0 || check_written(out->file, durability.written) != 0)
+        {
+            publish_durable(0, true);
+            return -1;
+        }
+        durability.writebackFrom = durability.written;
+        durability.publishPending = false;
+        publish_durable(durability.pendingSeq, false);
+        return 0;
+    }
+
+    if (durability.publishPending && !moreQueued)
+    {
+        durability.publishPending = false;
+        publish_durable(durability.pendingSeq, false);
+    }
+
+    if ((durability.policy == DURABILITY_INTERVAL || durability.policy == DURABILITY_BYTES) &&
+        durability.written - durability.writebackFrom >= WRITEBACK_CHUNK)
+    {
+        // start writeback without waiting for it
+        if (fflush(out->file) != 0 ||
+            sync_file_range(fileno(out->file), durability.writebackFrom, durability.written - durability.writebackFrom,
+                            SYNC_FILE_RANGE_WRITE) == -1)
+        {
+            LOG("error starting writeback: %s", strerror(errno));
+        }
+        durability.writebackFrom = durability.written;
+    }
+
+    return 0;
+}
+
+static inline int perform_output(const output_t *out, bool moreQueued)
+{
+    if (out->size > 0)
+    {
+        if (!(out->flags & OUTPUT_MAPPED))
+        {
+            PROBE(write__start, out->size, out->offset);
+            const uint64_t start = now_us();
+            if (out->size != fwrite(out->buffer, 1, out->size, out->file))
+            {
+                LOG("error writing compressed buffer to file: %s", strerror(errno));
+                return -1;
+            }
+            observe(&stats.writeTime, now_us() - start, 1);
+            PROBE(write__end, out->size);
+        }
+        stats_add(&stats.writtenBytes, out->size);
+
+        const size_t end = out->offset + out->size;
+        if (config.dropCache && out->offset == 0)
+        {
+            // a new file
+            *out->dropped = 0;
+        }
+        if (config.dropCache && end / DROP_CHUNK != out->offset / DROP_CHUNK)
+        {
+            drop_behind(out, end / DROP_CHUNK * DROP_CHUNK);
+        }
+    }
+
+    if ((out->flags & OUTPUT_FLUSH) && fflush(out->file) != 0)
+    {
+        LOG("error flushing output file: %s", strerror(errno));
+        return -1;
+    }
+
+    if (durability.policy != DURABILITY_NONE && out->file != NULL && update_durability(out, moreQueued) != 0)
+    {
+        return -1;
+    }
+
+    if (out->flags & OUTPUT_CLOSE)
+    {
+        return reaper_close(out->file, out->names);
+    }
+
+    return 0;
+}
+
+typedef struct writer_t_
+{
+    bool enabled;
+    // output buffers per stream
+    size_t bufferCount;
+
+    // filled buffers of every stream travel compressor -> writer, written ones go back to their stream
+    ring_t queue;
+    // marks the end of the queue
+    output_t eof;
+
+    pthread_t thread;
+    bool running;
+    _Atomic size_t inFlight;
+    _Atomic bool failed;
+
+    // times the compressor found no written buffer to continue with, the disk is the bottleneck then
+    size_t stalls;
+} writer_t;
+
+static writer_t writer = {
+    .enabled = false,
+    .bufferCount = 2,
+    .eof = {.flags = OUTPUT_EOF, .home = NULL},
+    .running = false,
+    .stalls = 0};
+
+static void *writer_main(void *arg)
+{
+    (void)arg;
+
+    bool eof = false;
+    while (!eof)
+    {
+        output_t *out = (output_t *)ring_pop(&writer.queue);
+        eof = (out->flags & OUTPUT_EOF) != 0;
+
+        // after an error buffers are only recycled so the compressor does not get stuck
+        if (!atomic_load_explicit(&writer.failed, memory_order_relaxed) && perform_output(out, !ring_empty(&writer.queue)) != 0)
+        {
+            atomic_store(&writer.failed, true);
+            publish_durable(0, true);
+        }
+
+        atomic_fetch_sub(&writer.inFlight, 1);
+        if (out->home != NULL)
+        {
+            ring_push(out->home, out);
+        }
+    }
+
+    return NULL;
+}
+
+// the queue has to hold every buffer of up to streamCount streams plus the end mark
+static inline int writer_start(size_t streamCount)
+{
+    if (ring_init(&writer.queue, ring_capacity_for(streamCount * writer.bufferCount + 1)) != 0)
+    {
+        LOG("error allocating writer");
+        return -1;
+    }
+
+    atomic_init(&writer.inFlight, 0);
+    atomic_init(&writer.failed, false);
+
+    const int err = start_thread(&writer.thread, &affinity.writer, writer_main, NULL);
+    if (err != 0)
+    {
+        LOG("error creating writer thread: %s", strerror(err));
+        return -1;
+    }
+    writer.running = true;
+
+    return 0;
+}
+
+// waits until everything submitted so far has been written
+static inline int writer_stop()
+{
+    if (!writer.running)
+    {
+        return 0;
+    }
+
+    atomic_fetch_add(&writer.inFlight, 1);
+    ring_push(&writer.queue, &writer.eof);
+
+    const int err = pthread_join(writer.thread, NULL);
+    if (err != 0)
+    {
+        LOG("error joining writer thread: %s", strerror(err));
+        return -1;
+    }
+    writer.running = false;
+
+    return atomic_load(&writer.failed) ? -1 : 0;
+}
+
+static inline void writer_free()
+{
+    ring_destroy(&writer.queue);
+}
+
+////////////////////////////////////////////////////////////////////////
+
+static inline void put_le32(unsigned char *dst, uint32_t value)
+{
+    dst[0] = (unsigned char)(value);
+    dst[1] = (unsigned char)(value >> 8);
+    dst[2] = (unsigned char)(value >> 16);
+    dst[3] = (unsigned char)(value >> 24);
+}
+
+static inline uint32_t get_le32(const unsigned char *src)
+{
+    return (uint32_t)(src[0]) | (uint32_t)(src[1]) << 8 | (uint32_t)(src[2]) << 16 | (uint32_t)(src[3]) << 24;
+}
+
+typedef struct text_t_
+{
+    char *data;
+    size_t size;
+    size_t capacity;
+} text_t;
+
+static inline int text_append(text_t *t, const char *data, size_t size)
+{
+    if (t->size + size > t->capacity)
+    {
+        size_t capacity = t->capacity == 0 ? 4096 : t->capacity * 2;
+        capacity = capacity >= t->size + size ? capacity : t->size + size;
+        char *grown = (char *)realloc(t->data, capacity);
+        if (grown == NULL)
+        {
+            LOG("error growing text buffer");
+            return -1;
+        }
+        t->data = grown;
+        t->capacity = capacity;
+    }
+
+    memcpy(t->data + t->size, data, size);
+    t->size += size;
+    return 0;
+}
+
+static inline void text_free(text_t *t)
+{
+    free(t->data);
+    *t = (text_t){NULL, 0, 0};
+}
+
+// --transform: a line starting with an RFC 3339 timestamp (YYYY-MM-DDTHH:MM:SS, an optional fraction of up to 9
+// digits, Z, +HH:MM, -HH:MM or no offset at all, and a space) is coded as
+//   0x80 | tokens, with TRANSFORM_FORMAT if the fraction digits or the offset differ from the last coded line,
+//   then the format byte (digits | zone << 4) and for a numeric offset its minutes as a varint,
+//   the zigzag varint of its time in units of its last fraction digit minus the one of the last coded line,
+//   per token (the space separated fields after the time, at most TRANSFORM_TOKENS) the slot of a recently seen
+//   one or TRANSFORM_LITERAL and the token with its space,
+//   the rest of the line as is.
+// any other line is a 0 byte followed by the line. the state starts over with every frame, which is preceded by a
+// skippable marker frame saying whether it starts inside a line. version 1 files had no fraction or offset, they
+// read the same as version 2 files whose lines never change format
+
+#define TRANSFORM_MAGIC 0x184D2A5Bu
+#define TRANSFORM_ID "OMZT"
+#define TRANSFORM_VERSION 2
+#define TRANSFORM_MARKER_SIZE 16
+#define TRANSFORM_MID_LINE 0x01u
+#define TRANSFORM_CODED 0x80u
+#define TRANSFORM_FORMAT 0x40u
+#define TRANSFORM_TIME_LEN 19
+#define TRANSFORM_FRACTION_MAX 9
+// time, fraction, offset and space
+#define TRANSFORM_STAMP_MAX (TRANSFORM_TIME_LEN + 1 + TRANSFORM_FRACTION_MAX + 6 + 1)
+#define TRANSFORM_OFFSET_MAX (23 * 60 + 59)
+#define TRANSFORM_TOKENS 2
+#define TRANSFORM_SLOTS 16
+#define TRANSFORM_LITERAL 0x10u
+#define TRANSFORM_TOKEN_MAX 63
+// input is coded this much at a time, the scratch buffer holds the worst case of a 0 byte per line
+#define TRANSFORM_PIECE (64 * 1024)
+
+// the zone of a format byte
+enum
+{
+    ZONE_NONE = 0,
+    ZONE_UTC,
+    ZONE_EAST,
+    ZONE_WEST
+};
+
+enum
+{
+    DECODE_LINE = 0,
+    DECODE_FORMAT,
+    DECODE_OFFSET,
+    DECODE_TIME,
+    DECODE_TOKEN,
+    DECODE_LITERAL,
+    DECODE_REST
+};
+
+typedef struct token_t_
+{
+    size_t len;
+    char text[TRANSFORM_TOKEN_MAX];
+} token_t;
+
+typedef struct transform_t_
+{
+    // the start of the current line is coded already, the rest goes through up to its newline
+    bool midLine;
+    // of the last coded line: seconds of the time as written, the fraction in nanoseconds and the format byte
+    // with the offset in minutes
+    int64_t time;
+    int64_t nanos;
+    unsigned format;
+    uint64_t offset;
+    // most recently used first, per token position
+    token_t tokens[TRANSFORM_TOKENS][TRANSFORM_SLOTS];
+    size_t tokenCount[TRANSFORM_TOKENS];
+
+    // encoder: coded output of a piece
+    char *scratch;
+
+    // decoder: where in a coded line start it is
+    int state;
+    size_t token;
+    size_t lineTokens;
+    uint64_t varint;
+    unsigned shift;
+    token_t literal;
+} transform_t;
+
+static inline transform_t *transform_new(bool encoder)
+{
+    transform_t *t = (transform_t *)calloc(1, sizeof(transform_t));
+    if (t == NULL || (encoder && (t->scratch = (char *)malloc(2 * (2 * TRANSFORM_PIECE) + 1)) == NULL))
+    {
+        LOG("error allocating transform");
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+static inline void transform_free(transform_t *t)
+{
+    if (t != NULL)
+    {
+        free(t->scratch);
+        free(t);
+    }
+}
+
+static inline void transform_reset(transform_t *t, bool midLine)
+{
+    t->midLine = midLine;
+    t->time = 0;
+    t->nanos = 0;
+    t->format = 0;
+    t->offset = 0;
+    t->tokenCount[0] = 0;
+    t->tokenCount[1] = 0;
+    t->state = midLine ? DECODE_REST : DECODE_LINE;
+}
+
+static inline void transform_marker(unsigned char *out, bool midLine)
+{
+    memset(out, 0, TRANSFORM_MARKER_SIZE);
+    put_le32(out, TRANSFORM_MAGIC);
+    put_le32(out + 4, TRANSFORM_MARKER_SIZE - 8);
+    memcpy(out + 8, TRANSFORM_ID, 4);
+    out[12] = TRANSFORM_VERSION;
+    out[13] = midLine ? TRANSFORM_MID_LINE : 0;
+}
+
+// true for the marker of a transformed frame, *midLine is its flag
+static inline bool transform_is_marker(const unsigned char *data, size_t size, bool *midLine)
+{
+    if (size < TRANSFORM_MARKER_SIZE || get_le32(data) != TRANSFORM_MAGIC || get_le32(data + 4) != TRANSFORM_MARKER_SIZE - 8 ||
+        memcmp(data + 8, TRANSFORM_ID, 4) != 0 || data[12] < 1 || data[12] > TRANSFORM_VERSION)
+    {
+        return false;
+    }
+    *midLine = (data[13] & TRANSFORM_MID_LINE) != 0;
+    return true;
+}
+
+static inline int64_t days_from_civil(int64_t y, int64_t m, int64_t d)
+{
+    y -= m <= 2;
+    const int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const int64_t yoe = y - era * 400;
+    const int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    const int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static inline void put_digits(char *out, int64_t value, int width)
+{
+    for (int i = width - 1; i >= 0; i--)
+    {
+        out[i] = (char)('0' + value % 10);
+        value /= 10;
+    }
+}
+
+// YYYY-MM-DDTHH:MM:SS of seconds since 1970 in UTC
+static inline void format_time(int64_t time, char *out)
+{
+    int64_t z = (time >= 0 ? time : time - 86399) / 86400;
+    const int64_t seconds = time - z * 86400;
+    z += 719468;
+    const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    const int64_t doe = z - era * 146097;
+    const int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    const int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    const int64_t mp = (5 * doy + 2) / 153;
+    const int64_t d = doy - (153 * mp + 2) / 5 + 1;
+    const int64_t m = mp < 10 ? mp + 3 : mp - 9;
+    const int64_t y = yoe + era * 400 + (m <= 2);
+
+    put_digits(out, y, 4);
+    out[4] = '-';
+    put_digits(out + 5, m, 2);
+    out[7] = '-';
+    put_digits(out + 8, d, 2);
+    out[10] = 'T';
+    put_digits(out + 11, seconds / 3600, 2);
+    out[13] = ':';
+    put_digits(out + 14, seconds / 60 % 60, 2);
+    out[16] = ':';
+    put_digits(out + 17, seconds % 60, 2);
+}
+
+// only a time that formats back to exactly the same text is coded, that rules out Feb 30 or leap seconds
+static inline bool parse_time(const char *p, int64_t *time)
+{
+    static const char layout[] = "dddd-dd-ddTdd:dd:dd";
+    int64_t fields[6] = {0};
+    size_t field = 0;
+    for (size_t i = 0; i < TRANSFORM_TIME_LEN; i++)
+    {
+        if (layout[i] == 'd')
+        {
+            if (p[i] < '0' || p[i] > '9')
+            {
+                return false;
+            }
+            fields[field] = fields[field] * 10 + (p[i] - '0');
+        }
+        else if (p[i] != layout[i])
+        {
+            return false;
+        }
+        else
+        {
+            field++;
+        }
+    }
+
+    *time = days_from_civil(fields[0], fields[1], fields[2]) * 86400 + fields[3] * 3600 + fields[4] * 60 + fields[5];
+    char check[TRANSFORM_TIME_LEN];
+    format_time(*time, check);
+    return memcmp(check, p, TRANSFORM_TIME_LEN) == 0;
+}
+
+static inline int64_t power10(unsigned exponent)
+{
+    static const int64_t powers[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+    return powers[exponent];
+}
+
+static inline bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// the timestamp at the start of a line up to and with the space after it: *units is its time in units of its
+// last fraction digit, *format and *offset as in transform_t
+static inline size_t parse_stamp(const char *p, const char *lineEnd, int64_t *units, unsigned *format, uint64_t *offset)
+{
+    int64_t seconds = 0;
+    if (lineEnd - p <= TRANSFORM_TIME_LEN || !parse_time(p, &seconds))
+    {
+        return 0;
+    }
+
+    const char *q = p + TRANSFORM_TIME_LEN;
+    unsigned digits = 0;
+    int64_t fraction = 0;
+    if (*q == '.')
+    {
+        for (q++; q < lineEnd && is_digit(*q) && digits <= TRANSFORM_FRACTION_MAX; q++, digits++)
+        {
+            fraction = fraction * 10 + (*q - '0');
+        }
+        if (digits == 0 || digits > TRANSFORM_FRACTION_MAX)
+        {
+            return 0;
+        }
+    }
+
+    unsigned zone = ZONE_NONE;
+    *offset = 0;
+    if (q < lineEnd && *q == 'Z')
+    {
+        zone = ZONE_UTC;
+        q++;
+    }
+    else if (q < lineEnd && (*q == '+' || *q == '-'))
+    {
+        if (lineEnd - q < 6 || !is_digit(q[1]) || !is_digit(q[2]) || q[3] != ':' || !is_digit(q[4]) || !is_digit(q[5]))
+        {
+            return 0;
+        }
+        const unsigned hours = (unsigned)(q[1] - '0') * 10 + (unsigned)(q[2] - '0');
+        const unsigned minutes = (unsigned)(q[4] - '0') * 10 + (unsigned)(q[5] - '0');
+        if (hours > 23 || minutes > 59)
+        {
+            return 0;
+        }
+        zone = *q == '+' ? ZONE_EAST : ZONE_WEST;
+        *offset = hours * 60 + minutes;
+        q += 6;
+    }
+
+    if (q >= lineEnd || *q != ' ' || __builtin_mul_overflow(seconds, power10(digits), units) ||
+        __builtin_add_overflow(*units, fraction, units))
+    {
+        return 0;
+    }
+    *format = digits | zone << 4;
+    return (size_t)(q + 1 - p);
+}
+
+// the time of the last coded line in units of 10^-digits seconds, rounded down
+static inline bool last_units(const transform_t *t, unsigned digits, int64_t *units)
+{
+    return !__builtin_mul_overflow(t->time, power10(digits), units) &&
+           !__builtin_add_overflow(*units, t->nanos / power10(TRANSFORM_FRACTION_MAX - digits), units);
+}
+
+// the timestamp of the last coded line with its space, returns its length
+static inline size_t format_stamp(const transform_t *t, char *out)
+{
+    format_time(t->time, out);
+    size_t len = TRANSFORM_TIME_LEN;
+
+    const unsigned digits = t->format & 0x0f;
+    if (digits > 0)
+    {
+        out[len++] = '.';
+        put_digits(out + len, t->nanos / power10(TRANSFORM_FRACTION_MAX - digits), (int)(digits));
+        len += digits;
+    }
+
+    const unsigned zone = t->format >> 4;
+    if (zone == ZONE_UTC)
+    {
+        out[len++] = 'Z';
+    }
+    else if (zone == ZONE_EAST || zone == ZONE_WEST)
+    {
+        out[len] = zone == ZONE_EAST ? '+' : '-';
+        put_digits(out + len + 1, (int64_t)(t->offset / 60), 2);
+        out[len + 3] = ':';
+        put_digits(out + len + 4, (int64_t)(t->offset % 60), 2);
+        len += 6;
+    }
+
+    out[len++] = ' ';
+    return len;
+}
+
+static inline char *put_varint(char *o, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *o++ = (char)(value | 0x80);
+        value >>= 7;
+    }
+    *o++ = (char)(value);
+    return o;
+}
+
+static inline void token_touch(transform_t *t, size_t position, size_t slot)
+{
+    token_t *tokens = t->tokens[position];
+    const token_t used = tokens[slot];
+    memmove(tokens + 1, tokens, slot * sizeof(token_t));
+    tokens[0] = used;
+}
+
+static inline void token_insert(transform_t *t, size_t position, const char *text, size_t len)
+{
+    token_t *tokens = t->tokens[position];
+    if (t->tokenCount[position] < TRANSFORM_SLOTS)
+    {
+        t->tokenCount[position]++;
+    }
+    memmove(tokens + 1, tokens, (t->tokenCount[position] - 1) * sizeof(token_t));
+    tokens[0].len = len;
+    memcpy(tokens[0].text, text, len);
+}
+
+// codes the start of the line at p, *next is where its uncoded rest begins
+static inline char *encode_line(transform_t *t, const char *p, const char *lineEnd, char *o, const char **next)
+{
+    int64_t units = 0;
+    unsigned format = 0;
+    uint64_t offset = 0;
+    const size_t stampLen = parse_stamp(p, lineEnd, &units, &format, &offset);
+    const unsigned digits = format & 0x0f;
+    int64_t last = 0;
+    int64_t delta = 0;
+    if (stampLen == 0 || !last_units(t, digits, &last) || __builtin_sub_overflow(units, last, &delta))
+    {
+        *o++ = 0;
+        *next = p;
+        return o;
+    }
+
+    const char *q = p + stampLen;
+    const char *tokens[TRANSFORM_TOKENS];
+    size_t lens[TRANSFORM_TOKENS];
+    size_t count = 0;
+    while (count < TRANSFORM_TOKENS)
+    {
+        const char *space = (const char *)memchr(q, ' ', (size_t)(lineEnd - q));
+        if (space == NULL || space == q || space - q > TRANSFORM_TOKEN_MAX)
+        {
+            break;
+        }
+        tokens[count] = q;
+        lens[count] = (size_t)(space - q);
+        count++;
+        q = space + 1;
+    }
+
+    const bool changed = format != t->format || offset != t->offset;
+    *o++ = (char)(TRANSFORM_CODED | (changed ? TRANSFORM_FORMAT : 0) | count);
+    if (changed)
+    {
+        *o++ = (char)(format);
+        const unsigned zone = format >> 4;
+        if (zone == ZONE_EAST || zone == ZONE_WEST)
+        {
+            o = put_varint(o, offset);
+        }
+        t->format = format;
+        t->offset = offset;
+    }
+    o = put_varint(o, ((uint64_t)(delta) << 1) ^ (uint64_t)(delta >> 63));
+
+    // before 1970 units is negative and / rounds towards zero
+    const int64_t unit = power10(digits);
+    t->time = units / unit - (units % unit < 0);
+    t->nanos = (units - t->time * unit) * power10(TRANSFORM_FRACTION_MAX - digits);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t slot = 0;
+        while (slot < t->tokenCount[i] &&
+               (t->tokens[i][slot].len != lens[i] || memcmp(t->tokens[i][slot].text, tokens[i], lens[i]) != 0))
+        {
+            slot++;
+        }
+
+        if (slot < t->tokenCount[i])
+        {
+            *o++ = (char)(slot);
+            token_touch(t, i, slot);
+        }
+        else
+        {
+            *o++ = (char)(TRANSFORM_LITERAL);
+            memcpy(o, tokens[i], lens[i] + 1);
+            o += lens[i] + 1;
+            token_insert(t, i, tokens[i], lens[i]);
+        }
+    }
+
+    *next = q;
+    return o;
+}
+
+// codes data into the scratch buffer and returns its size. a line start is only coded when its time and tokens
+// are all in data, so size is best cut at a line end
+static inline size_t transform_encode(transform_t *t, const char *data, size_t size)
+{
+    char *o = t->scratch;
+    const char *p = data;
+    const char *end = data + size;
+    while (p < end)
+    {
+        if (!t->midLine)
+        {
+            const char *nl = (const char *)memchr(p, '\n', (size_t)(end - p));
+            o = encode_line(t, p, nl == NULL ? end : nl, o, &p);
+            t->midLine = true;
+        }
+
+        const char *nl = (const char *)memchr(p, '\n', (size_t)(end - p));
+        const char *stop = nl == NULL ? end : nl + 1;
+        memcpy(o, p, (size_t)(stop - p));
+        o += stop - p;
+        p = stop;
+        t->midLine = nl == NULL;
+    }
+
+    return (size_t)(o - t->scratch);
+}
+
+// how much of data to code at once: up to the first line end past TRANSFORM_PIECE, or TRANSFORM_PIECE inside a very
+// long line
+static inline size_t transform_piece(const char *data, size_t size)
+{
+    if (size <= TRANSFORM_PIECE)
+    {
+        return size;
+    }
+    const size_t rest = size - TRANSFORM_PIECE < TRANSFORM_PIECE ? size - TRANSFORM_PIECE : TRANSFORM_PIECE;
+    const char *nl = (const char *)memchr(data + TRANSFORM_PIECE, '\n', rest);
+    return nl == NULL ? TRANSFORM_PIECE : (size_t)(nl + 1 - data);
+}
+
+static inline int decode_token(transform_t *t, const token_t *token, text_t *out)
+{
+    t->token++;
+    t->state = t->token < t->lineTokens ? DECODE_TOKEN : DECODE_REST;
+    return text_append(out, token->text, token->len) != 0 || text_append(out, " ", 1) != 0 ? -1 : 0;
+}
+
+// inverts transform_encode, data may be cut anywhere
+static inline int transform_decode(transform_t *t, const char *data, size_t size, text_t *out)
+{
+    const char *p = data;
+    const char *end = data + size;
+    while (p < end)
+    {
+        switch (t->state)
+        {
+        case DECODE_REST:
+        {
+            const char *nl = (const char *)memchr(p, '\n', (size_t)(end - p));
+            const char *stop = nl == NULL ? end : nl + 1;
+            if (text_append(out, p, (size_t)(stop - p)) != 0)
+            {
+                return -1;
+            }
+            p = stop;
+            t->state = nl == NULL ? DECODE_REST : DECODE_LINE;
+            break;
+        }
+        case DECODE_LINE:
+        {
+            const unsigned char head = (unsigned char)(*p++);
+            const unsigned tokens = head & ~(TRANSFORM_CODED | TRANSFORM_FORMAT);
+            if (head != 0 && (!(head & TRANSFORM_CODED) || tokens > TRANSFORM_TOKENS))
+            {
+                return -1;
+            }
+            t->lineTokens = tokens;
+            t->token = 0;
+            t->varint = 0;
+            t->shift = 0;
+            t->state = head == 0 ? DECODE_REST : ((head & TRANSFORM_FORMAT) ? DECODE_FORMAT : DECODE_TIME);
+            break;
+        }
+        case DECODE_FORMAT:
+        {
+            const unsigned format = (unsigned char)(*p++);
+            const unsigned zone = format >> 4;
+            if ((format & 0x0f) > TRANSFORM_FRACTION_MAX || zone > ZONE_WEST)
+            {
+                return -1;
+            }
+            t->format = format;
+            t->offset = 0;
+            t->state = zone == ZONE_EAST || zone == ZONE_WEST ? DECODE_OFFSET : DECODE_TIME;
+            break;
+        }
+        case DECODE_OFFSET:
+        case DECODE_TIME:
+        {
+            const unsigned char byte = (unsigned char)(*p++);
+            if (t->shift > 63)
+            {
+                return -1;
+            }
+            t->varint |= (uint64_t)(byte & 0x7f) << t->shift;
+            t->shift += 7;
+            if (byte & 0x80)
+            {
+                break;
+            }
+
+            const uint64_t value = t->varint;
+            t->varint = 0;
+            t->shift = 0;
+            if (t->state == DECODE_OFFSET)
+            {
+                if (value > TRANSFORM_OFFSET_MAX)
+                {
+                    return -1;
+                }
+                t->offset = value;
+                t->state = DECODE_TIME;
+                break;
+            }
+
+            const unsigned digits = t->format & 0x0f;
+            const int64_t unit = power10(digits);
+            int64_t units = 0;
+            if (!last_units(t, digits, &units) ||
+                __builtin_add_overflow(units, (int64_t)(value >> 1) ^ -(int64_t)(value & 1), &units))
+            {
+                return -1;
+            }
+            t->time = units / unit - (units % unit < 0);
+            t->nanos = (units - t->time * unit) * power10(TRANSFORM_FRACTION_MAX - digits);
+
+            char text[TRANSFORM_STAMP_MAX];
+            if (text_append(out, text, format_stamp(t, text)) != 0)
+            {
+                return -1;
+            }
+            t->state = t->lineTokens > 0 ? DECODE_TOKEN : DECODE_REST;
+            break;
+        }
+        case DECODE_TOKEN:
+        {
+            const unsigned char slot = (unsigned char)(*p++);
+            if (slot == TRANSFORM_LITERAL)
+            {
+                t->literal.len = 0;
+                t->state = DECODE_LITERAL;
+                break;
+            }
+            if (slot >= t->tokenCount[t->token])
+            {
+                return -1;
+            }
+            const token_t token = t->tokens[t->token][slot];
+            token_touch(t, t->token, slot);
+            if (decode_token(t, &token, out) != 0)
+            {
+                return -1;
+            }
+            break;
+        }
+        case DECODE_LITERAL:
+        {
+            const char *space = (const char *)memchr(p, ' ', (size_t)(end - p));
+            const size_t len = (size_t)((space == NULL ? end : space) - p);
+            if (t->literal.len + len > TRANSFORM_TOKEN_MAX)
+            {
+                return -1;
+            }
+            memcpy(t->literal.text + t->literal.len, p, len);
+            t->literal.len += len;
+            p += len;
+            if (space != NULL)
+            {
+                p++;
+                token_insert(t, t->token, t->literal.text, t->literal.len);
+                if (decode_token(t, &t->literal, out) != 0)
+                {
+                    return -1;
+                }
+            }
+            break;
+        }
+        default:
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+// --part: the file (and index) the next rotation of a stream switches to, opened by the reaper ahead of time
+typedef struct spare_t_
+{
+    struct stream_t_ *stream;
+    file_names_t *names;
+    file_names_t *indexNames;
+    FILE *file;
+    FILE *indexFile;
+    // preallocated for this many bytes, complaining about it only once
+    size_t expected;
+    bool quiet;
+    bool preallocateFailed;
+} spare_t;
+
+typedef struct stream_t_
+{
+    size_t outputBufferSize;
+    char *outputBuffer;
+
+    // writer mode: buffers of this stream, the one zstd is currently filling and the written ones
+    output_t *outputs;
+    output_t *current;
+    ring_t free;
+
+    ZSTD_CCtx *zctx;
+    // --memory-limit: where zctx allocates from
+    arena_t *arena;
+    ZSTD_CDict *cdict;
+    ZSTD_inBuffer zInBuf;
+    ZSTD_outBuffer zOutBuf;
+
+    // --mmap: the window of the current file zOutBuf points into
+    char *map;
+    size_t mapStart;
+    size_t mapLength;
+
+    FILE *outFile;
+    const char *outFileName;
+    // routed streams own their file name, the routing key points into it. NULL for the default stream
+    char *routeName;
+    const char *key;
+    size_t keyLen;
+    // compressed into since the last commit
+    bool touched;
+    // --shard-output interleaved: only gets whole frames appended, never compresses anything itself
+    bool framesOnly;
+
+    // compressed bytes written to and uncompressed bytes fed into the current file
+    size_t fileBytes;
+    size_t fileInput;
+    uint64_t fileOpenedAt;
+    // --drop-cache: how much of the current file is dropped from the page cache, see output_t
+    size_t dropped;
+
+    // compressed offset and uncompressed size of the frame in progress, and when its first input came in.
+    // frameFed is what zstd got for it, more or less than frameInput with --transform
+    size_t frameStart;
+    size_t frameInput;
+    size_t frameFed;
+    uint64_t frameOpenedAt;
+
+    // --transform
+    transform_t *transform;
+
+    // --accumulate: input of the frame in progress, zInBuf spans all of it
+    char *stage;
+
+    // --listen: client in the middle of a line of this stream, lines of other clients wait until it is done
+    const struct client_t_ *holder;
+
+    // when the oldest input that zstd may still be holding on to was fed, 0 = everything is flushed
+    uint64_t unflushedSince;
+
+    // only complain about fallocate once
+    bool preallocateFailed;
+
+    // --part: names of the current file and its index, and the file the next rotation switches to.
+    // at most one spare is requested from the reaper at a time
+    file_names_t *names;
+    file_names_t *indexNames;
+    _Atomic(spare_t *) spare;
+    bool spareRequested;
+    unsigned spareSeq;
+    // files activated within the same second get a .N suffix
+    unsigned long nameTime;
+    unsigned nameSeq;
+
+    // all compressed bytes ever written, and how many of them were covered by the last sync request
+    size_t totalBytes;
+    size_t syncedBytes;
+    uint64_t syncRequestedAt;
+
+    // seekable mode: compressed and decompressed size of every finished frame of the current file
+    uint32_t *seekTable;
+    size_t seekFrames;
+    size_t seekCapacity;
+
+    // --index: sidecar of the current file and the segment since the last frame end or flush point
+    FILE *indexFile;
+    size_t indexCompressed;
+    size_t indexInput;
+    size_t indexLines;
+    int64_t indexMin;
+    int64_t indexMax;
+    bool indexFrameStart;
+    // the next input continues a line whose start was already looked at
+    bool indexMidLine;
+} stream_t;
+
+static stream_t stream = {
+    .outputBufferSize = 1024 * 1024 * 8,
+    .outputBuffer = NULL,
+    .outputs = NULL,
+    .current = NULL,
+    .zctx = NULL,
+    .arena = NULL,
+    .cdict = NULL,
+    .zInBuf = {
+        .src = NULL,
+        .size = 0,
+        .pos = 0},
+    .zOutBuf = {.dst = NULL, .size = 0, .pos = 0},
+    .map = NULL,
+    .mapStart = 0,
+    .mapLength = 0,
+    .outFile = NULL,
+    .outFileName = NULL,
+    .routeName = NULL,
+    .key = NULL,
+    .keyLen = 0,
+    .touched = false,
+    .framesOnly = false,
+    .fileBytes = 0,
+    .fileInput = 0,
+    .fileOpenedAt = 0,
+    .dropped = 0,
+    .preallocateFailed = false,
+    .names = NULL,
+    .indexNames = NULL,
+    .spare = NULL,
+    .spareRequested = false,
+    .spareSeq = 0,
+    .nameTime = 0,
+    .nameSeq = 0,
+    .frameStart = 0,
+    .frameInput = 0,
+    .frameFed = 0,
+    .frameOpenedAt = 0,
+    .transform = NULL,
+    .holder = NULL,
+    .unflushedSince = 0,
+    .totalBytes = 0,
+    .syncedBytes = 0,
+    .syncRequestedAt = 0,
+    .seekTable = NULL,
+    .seekFrames = 0,
+    .seekCapacity = 0,
+    .indexFile = NULL,
+    .indexLines = 0,
+    .indexMidLine = false};
+
+// --mmap: maps the output buffer over the file from fileBytes on, the file is extended to cover all of it
+static inline int map_window(stream_t *s)
+{
+    const int fd = fileno(s->outFile);
+    const size_t page = (size_t)(sysconf(_SC_PAGESIZE));
+    const size_t start = s->fileBytes / page * page;
+    const size_t length = (s->outputBufferSize + page - 1) / page * page + page;
+
+    if (s->map != NULL && munmap(s->map, s->mapLength) != 0)
+    {
+        LOG("error unmapping output file: %s", strerror(errno));
+        return -1;
+    }
+    s->map = NULL;
+
+    // allocated up front, running out of space while writing to the mapping would be a SIGBUS
+    if (fallocate(fd, 0, (off_t)(start), (off_t)(length)) != 0 &&
+        (errno != EOPNOTSUPP || ftruncate(fd, (off_t)(start + length)) != 0))
+    {
+        LOG("error extending output file for mapping: %s", strerror(errno));
+        return -1;
+    }
+
+    void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)(start));
+    if (map == MAP_FAILED)
+    {
+        LOG("error mapping output file: %s", strerror(errno));
+        return -1;
+    }
+    if (madvise(map, length, MADV_SEQUENTIAL) != 0)
+    {
+        LOG("error setting access pattern of output mapping: %s", strerror(errno));
+    }
+
+    s->map = (char *)map;
+    s->mapStart = start;
+    s->mapLength = length;
+    s->outputBuffer = s->map + (s->fileBytes - start);
+    s->zOutBuf.dst = s->outputBuffer;
+    s->zOutBuf.size = length - (s->fileBytes - start);
+    s->zOutBuf.pos = 0;
+    return 0;
+}
+
+// --mmap: drops the window and cuts the file back to what was written, the stdio position follows so closing
+// and trimming the file works as usual
+static inline int unmap_file(stream_t *s)
+{
+    if (s->map == NULL)
+    {
+        return 0;
+    }
+
+    const int unmapped = munmap(s->map, s->mapLength);
+    s->map = NULL;
+    s->outputBuffer = NULL;
+    if (unmapped != 0 || ftruncate(fileno(s->outFile), (off_t)(s->fileBytes)) != 0 ||
+        fseeko(s->outFile, (off_t)(s->fileBytes), SEEK_SET) != 0)
+    {
+        LOG("error finishing mapped output file: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// --mmap: the output is in the file already, the window moves on once zstd could not use what is left of it
+static inline int submit_mapped(stream_t *s, unsigned flags, uint64_t seq)
+{
+    const output_t out = {
+        .buffer = s->outputBuffer,
+        .size = s->zOutBuf.pos,
+        .file = s->outFile,
+        .flags = flags | OUTPUT_MAPPED,
+        .seq = seq,
+        .offset = s->fileBytes,
+        .home = NULL,
+        .names = (flags & OUTPUT_CLOSE) ? s->names : NULL,
+        .dropped = &s->dropped};
+    s->totalBytes += s->zOutBuf.pos;
+    s->fileBytes += s->zOutBuf.pos;
+
+    if ((flags & OUTPUT_CLOSE) && unmap_file(s) != 0)
+    {
+        return -1;
+    }
+    if (perform_output(&out, false) != 0)
+    {
+        return -1;
+    }
+    if (flags & OUTPUT_CLOSE)
+    {
+        return 0;
+    }
+
+    if (s->zOutBuf.size - s->zOutBuf.pos < ZSTD_CStreamOutSize())
+    {
+        return map_window(s);
+    }
+    s->outputBuffer += s->zOutBuf.pos;
+    s->zOutBuf.dst = s->outputBuffer;
+    s->zOutBuf.size -= s->zOutBuf.pos;
+    s->zOutBuf.pos = 0;
+    return 0;
+}
+
+// hands the compressed data in the output buffer to the writer, flags apply to the current output file
+static inline int submit_output_seq(stream_t *s, unsigned flags, uint64_t seq)
+{
+    if (s->zOutBuf.pos == 0 && flags == 0)
+    {
+        return 0;
+    }
+    stats_add(&stats.compressedBytes, s->zOutBuf.pos);
+
+    if (config.mmap)
+    {
+        return submit_mapped(s, flags, seq);
+    }
+
+    if (!writer.enabled)
+    {
+        const output_t out = {
+            .buffer = s->outputBuffer,
+            .size = s->zOutBuf.pos,
+            .file = s->outFile,
+            .flags = flags,
+            .seq = seq,
+            .offset = s->fileBytes,
+            .home = NULL,
+            .names = (flags & OUTPUT_CLOSE) ? s->names : NULL,
+            .dropped = &s->dropped};
+        if (perform_output(&out, false) != 0)
+        {
+            return -1;
+        }
+        s->totalBytes += s->zOutBuf.pos;
+        s->fileBytes += s->zOutBuf.pos;
+        s->zOutBuf.pos = 0;
+        return 0;
+    }
+
+    if (UNLIKELY(atomic_load_explicit(&writer.failed, memory_order_relaxed)))
+    {
+        LOG("writer failed, exiting");
+        return -1;
+    }
+
+    s->current->size = s->zOutBuf.pos;
+    s->current->file = s->outFile;
+    s->current->flags = flags;
+    s->current->seq = seq;
+    s->current->offset = s->fileBytes;
+    s->current->names = (flags & OUTPUT_CLOSE) ? s->names : NULL;
+    atomic_fetch_add(&writer.inFlight, 1);
+    ring_push(&writer.queue, s->current);
+    s->fileBytes += s->zOutBuf.pos;
+    s->totalBytes += s->zOutBuf.pos;
+
+    // waiting for a written buffer is our backpressure
+    if (ring_empty(&s->free))
+    {
+        writer.stalls++;
+    }
+    s->current = (output_t *)ring_pop(&s->free);
+    s->outputBuffer = s->current->buffer;
+    s->zOutBuf.dst = s->outputBuffer;
+    s->zOutBuf.pos = 0;
+    return 0;
+}
+
+static inline int submit_output(stream_t *s, unsigned flags)
+{
+    return submit_output_seq(s, flags, 0);
+}
+
+static inline int write_output(stream_t *s)
+{
+    // with a writer thread small writes are batched up for as long as it is busy
+    if (writer.enabled && s->zOutBuf.pos < s->zOutBuf.size && atomic_load(&writer.inFlight) > 0)
+    {
+        return 0;
+    }
+
+    return submit_output(s, 0);
+}
+
+static inline size_t compress_stream(stream_t *s, ZSTD_inBuffer *in, ZSTD_EndDirective mode)
+{
+    PROBE(compress__start, in->size - in->pos, mode);
+    const bool timed = stats.socketPath != NULL;
+    const uint64_t start = timed ? now_us() : 0;
+    const size_t ret = ZSTD_compressStream2(s->zctx, &s->zOutBuf, in, mode);
+    if (timed)
+    {
+        observe(&stats.compressTime, now_us() - start, 1);
+    }
+    PROBE(compress__end, in->pos, s->zOutBuf.pos, ret);
+    return ret;
+}
+
+// copies raw bytes (skippable frames) into the output
+static inline int append_output(stream_t *s, const void *data, size_t size)
+{
+    const char *src = (const char *)data;
+    while (size > 0)
+    {
+        const size_t n = size < s->zOutBuf.size - s->zOutBuf.pos ? size : s->zOutBuf.size - s->zOutBuf.pos;
+        memcpy((char *)s->zOutBuf.dst + s->zOutBuf.pos, src, n);
+        s->zOutBuf.pos += n;
+        src += n;
+        size -= n;
+
+        if (s->zOutBuf.pos == s->zOutBuf.size && submit_output(s, 0) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// --accumulate without --max-flush-latency or per-commit durability: zstd only runs once a frame is complete, so it
+// also writes the frame in place instead of going through a buffer of its own
+static inline bool stable_output()
+{
+    return config.accumulate > 0 && config.maxFlushLatency == 0 && durability.policy != DURABILITY_COMMIT;
+}
+
+// hands data to zstd, only writing output once the output buffer is full
+static inline int feed_zstd(stream_t *s, const char *data, size_t size)
+{
+    if (s->stage != NULL)
+    {
+        // compress_lines keeps the frame within the stage, zstd gets it at the next flush or frame end
+        memcpy(s->stage + s->zInBuf.size, data, size);
+        s->zInBuf.size += size;
+        s->frameFed += size;
+        return 0;
+    }
+
+    s->zInBuf.src = data;
+    s->zInBuf.size = size;
+    s->zInBuf.pos = 0;
+    s->frameFed += size;
+
+    while (s->zInBuf.pos != s->zInBuf.size)
+    {
+        const size_t remaining = compress_stream(s, &s->zInBuf, ZSTD_e_continue);
+        if (UNLIKELY(ZSTD_isError(remaining)))
+        {
+            LOG("error compressing input: %s", ZSTD_getErrorName(remaining));
+            return -1;
+        }
+
+        if (s->zOutBuf.pos == s->zOutBuf.size && write_output(s) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// feeds data into the current frame. with --transform it is coded first, and every frame starts over behind a
+// marker so it decodes on its own
+static inline int compress_input(stream_t *s, const char *data, size_t size)
+{
+    const bool frameStart = s->frameInput == 0;
+    if (config.checkpointInterval > 0 && frameStart)
+    {
+        s->frameOpenedAt = now_ms();
+    }
+    s->fileInput += size;
+    s->frameInput += size;
+    if (config.maxFlushLatency > 0 && s->unflushedSince == 0)
+    {
+        s->unflushedSince = now_ms();
+    }
+
+    transform_t *t = s->transform;
+    if (t == NULL)
+    {
+        return feed_zstd(s, data, size);
+    }
+
+    if (frameStart)
+    {
+        unsigned char marker[TRANSFORM_MARKER_SIZE];
+        transform_marker(marker, t->midLine);
+        transform_reset(t, t->midLine);
+        if (append_output(s, marker, sizeof marker) != 0)
+        {
+            return -1;
+        }
+    }
+
+    while (size > 0)
+    {
+        const size_t piece = transform_piece(data, size);
+        if (feed_zstd(s, t->scratch, transform_encode(t, data, piece)) != 0)
+        {
+            return -1;
+        }
+        data += piece;
+        size -= piece;
+    }
+
+    return 0;
+}
+
+static inline int record_frame(stream_t *s, size_t compressed, size_t decompressed)
+{
+    if (s->seekFrames == s->seekCapacity)
+    {
+        const size_t capacity = s->seekCapacity == 0 ? 256 : s->seekCapacity * 2;
+        uint32_t *table = (uint32_t *)realloc(s->seekTable, capacity * 2 * sizeof(uint32_t));
+        if (table == NULL)
+        {
+            LOG("error growing seek table");
+            return -1;
+        }
+        s->seekTable = table;
+        s->seekCapacity = capacity;
+    }
+
+    s->seekTable[s->seekFrames * 2] = (uint32_t)(compressed);
+    s->seekTable[s->seekFrames * 2 + 1] = (uint32_t)(decompressed);
+    s->seekFrames++;
+    return 0;
+}
+
+#define SEEKABLE_SKIPPABLE_MAGIC 0x184D2A5Eu
+#define SEEKABLE_MAGIC 0x8F92EAB1u
+
+// appends the seek table of the zstd seekable format as a skippable frame, entries carry no checksum
+static inline int write_seek_table(stream_t *s)
+{
+    unsigned char header[8];
+    put_le32(header, SEEKABLE_SKIPPABLE_MAGIC);
+    put_le32(header + 4, (uint32_t)(s->seekFrames * 8 + 9));
+    if (append_output(s, header, sizeof header) != 0)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < s->seekFrames; i++)
+    {
+        unsigned char entry[8];
+        put_le32(entry, s->seekTable[i * 2]);
+        put_le32(entry + 4, s->seekTable[i * 2 + 1]);
+        if (append_output(s, entry, sizeof entry) != 0)
+        {
+            return -1;
+        }
+    }
+
+    unsigned char footer[9];
+    put_le32(footer, (uint32_t)(s->seekFrames));
+    footer[4] = 0;
+    put_le32(footer + 5, SEEKABLE_MAGIC);
+    if (append_output(s, footer, sizeof footer) != 0)
+    {
+        return -1;
+    }
+
+    s->seekFrames = 0;
+    return 0;
+}
+
+typedef struct sidecar_t_
+{
+    bool enabled;
+    // field of a line holding its timestamp (1-based, space separated) and its strptime format, "epoch" = seconds
+    size_t field;
+    const char *format;
+} sidecar_t;
+
+static sidecar_t sidecar = {
+    .enabled = false,
+    .field = 1,
+    .format = "%Y-%m-%dT%H:%M:%S"};
+
+// timestamps mostly repeat from line to line, so the text strptime consumed last time is remembered.
+// per thread, --shards indexes on several at once
+typedef struct time_cache_t_
+{
+    char text[64];
+    size_t len;
+    int64_t value;
+} time_cache_t;
+
+static _Thread_local time_cache_t timeCache = {.len = 0, .value = 0};
+
+#define INDEX_NO_TIME INT64_MIN
+
+// parses the timestamp at the start of text into seconds since the epoch. fractional seconds are skipped and a
+// trailing Z or +hh:mm offset the format itself does not consume is applied
+static inline int64_t parse_timestamp(const char *text, size_t len)
+{
+    const char *end = text + len;
+    int64_t value = 0;
+
+    if (strcmp(sidecar.format, "epoch") == 0)
+    {
+        if (text == end || *text < '0' || *text > '9')
+        {
+            return INDEX_NO_TIME;
+        }
+        while (text < end && *text >= '0' && *text <= '9')
+        {
+            value = value * 10 + (*text++ - '0');
+        }
+        return value;
+    }
+
+    if (timeCache.len > 0 && len >= timeCache.len && memcmp(text, timeCache.text, timeCache.len) == 0)
+    {
+        value = timeCache.value;
+        text += timeCache.len;
+    }
+    else
+    {
+        char buf[sizeof timeCache.text];
+        const size_t n = len < sizeof buf - 1 ? len : sizeof buf - 1;
+        memcpy(buf, text, n);
+        buf[n] = '\0';
+
+        struct tm tm;
+        memset(&tm, 0, sizeof tm);
+        const char *parsed = strptime(buf, sidecar.format, &tm);
+        if (parsed == NULL || parsed == buf)
+        {
+            return INDEX_NO_TIME;
+        }
+
+        value = (int64_t)(timegm(&tm)) - tm.tm_gmtoff;
+        timeCache.len = (size_t)(parsed - buf);
+        memcpy(timeCache.text, buf, timeCache.len);
+        timeCache.value = value;
+        text += timeCache.len;
+    }
+
+    if (text < end && *text == '.')
+    {
+        text++;
+        while (text < end && *text >= '0' && *text <= '9')
+        {
+            text++;
+        }
+    }
+
+    if (end - text >= 6 && (*text == '+' || *text == '-') && text[3] == ':')
+    {
+        const int64_t offset = ((text[1] - '0') * 10 + (text[2] - '0')) * 3600 + ((text[4] - '0') * 10 + (text[5] - '0')) * 60;
+        value += *text == '+' ? -offset : offset;
+    }
+
+    return value;
+}
+
+// counts the lines of data and widens the segment's time range by their timestamps
+static inline void index_lines(stream_t *s, const char *data, size_t size)
+{
+    const char *end = data + size;
+    while (data < end)
+    {
+        const char *nl = (const char *)memchr(data, '\n', (size_t)(end - data));
+        const size_t len = nl == NULL ? (size_t)(end - data) : (size_t)(nl - data);
+
+        if (!s->indexMidLine)
+        {
+            const char *field = find_field(data, len, sidecar.field, ' ');
+            const int64_t t = field == NULL ? INDEX_NO_TIME : parse_timestamp(field, (size_t)(data + len - field));
+            if (t != INDEX_NO_TIME)
+            {
+                s->indexMin = s->indexMin == INDEX_NO_TIME || t < s->indexMin ? t : s->indexMin;
+                s->indexMax = s->indexMax == INDEX_NO_TIME || t > s->indexMax ? t : s->indexMax;
+            }
+        }
+
+        if (nl == NULL)
+        {
+            s->indexMidLine = true;
+            break;
+        }
+        s->indexMidLine = false;
+        s->indexLines++;
+        data = nl + 1;
+    }
+}
+
+static inline void index_reset(stream_t *s, size_t compressed, bool frameStart)
+{
+    s->indexCompressed = compressed;
+    s->indexInput = s->fileInput;
+    s->indexLines = 0;
+    s->indexMin = INDEX_NO_TIME;
+    s->indexMax = INDEX_NO_TIME;
+    s->indexFrameStart = frameStart;
+}
+
+// closes the segment at a frame end or flush point, compressed is the output position right after it
+static inline int index_point(stream_t *s, size_t compressed, bool frameEnd)
+{
+    if (s->indexFile == NULL || s->fileInput == s->indexInput)
+    {
+        return 0;
+    }
+
+    char times[64];
+    if (s->indexMin == INDEX_NO_TIME)
+    {
+        snprintf(times, sizeof times, "-\t-");
+    }
+    else
+    {
+        snprintf(times, sizeof times, "%lld\t%lld", (long long)(s->indexMin), (long long)(s->indexMax));
+    }
+
+    if (fprintf(s->indexFile, "%zu\t%zu\t%zu\t%zu\t%zu\t%s\t%d\n", s->indexCompressed, compressed - s->indexCompressed,
+                s->indexInput, s->fileInput - s->indexInput, s->indexLines, times, s->indexFrameStart ? 1 : 0) < 0)
+    {
+        LOG("error writing index: %s", strerror(errno));
+        return -1;
+    }
+
+    index_reset(s, compressed, frameEnd);
+    return 0;
+}
+
+static inline FILE *index_create(const char *indexName)
+{
+    FILE *file = fopen(indexName, "wbx");
+    if (file == NULL)
+    {
+        LOG("error opening index file ('%s'): %s", indexName, strerror(errno));
+        return NULL;
+    }
+
+    fprintf(file, "# compressed_offset\tcompressed_size\tuncompressed_offset\tuncompressed_size\tlines\t"
+                  "min_time\tmax_time\tframe_start\n");
+    return file;
+}
+
+// the index of a new file starts with its first segment
+static inline void index_start(stream_t *s)
+{
+    index_reset(s, 0, true);
+    s->indexMidLine = false;
+}
+
+static inline int index_open(stream_t *s, const char *fileName)
+{
+    char indexName[2048 + 4] = {0};
+    snprintf(indexName, sizeof indexName, "%s.idx", fileName);
+
+    s->indexFile = index_create(indexName);
+    if (s->indexFile == NULL)
+    {
+        return -1;
+    }
+
+    index_start(s);
+    return 0;
+}
+
+// ends the current frame
+static inline int flush_zstd(stream_t *s)
+{
+    const ZSTD_EndDirective mode = ZSTD_e_end;
+    ZSTD_inBuffer empty = {"", 0, 0};
+    // --accumulate: the stage still holds the frame, or what came in since the last flush
+    ZSTD_inBuffer *input = s->stage != NULL ? &s->zInBuf : &empty;
+
+    // a seekable file does not need an empty frame in front of its seek table
+    if ((config.seekableFrameSize > 0 || s->framesOnly) && s->frameInput == 0)
+    {
+        return 0;
+    }
+
+    // zstd may not see the output buffer move until the frame is done, so there has to be room for all of it
+    const bool stable = stable_output();
+    if (stable && s->zOutBuf.size - s->zOutBuf.pos < ZSTD_compressBound(input->size) && submit_output(s, 0) != 0)
+    {
+        LOG("error writing compressed buffer to file, exiting");
+        return -1;
+    }
+
+    size_t remaining = 0;
+    do
+    {
+        remaining = compress_stream(s, input, mode);
+        if (ZSTD_isError(remaining))
+        {
+            LOG("error flushing ZSTD buffer: %s", ZSTD_getErrorName(remaining));
+            return -1;
+        }
+
+        if (!stable && write_output(s) != 0)
+        {
+            LOG("error writing compressed buffer to file, exiting");
+            return -1;
+        }
+        // TODO: add an upper limit of how often we try to flush
+    } while (remaining != 0);
+
+    s->unflushedSince = 0;
+
+    const size_t frameEnd = s->fileBytes + s->zOutBuf.pos;
+    PROBE(frame__end, frameEnd - s->frameStart, s->frameFed);
+    if ((config.seekableFrameSize > 0 && record_frame(s, frameEnd - s->frameStart, s->frameFed) != 0) ||
+        index_point(s, frameEnd, true) != 0)
+    {
+        return -1;
+    }
+    s->frameInput = 0;
+    s->frameFed = 0;
+    if (s->stage != NULL)
+    {
+        s->zInBuf.size = 0;
+        s->zInBuf.pos = 0;
+    }
+
+    if (submit_output(s, 0) != 0)
+    {
+        LOG("error writing compressed buffer to file, exiting");
+        return -1;
+    }
+    s->frameStart = s->fileBytes;
+
+    return 0;
+}
+
+// pushes everything zstd buffered so far out to the file without ending the frame
+static inline int flush_stream(stream_t *s)
+{
+    ZSTD_inBuffer empty = {"", 0, 0};
+    ZSTD_inBuffer *input = s->stage != NULL ? &s->zInBuf : &empty;
+
+    size_t remaining = 0;
+    do
+    {
+        remaining = compress_stream(s, input, ZSTD_e_flush);
+        if (ZSTD_isError(remaining))
+        {
+            LOG("error flushing ZSTD buffer: %s", ZSTD_getErrorName(remaining));
+            return -1;
+        }
+
+        if (s->zOutBuf.pos == s->zOutBuf.size && submit_output(s, 0) != 0)
+        {
+            return -1;
+        }
+    } while (remaining != 0);
+
+    s->unflushedSince = 0;
+
+    if (index_point(s, s->fileBytes + s->zOutBuf.pos, false) != 0)
+    {
+        return -1;
+    }
+
+    if (submit_output(s, OUTPUT_FLUSH) != 0)
+    {
+        LOG("error writing compressed buffer to file, exiting");
+        return -1;
+    }
+
+    return 0;
+}
+
+// flushes once the oldest unflushed input is older than --max-flush-latency, so bursts still get full blocks
+static inline int check_flush_latency(stream_t *s)
+{
+    if (config.maxFlushLatency > 0 && s->unflushedSince != 0 &&
+        now_ms() - s->unflushedSince >= config.maxFlushLatency)
+    {
+        return flush_stream(s);
+    }
+
+    return 0;
+}
+
+// --checkpoint-interval: ends the frame at the block boundary and hands it to the kernel, a SIGKILL then leaves
+// a file that is valid up to here. surviving a power loss takes --durability on top
+static inline int check_checkpoint(stream_t *s)
+{
+    if (config.checkpointInterval > 0 && s->frameInput > 0 && now_ms() - s->frameOpenedAt >= config.checkpointInterval)
+    {
+        if (flush_zstd(s) != 0 || submit_output(s, OUTPUT_FLUSH) != 0)
+        {
+            LOG("error writing checkpoint, exiting");
+            return -1;
+        }
+        stats_add(&stats.checkpoints, 1);
+    }
+
+    return 0;
+}
+
+// requests a sync of everything written so far once --sync-interval or --sync-bytes is reached
+static inline int check_sync(stream_t *s)
+{
+    bool due = false;
+    if (durability.policy == DURABILITY_INTERVAL)
+    {
+        due = s->totalBytes + s->zOutBuf.pos > s->syncedBytes &&
+              now_ms() - s->syncRequestedAt >= durability.interval;
+    }
+    else if (durability.policy == DURABILITY_BYTES)
+    {
+        due = s->totalBytes + s->zOutBuf.pos - s->syncedBytes >= durability.bytes;
+    }
+
+    if (!due)
+    {
+        return 0;
+    }
+
+    if (submit_output(s, OUTPUT_SYNC) != 0)
+    {
+        LOG("error syncing output, exiting");
+        return -1;
+    }
+    s->syncedBytes = s->totalBytes;
+    s->syncRequestedAt = now_ms();
+    return 0;
+}
+
+// ends the last frame of the current file and appends its trailers
+static inline int finish_file(stream_t *s)
+{
+    if (flush_zstd(s) != 0)
+    {
+        return -1;
+    }
+
+    if (config.seekableFrameSize > 0 && (write_seek_table(s) != 0 || submit_output(s, 0) != 0))
+    {
+        LOG("error writing seek table, exiting");
+        return -1;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+typedef struct dictionary_t_
+{
+    // dictionary loaded at startup with --dictionary
+    const char *path;
+    int level;
+    ZSTD_CDict *cdict;
+
+    // --train-dictionary: lines are sampled until samplesCapacity is reached, then a trainer thread builds the
+    // dictionary, writes it to trainPath.<dictID> and hands it over for the next file. an existing dictionary file
+    // is never replaced, old files still need it
+    const char *trainPath;
+    size_t size;
+
+    char *samples;
+    size_t samplesSize;
+    size_t samplesCapacity;
+    size_t *sampleSizes;
+    size_t sampleCount;
+    size_t sampleSizesCapacity;
+
+    pthread_t trainer;
+    bool training;
+    _Atomic(ZSTD_CDict *) trained;
+} dictionary_t;
+
+static dictionary_t dictionary = {
+    .path = NULL,
+    .level = 3,
+    .cdict = NULL,
+    .trainPath = NULL,
+    // same default as `zstd --train`
+    .size = 112640,
+    .samples = NULL,
+    .samplesSize = 0,
+    .samplesCapacity = 0,
+    .sampleSizes = NULL,
+    .sampleCount = 0,
+    .sampleSizesCapacity = 0,
+    .training = false};
+
+// the newest dictionary, streams pick it up whenever they start a file
+static inline ZSTD_CDict *current_dictionary()
+{
+    ZSTD_CDict *trained = dictionary.trainPath != NULL ? atomic_load_explicit(&dictionary.trained, memory_order_acquire) : NULL;
+    return trained != NULL ? trained : dictionary.cdict;
+}
+
+static inline int use_dictionary(stream_t *s, ZSTD_CDict *cdict)
+{
+    const size_t err = ZSTD_CCtx_refCDict(s->zctx, cdict);
+    if (ZSTD_isError(err))
+    {
+        LOG("error referencing dictionary: %s", ZSTD_getErrorName(err));
+        return -1;
+    }
+
+    s->cdict = cdict;
+    return 0;
+}
+
+// zstd recommends about a hundred times the dictionary size worth of samples, within reason
+#define DICTIONARY_SAMPLES_MAX (256 * 1024 * 1024)
+
+static inline size_t samples_capacity()
+{
+    return dictionary.size * 100 < DICTIONARY_SAMPLES_MAX ? dictionary.size * 100 : DICTIONARY_SAMPLES_MAX;
+}
+
+// a whole dictionary file, NULL after logging why not
+static inline char *read_dictionary(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        LOG("error opening dictionary ('%s'): %s", path, strerror(errno));
+        return NULL;
+    }
+
+    char *buffer = NULL;
+    long len = -1;
+    *size = 0;
+    if (fseek(file, 0, SEEK_END) == 0 && (len = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0)
+    {
+        *size = (size_t)(len);
+        buffer = (char *)malloc(*size);
+    }
+
+    if (buffer == NULL || fread(buffer, 1, *size, file) != *size)
+    {
+        LOG("error reading dictionary ('%s')", path);
+        free(buffer);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+
+    return buffer;
+}
+
+static inline int load_dictionary()
+{
+    size_t size = 0;
+    char *buffer = read_dictionary(dictionary.path, &size);
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+
+    dictionary.cdict = ZSTD_createCDict(buffer, size, dictionary.level);
+    free(buffer);
+    if (dictionary.cdict == NULL)
+    {
+        LOG("error creating dictionary from '%s'", dictionary.path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *trainer_main(void *arg)
+{
+    (void)arg;
+
+    void *dict = malloc(dictionary.size);
+    if (dict == NULL)
+    {
+        LOG("error allocating dictionary");
+        return NULL;
+    }
+
+    const size_t len = ZDICT_trainFromBuffer(dict, dictionary.size, dictionary.samples, dictionary.sampleSizes,
+                                             (unsigned)(dictionary.sampleCount));
+    if (ZDICT_isError(len))
+    {
+        LOG("error training dictionary from %zu samples: %s", dictionary.sampleCount, ZDICT_getErrorName(len));
+        free(dict);
+        return NULL;
+    }
+
+    // written next to the target and linked, so a reader never sees half a dictionary and a dictionary that
+    // files were compressed with is never replaced
+    const unsigned id = ZDICT_getDictID(dict, len);
+    char name[2048] = {0};
+    char tmpName[2048] = {0};
+    snprintf(name, 2048, "%s.%u", dictionary.trainPath, id);
+    snprintf(tmpName, 2048, "%s.%d.tmp", name, myPid);
+
+    FILE *file = fopen(tmpName, "wbx");
+    if (file == NULL || fwrite(dict, 1, len, file) != len || close_file(file) != 0 ||
+        (link(tmpName, name) != 0 && errno != EEXIST))
+    {
+        LOG("error writing dictionary ('%s'): %s", name, strerror(errno));
+        unlink(tmpName);
+        free(dict);
+        return NULL;
+    }
+    unlink(tmpName);
+
+    // the id comes from the content, a file that is already there is the same dictionary from an earlier run
+    size_t size = 0;
+    char *existing = read_dictionary(name, &size);
+    if (existing == NULL || size != len || memcmp(existing, dict, len) != 0)
+    {
+        LOG("dictionary '%s' is already there with other content, not using the new one", name);
+        free(existing);
+        free(dict);
+        return NULL;
+    }
+    free(existing);
+
+    LOG("trained dictionary %u from %zu samples into '%s', used from the next file on", id, dictionary.sampleCount, name);
+
+    atomic_store(&dictionary.trained, ZSTD_createCDict(dict, len, dictionary.level));
+    free(dict);
+    return NULL;
+}
+
+static inline int start_training()
+{
+    dictionary.training = true;
+
+    const int err = pthread_create(&dictionary.trainer, NULL, trainer_main, NULL);
+    if (err != 0)
+    {
+        LOG("error creating dictionary trainer thread: %s", strerror(err));
+        dictionary.training = false;
+        return -1;
+    }
+
+    return 0;
+}
+
+// copies lines into the training sample set until it is full
+static inline int sample_lines(const char *data, size_t size)
+{
+    if (dictionary.trainPath == NULL || dictionary.training)
+    {
+        return 0;
+    }
+
+    while (size > 0 && dictionary.samplesSize < dictionary.samplesCapacity)
+    {
+        const char *nl = (const char *)memchr(data, '\n', size);
+        const size_t len = nl == NULL ? size : (size_t)(nl - data) + 1;
+        if (len > dictionary.samplesCapacity - dictionary.samplesSize)
+        {
+            break;
+        }
+
+        if (dictionary.sampleCount == dictionary.sampleSizesCapacity)
+        {
+            const size_t capacity = dictionary.sampleSizesCapacity == 0 ? 4096 : dictionary.sampleSizesCapacity * 2;
+            size_t *sizes = (size_t *)realloc(dictionary.sampleSizes, capacity * sizeof(size_t));
+            if (sizes == NULL)
+            {
+                LOG("error growing dictionary samples");
+                return -1;
+            }
+            dictionary.sampleSizes = sizes;
+            dictionary.sampleSizesCapacity = capacity;
+        }
+
+        memcpy(dictionary.samples + dictionary.samplesSize, data, len);
+        dictionary.samplesSize += len;
+        dictionary.sampleSizes[dictionary.sampleCount++] = len;
+        data += len;
+        size -= len;
+    }
+
+    if (size > 0)
+    {
+        // the sample set is full
+        return start_training();
+    }
+
+    return 0;
+}
+
+static inline int dictionary_init()
+{
+    if (dictionary.path != NULL && load_dictionary() != 0)
+    {
+        return -1;
+    }
+
+    if (dictionary.trainPath != NULL)
+    {
+        dictionary.samplesCapacity = samples_capacity();
+        dictionary.samples = (char *)malloc(dictionary.samplesCapacity);
+        if (dictionary.samples == NULL)
+        {
+            LOG("error allocating dictionary samples");
+            return -1;
+        }
+        atomic_init(&dictionary.trained, NULL);
+    }
+
+    return 0;
+}
+
+// a sample set that never filled up is dropped, and a trainer that is still busy does not hold up the exit:
+// nothing would be compressed with its dictionary anymore
+static inline void dictionary_finish()
+{
+    if (dictionary.training && pthread_tryjoin_np(dictionary.trainer, NULL) != 0)
+    {
+        // it still reads the samples, the process exit takes it down
+        LOG("dictionary training is still running, dropping it");
+        return;
+    }
+    dictionary.training = false;
+
+    ZSTD_freeCDict(atomic_exchange(&dictionary.trained, NULL));
+
+    free(dictionary.samples);
+    dictionary.samples = NULL;
+    free(dictionary.sampleSizes);
+    dictionary.sampleSizes = NULL;
+
+    ZSTD_freeCDict(dictionary.cdict);
+    dictionary.cdict = NULL;
+}
+
+// the size a new file is preallocated for: the previous file or else --rotate-size, 0 = nothing
+static inline size_t expected_size(const stream_t *s)
+{
+    return config.preallocate ? (s->fileBytes > 0 ? s->fileBytes : config.rotateSize) : 0;
+}
+
+// sets the access pattern and reserves the expected size, returns false if fallocate failed
+static inline bool prepare_file(FILE *file, const char *name, size_t expected, bool quiet)
+{
+    if (config.dropCache && posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL) != 0)
+    {
+        LOG("error setting access pattern of output file ('%s')", name);
+    }
+
+    // KEEP_SIZE leaves the visible size at what was written
+    if (expected > 0 && fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, 0, (off_t)(expected)) != 0)
+    {
+        if (!quiet)
+        {
+            // not fatal, the file just grows as usual
+            LOG("error preallocating %zu bytes for output file ('%s'): %s", expected, name, strerror(errno));
+        }
+        return false;
+    }
+
+    return true;
+}
+
+// a shared writable mapping needs the file open for reading as well
+static inline const char *output_mode()
+{
+    return config.mmap ? "w+bx" : "wbx";
+}
+
+// counters of a file that was just switched to
+static inline void start_file(stream_t *s)
+{
+    s->fileBytes = 0;
+    s->fileInput = 0;
+    s->fileOpenedAt = now_ms();
+    s->frameStart = 0;
+    s->frameInput = 0;
+    s->frameFed = 0;
+    s->seekFrames = 0;
+}
+
+// opens PREFIX.PID.TIME, a file rotated within the same second gets a .N suffix instead of being overwritten
+static inline int open_file(stream_t *s)
+{
+    const unsigned long now = (unsigned long)time(NULL);
+
+    char outFileFullName[2048] = {0};
+    snprintf(outFileFullName, 2048, "%s.%d.%lu", s->outFileName, myPid, now);
+
+    if (sink.kind != SINK_FILE)
+    {
+        // nothing to collide with on a sink, files of the same second are told apart by counting them
+        s->nameSeq = now == s->nameTime ? s->nameSeq + 1 : 0;
+        s->nameTime = now;
+        if (s->nameSeq > 0)
+        {
+            snprintf(outFileFullName, 2048, "%s.%d.%lu.%u", s->outFileName, myPid, now, s->nameSeq);
+        }
+        s->outFile = sink_open(outFileFullName);
+        if (s->outFile == NULL)
+        {
+            return -1;
+        }
+        start_file(s);
+        return 0;
+    }
+
+    for (unsigned seq = 1; (s->outFile = fopen(outFileFullName, output_mode())) == NULL && errno == EEXIST; seq++)
+    {
+        snprintf(outFileFullName, 2048, "%s.%d.%lu.%u", s->outFileName, myPid, now, seq);
+    }
+
+    if (s->outFile == NULL)
+    {
+        LOG("error opening output file ('%s'): %s", outFileFullName, strerror(errno));
+        return -1;
+    }
+
+    if (!prepare_file(s->outFile, outFileFullName, expected_size(s), s->preallocateFailed))
+    {
+        s->preallocateFailed = true;
+    }
+
+    start_file(s);
+
+    if (sidecar.enabled && index_open(s, outFileFullName) != 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+// closes and removes the files of a spare nobody switched to, NULL is fine
+static inline void spare_free(spare_t *spare)
+{
+    if (spare == NULL)
+    {
+        return;
+    }
+
+    if (spare->file != NULL)
+    {
+        fclose(spare->file);
+        unlink(spare->names->spare);
+    }
+    if (spare->indexFile != NULL)
+    {
+        fclose(spare->indexFile);
+        unlink(spare->indexNames->spare);
+    }
+    free(spare->names);
+    free(spare->indexNames);
+    free(spare);
+}
+
+// PREFIX.PID.next.N.part, N counts the spares of a stream so they never collide with one still being renamed
+static inline spare_t *spare_new(stream_t *s)
+{
+    spare_t *spare = (spare_t *)calloc(1, sizeof(spare_t));
+    if (spare == NULL || (spare->names = (file_names_t *)calloc(1, sizeof(file_names_t))) == NULL ||
+        (sidecar.enabled && (spare->indexNames = (file_names_t *)calloc(1, sizeof(file_names_t))) == NULL))
+    {
+        LOG("error allocating spare output file");
+        spare_free(spare);
+        return NULL;
+    }
+
+    spare->stream = s;
+    spare->expected = expected_size(s);
+    spare->quiet = s->preallocateFailed;
+    snprintf(spare->names->spare, sizeof spare->names->spare, "%s.%d.next.%u.part", s->outFileName, myPid, s->spareSeq);
+    if (spare->indexNames != NULL)
+    {
+        snprintf(spare->indexNames->spare, sizeof spare->indexNames->spare, "%s.%d.next.%u.idx.part", s->outFileName,
+                 myPid, s->spareSeq);
+    }
+    s->spareSeq++;
+    return spare;
+}
+
+// leaves spare->file NULL if it could not be opened
+static inline void spare_open(spare_t *spare)
+{
+    spare->file = fopen(spare->names->spare, output_mode());
+    if (spare->file == NULL)
+    {
+        LOG("error opening output file ('%s'): %s", spare->names->spare, strerror(errno));
+        return;
+    }
+
+    spare->preallocateFailed = !prepare_file(spare->file, spare->names->spare, spare->expected, spare->quiet);
+
+    if (spare->indexNames != NULL && (spare->indexFile = index_create(spare->indexNames->spare)) == NULL)
+    {
+        fclose(spare->file);
+        unlink(spare->names->spare);
+        spare->file = NULL;
+    }
+}
+
+// runs on the reaper
+static void spare_ready(void *arg)
+{
+    spare_t *spare = (spare_t *)arg;
+    spare_open(spare);
+    atomic_store(&spare->stream->spare, spare);
+}
+
+static inline void set_names(file_names_t *names, const char *prefix, unsigned long when, unsigned seq, const char *suffix)
+{
+    if (seq == 0)
+    {
+        snprintf(names->final, sizeof names->final, "%s.%d.%lu%s", prefix, myPid, when, suffix);
+    }
+    else
+    {
+        snprintf(names->final, sizeof names->final, "%s.%d.%lu.%u%s", prefix, myPid, when, seq, suffix);
+    }
+    snprintf(names->part, sizeof names->part, "%s.part", names->final);
+}
+
+// --part: switches to the spare the reaper opened, so a rotation costs a pointer swap. the renames happen in the
+// background, a spare that is not ready yet is opened right here
+static inline int activate_file(stream_t *s)
+{
+    spare_t *spare = atomic_exchange(&s->spare, NULL);
+    if (spare != NULL)
+    {
+        s->spareRequested = false;
+    }
+
+    if (spare == NULL || spare->file == NULL)
+    {
+        spare_free(spare);
+        spare = spare_new(s);
+        if (spare == NULL)
+        {
+            return -1;
+        }
+        spare_open(spare);
+        if (spare->file == NULL)
+        {
+            spare_free(spare);
+            return -1;
+        }
+        stats_add(&stats.unpreparedRotations, 1);
+    }
+
+    if (spare->preallocateFailed)
+    {
+        s->preallocateFailed = true;
+    }
+
+    const unsigned long now = (unsigned long)time(NULL);
+    s->nameSeq = now == s->nameTime ? s->nameSeq + 1 : 0;
+    s->nameTime = now;
+    set_names(spare->names, s->outFileName, now, s->nameSeq, "");
+    if (spare->indexNames != NULL)
+    {
+        set_names(spare->indexNames, s->outFileName, now, s->nameSeq, ".idx");
+    }
+
+    s->outFile = spare->file;
+    s->names = spare->names;
+    s->indexFile = spare->indexFile;
+    s->indexNames = spare->indexNames;
+    free(spare);
+
+    if (reaper_rename(s->names) != 0 || (s->indexNames != NULL && reaper_rename(s->indexNames) != 0))
+    {
+        return -1;
+    }
+
+    // the next one is sized after the file that just ended
+    if (!s->spareRequested)
+    {
+        spare_t *next = spare_new(s);
+        if (next == NULL || reaper_run(spare_ready, next) != 0)
+        {
+            return -1;
+        }
+        s->spareRequested = true;
+    }
+
+    start_file(s);
+    if (s->indexFile != NULL)
+    {
+        index_start(s);
+    }
+
+    return 0;
+}
+
+// switches to the next file, with --mmap zstd writes into it right away
+static inline int next_file(stream_t *s)
+{
+    if ((config.part ? activate_file(s) : open_file(s)) != 0)
+    {
+        return -1;
+    }
+
+    return config.mmap ? map_window(s) : 0;
+}
+
+static inline int reopen_file(stream_t *s)
+{
+    if (s->outFile != NULL)
+    {
+        // the old file is synced and closed in the background
+        if (submit_output(s, OUTPUT_CLOSE) != 0 ||
+            (s->indexFile != NULL && reaper_close(s->indexFile, s->indexNames) != 0))
+        {
+            return -1;
+        }
+
+        s->outFile = NULL;
+        s->indexFile = NULL;
+        s->names = NULL;
+        s->indexNames = NULL;
+
+        if (next_file(s) != 0)
+        {
+            LOG("error reopening file");
+            return -1;
+        }
+
+        // a freshly trained dictionary is switched to between files, so every file needs just one
+        ZSTD_CDict *cdict = current_dictionary();
+        if (cdict != s->cdict)
+        {
+            return use_dictionary(s, cdict);
+        }
+
+        return 0;
+    }
+
+    return -1;
+}
+
+static inline int rotate(stream_t *s)
+{
+    PROBE(rotate__start, s->fileBytes, s->fileInput);
+    const uint64_t start = now_us();
+
+    if (finish_file(s) != 0)
+    {
+        // we can't flush zstd, exiting
+        LOG("can not flush ZSTD buffer, exiting");
+        return -1;
+    }
+    if (reopen_file(s) != 0)
+    {
+        // we can't reopen the file for writing, exiting
+        LOG("can not reopen file, exiting");
+        return -1;
+    }
+
+    observe(&stats.rotationTime, now_us() - start, 1);
+    PROBE(rotate__end, now_us() - start);
+    stats_add(&stats.rotations, 1);
+    return 0;
+}
+
+// rotates on SIGHUP or once the current file crossed --rotate-size or --rotate-interval
+static inline int check_rotation(stream_t *s, bool requested)
+{
+    if (UNLIKELY(requested))
+    {
+        return rotate(s);
+    }
+
+    if (config.rotateSize > 0 && s->fileBytes >= config.rotateSize)
+    {
+        return rotate(s);
+    }
+
+    // an idle file is kept instead of leaving a trail of empty ones
+    if (config.rotateInterval > 0 && s->fileInput > 0 && now_ms() - s->fileOpenedAt >= config.rotateInterval)
+    {
+        return rotate(s);
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+static inline int set_parameter(ZSTD_CCtx *zctx, ZSTD_cParameter param, int value, const char *name)
+{
+    const size_t err = ZSTD_CCtx_setParameter(zctx, param, value);
+    if (UNLIKELY(ZSTD_isError(err)))
+    {
+        LOG("error setting %s to %d: %s", name, value, ZSTD_getErrorName(err));
+        return -1;
+    }
+
+    return 0;
+}
+
+// compression parameters that can be given as key=value, named like zstd's ZSTD_c_* parameters
+static const struct
+{
+    const char *name;
+    ZSTD_cParameter param;
+} PARAMETERS[] = {
+    {"windowLog", ZSTD_c_windowLog},
+    {"hashLog", ZSTD_c_hashLog},
+    {"chainLog", ZSTD_c_chainLog},
+    {"searchLog", ZSTD_c_searchLog},
+    {"minMatch", ZSTD_c_minMatch},
+    {"targetLength", ZSTD_c_targetLength},
+    {"strategy", ZSTD_c_strategy},
+    {"enableLongDistanceMatching", ZSTD_c_enableLongDistanceMatching},
+    {"ldmHashLog", ZSTD_c_ldmHashLog},
+    {"ldmMinMatch", ZSTD_c_ldmMinMatch},
+    {"ldmBucketSizeLog", ZSTD_c_ldmBucketSizeLog},
+    {"ldmHashRateLog", ZSTD_c_ldmHashRateLog},
+    {"jobSize", ZSTD_c_jobSize},
+    {"overlapLog", ZSTD_c_overlapLog},
+    {"targetCBlockSize", ZSTD_c_targetCBlockSize},
+    {"rsyncable", ZSTD_c_rsyncable},
+};
+
+static const char *const STRATEGIES[] = {NULL, "fast", "dfast", "greedy", "lazy", "lazy2", "btlazy2", "btopt", "btultra", "btultra2"};
+
+#define PROFILE_MAX (sizeof PARAMETERS / sizeof PARAMETERS[0])
+
+typedef struct profile_t_
+{
+    size_t count;
+    ZSTD_cParameter params[PROFILE_MAX];
+    int values[PROFILE_MAX];
+    const char *names[PROFILE_MAX];
+} profile_t;
+
+// --param and --param-file, applied to every context after LEVEL so explicit values win
+static profile_t profile = {.count = 0};
+
+// a later value replaces an earlier one
+static inline void profile_set(profile_t *p, ZSTD_cParameter param, const char *name, int value)
+{
+    size_t slot = 0;
+    while (slot < p->count && p->params[slot] != param)
+    {
+        slot++;
+    }
+    p->params[slot] = param;
+    p->values[slot] = value;
+    p->names[slot] = name;
+    p->count = slot == p->count ? p->count + 1 : p->count;
+}
+
+// -1 if the profile leaves it to the level
+static inline int profile_get(const profile_t *p, ZSTD_cParameter param)
+{
+    for (size_t i = 0; i < p->count; i++)
+    {
+        if (p->params[i] == param)
+        {
+            return p->values[i];
+        }
+    }
+    return -1;
+}
+
+static inline int set_profile_value(profile_t *p, const char *key, size_t keyLen, const char *value, size_t valueLen)
+{
+    size_t index = 0;
+    while (index < PROFILE_MAX && (strlen(PARAMETERS[index].name) != keyLen || strncmp(PARAMETERS[index].name, key, keyLen) != 0))
+    {
+        index++;
+    }
+    if (index == PROFILE_MAX)
+    {
+        LOG("unknown compression parameter '%.*s'", (int)(keyLen), key);
+        return -1;
+    }
+
+    char text[32];
+    if (valueLen == 0 || valueLen >= sizeof text)
+    {
+        LOG("invalid value for %s", PARAMETERS[index].name);
+        return -1;
+    }
+    memcpy(text, value, valueLen);
+    text[valueLen] = '\0';
+
+    size_t size = 0;
+    long number = parse_size(text, &size) == 0 && size <= INT32_MAX ? (long)(size) : -1;
+    if (number == -1)
+    {
+        for (size_t i = 1; PARAMETERS[index].param == ZSTD_c_strategy && i < sizeof STRATEGIES / sizeof STRATEGIES[0]; i++)
+        {
+            number = strcmp(text, STRATEGIES[i]) == 0 ? (long)(i) : number;
+        }
+        if (number == -1)
+        {
+            LOG("invalid value '%s' for %s", text, PARAMETERS[index].name);
+            return -1;
+        }
+    }
+
+    const ZSTD_bounds bounds = ZSTD_cParam_getBounds(PARAMETERS[index].param);
+    if (ZSTD_isError(bounds.error) || number < bounds.lowerBound || number > bounds.upperBound)
+    {
+        LOG("%s has to be between %d and %d", PARAMETERS[index].name, bounds.lowerBound, bounds.upperBound);
+        return -1;
+    }
+
+    profile_set(p, PARAMETERS[index].param, PARAMETERS[index].name, (int)(number));
+    return 0;
+}
+
+// parses "key=value[,key=value...]", whitespace around entries is ignored
+static inline int parse_profile(const char *list, profile_t *p)
+{
+    while (*list != '\0')
+    {
+        while (*list == ' ' || *list == '\t' || *list == ',')
+        {
+            list++;
+        }
+        if (*list == '\0')
+        {
+            break;
+        }
+
+        const char *entryEnd = list + strcspn(list, ",");
+        const char *eq = (const char *)memchr(list, '=', (size_t)(entryEnd - list));
+        if (eq == NULL)
+        {
+            LOG("expected key=value instead of '%.*s'", (int)(entryEnd - list), list);
+            return -1;
+        }
+
+        const char *valueEnd = entryEnd;
+        while (valueEnd > eq + 1 && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t'))
+        {
+            valueEnd--;
+        }
+        const char *keyEnd = eq;
+        while (keyEnd > list && (keyEnd[-1] == ' ' || keyEnd[-1] == '\t'))
+        {
+            keyEnd--;
+        }
+        const char *value = eq + 1;
+        while (value < valueEnd && (*value == ' ' || *value == '\t'))
+        {
+            value++;
+        }
+
+        if (set_profile_value(p, list, (size_t)(keyEnd - list), value, (size_t)(valueEnd - value)) != 0)
+        {
+            return -1;
+        }
+        list = entryEnd;
+    }
+
+    return 0;
+}
+
+// one key=value per line, # starts a comment
+static inline int load_profile(const char *path, profile_t *p)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        LOG("error opening parameter file ('%s'): %s", path, strerror(errno));
+        return -1;
+    }
+
+    char line[1024];
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof line, file) != NULL)
+    {
+        line[strcspn(line, "#\r\n")] = '\0';
+        ret = parse_profile(line, p);
+    }
+    fclose(file);
+
+    return ret;
+}
+
+static inline int apply_profile(ZSTD_CCtx *zctx, const profile_t *p)
+{
+    for (size_t i = 0; i < p->count; i++)
+    {
+        if (set_parameter(zctx, p->params[i], p->values[i], p->names[i]) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+typedef struct router_t_
+{
+    // --route-field: lines are split into one file per value of this field (1-based), 0 = a single file
+    size_t field;
+    // --listen: the clients of the daemon name their streams instead
+    bool named;
+    char delimiter;
+    // files besides the default one, lines with further keys go to the default file
+    size_t maxRoutes;
+    size_t bufferSize;
+
+    // the default stream comes first
+    stream_t **streams;
+    size_t count;
+    stream_t *last;
+    // stream of a line that continues in the next block
+    stream_t *partial;
+    bool overflowed;
+
+    // with routing and several threads all contexts share one worker pool instead of bringing their own
+    ZSTD_threadPool *pool;
+} router_t;
+
+static router_t router = {
+    .field = 0,
+    .named = false,
+    .delimiter = ' ',
+    .maxRoutes = 64,
+    .bufferSize = 1024 * 1024,
+    .streams = NULL,
+    .count = 0,
+    .last = NULL,
+    .partial = NULL,
+    .overflowed = false,
+    .pool = NULL};
+
+#define ROUTE_KEY_MAX 64
+
+// a context with LEVEL, THREADS and the profile applied, allocating from *arena with --memory-limit.
+// *arena is set even if setting up the context fails afterwards
+static inline ZSTD_CCtx *create_context(arena_t **arena)
+{
+    ZSTD_CCtx *zctx = NULL;
+    if (memory.arenaSize > 0)
+    {
+        *arena = arena_create(memory.arenaSize);
+        if (*arena == NULL)
+        {
+            return NULL;
+        }
+        const ZSTD_customMem mem = {arena_alloc, arena_free, *arena};
+        zctx = ZSTD_createCCtx_advanced(mem);
+    }
+    else
+    {
+        zctx = ZSTD_createCCtx();
+    }
+    if (zctx == NULL)
+    {
+        LOG("error creating ZSTD context");
+        return NULL;
+    }
+
+    if (set_parameter(zctx, ZSTD_c_compressionLevel, config.level, "compression level") != 0 ||
+        set_parameter(zctx, ZSTD_c_checksumFlag, 1, "checksumming") != 0 ||
+        (config.workers != 1 && set_parameter(zctx, ZSTD_c_nbWorkers, config.workers, "threads") != 0) ||
+        apply_profile(zctx, &profile) != 0)
+    {
+        ZSTD_freeCCtx(zctx);
+        return NULL;
+    }
+
+    if (router.pool != NULL)
+    {
+        const size_t err = ZSTD_CCtx_refThreadPool(zctx, router.pool);
+        if (ZSTD_isError(err))
+        {
+            LOG("error sharing the ZSTD thread pool: %s", ZSTD_getErrorName(err));
+            ZSTD_freeCCtx(zctx);
+            return NULL;
+        }
+    }
+
+    return zctx;
+}
+
+// sets up compression and the first file of a stream, outFileName and outputBufferSize have to be set
+static inline int stream_init(stream_t *s)
+{
+    s->zctx = create_context(&s->arena);
+    if (s->zctx == NULL)
+    {
+        return -1;
+    }
+
+    ZSTD_CDict *cdict = current_dictionary();
+    if (cdict != NULL && use_dictionary(s, cdict) != 0)
+    {
+        return -1;
+    }
+
+    if (config.transform && (s->transform = transform_new(true)) == NULL)
+    {
+        return -1;
+    }
+
+    if (config.accumulate > 0)
+    {
+        s->stage = (char *)big_alloc(config.accumulate);
+        if (s->stage == NULL)
+        {
+            LOG("error allocating accumulation stage");
+            return -1;
+        }
+        s->zInBuf.src = s->stage;
+        s->zInBuf.size = 0;
+        s->zInBuf.pos = 0;
+
+        if (set_parameter(s->zctx, ZSTD_c_stableInBuffer, 1, "stable input") != 0 ||
+            (stable_output() && set_parameter(s->zctx, ZSTD_c_stableOutBuffer, 1, "stable output") != 0))
+        {
+            return -1;
+        }
+    }
+
+    if (writer.enabled)
+    {
+        s->outputs = (output_t *)calloc(writer.bufferCount, sizeof(output_t));
+        if (s->outputs == NULL || ring_init(&s->free, ring_capacity_for(writer.bufferCount)) != 0)
+        {
+            LOG("error allocating writer buffers");
+            return -1;
+        }
+
+        for (size_t i = 0; i < writer.bufferCount; i++)
+        {
+            s->outputs[i].buffer = (char *)big_alloc(s->outputBufferSize);
+            if (s->outputs[i].buffer == NULL)
+            {
+                LOG("error allocating output buffer");
+                return -1;
+            }
+            s->outputs[i].home = &s->free;
+            s->outputs[i].dropped = &s->dropped;
+            ring_push(&s->free, &s->outputs[i]);
+        }
+
+        s->current = (output_t *)ring_pop(&s->free);
+        s->outputBuffer = s->current->buffer;
+    }
+    else if (!config.mmap)
+    {
+        s->outputBuffer = (char *)big_alloc(s->outputBufferSize);
+        if (s->outputBuffer == NULL)
+        {
+            LOG("error allocating output buffer");
+            return -1;
+        }
+    }
+
+    s->zOutBuf.dst = s->outputBuffer;
+    s->zOutBuf.size = s->outputBufferSize;
+    s->zOutBuf.pos = 0;
+
+    return next_file(s);
+}
+
+// closes the last file and frees the stream, everything submitted has to be written already
+static inline void stream_close(stream_t *s)
+{
+    // --part: only a file that made it to disk gets its final name
+    bool durable = false;
+
+    if (s->outFile != NULL)
+    {
+        // logs on its own, the file is still synced and closed
+        unmap_file(s);
+
+        // --sink: fclose waits until the sink has it all
+        const int fn = sink.kind == SINK_FILE ? fileno(s->outFile) : -1;
+        if (sink.kind != SINK_FILE)
+        {
+            durable = true;
+        }
+        else if (fn == -1)
+        {
+            LOG("error getting file number for output file (%s): %s", s->outFileName, strerror(errno));
+        }
+        else
+        {
+            trim_file(s->outFile);
+            if (fsync(fn) == -1)
+            {
+                LOG("error syncing output file to disk: %s", strerror(errno));
+            }
+            else
+            {
+                durable = true;
+                if (config.dropCache)
+                {
+                    drop_pages(s->outFile, 0, ftello(s->outFile));
+                }
+            }
+        }
+
+        if (fclose(s->outFile) != 0)
+        {
+            LOG("error closing output file (%s): %s", s->outFileName, strerror(errno));
+            durable = false;
+        }
+
+        s->outFile = NULL;
+    }
+
+    if (s->names != NULL)
+    {
+        if (durable)
+        {
+            finish_names(s->names);
+        }
+        else
+        {
+            free(s->names);
+        }
+        s->names = NULL;
+    }
+
+    if (s->indexFile != NULL)
+    {
+        durable = true;
+        if (fflush(s->indexFile) != 0 || fsync(fileno(s->indexFile)) == -1 || fclose(s->indexFile) != 0)
+        {
+            LOG("error closing index file (%s): %s", s->outFileName, strerror(errno));
+            durable = false;
+        }
+        s->indexFile = NULL;
+    }
+
+    if (s->indexNames != NULL)
+    {
+        if (durable)
+        {
+            finish_names(s->indexNames);
+        }
+        else
+        {
+            free(s->indexNames);
+        }
+        s->indexNames = NULL;
+    }
+
+    // everything the reaper was asked to do is done by now
+    spare_free(atomic_exchange(&s->spare, NULL));
+
+    if (s->outputs != NULL)
+    {
+        for (size_t i = 0; i < writer.bufferCount; i++)
+        {
+            big_free(s->outputs[i].buffer, s->outputBufferSize);
+        }
+        free(s->outputs);
+        s->outputs = NULL;
+        ring_destroy(&s->free);
+    }
+    else
+    {
+        big_free(s->outputBuffer, s->outputBufferSize);
+    }
+    s->outputBuffer = NULL;
+    s->current = NULL;
+
+    ZSTD_freeCCtx(s->zctx);
+    s->zctx = NULL;
+    arena_destroy(s->arena);
+    s->arena = NULL;
+
+    free(s->seekTable);
+    s->seekTable = NULL;
+
+    transform_free(s->transform);
+    s->transform = NULL;
+
+    big_free(s->stage, config.accumulate);
+    s->stage = NULL;
+}
+
+static inline int router_init(stream_t *defaultStream)
+{
+    const bool routed = router.field > 0 || router.named;
+    const size_t capacity = routed ? router.maxRoutes + 1 : (config.interleaved ? 1 : config.shards);
+    router.streams = (stream_t **)calloc(capacity, sizeof(stream_t *));
+    if (router.streams == NULL)
+    {
+        LOG("error allocating routes");
+        return -1;
+    }
+
+    if (routed && config.workers > 1)
+    {
+        router.pool = create_pool((size_t)(config.workers));
+        if (router.pool == NULL)
+        {
+            LOG("error creating ZSTD thread pool");
+            return -1;
+        }
+    }
+
+    router.streams[0] = defaultStream;
+    router.count = 1;
+    atomic_store_explicit(&stats.routes, 1, memory_order_relaxed);
+    router.last = defaultStream;
+    return 0;
+}
+
+// keys end up in file names
+static inline char route_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.'
+               ? c
+               : '_';
+}
+
+// copies raw into key with anything unsafe for a file name replaced. a key that had to be changed for that, cut
+// or with characters replaced, ends in '~' and a hash of raw instead, so distinct keys never share a file
+static inline size_t safe_key(const char *raw, size_t rawLen, char *key)
+{
+    bool changed = rawLen > ROUTE_KEY_MAX;
+    size_t n = 0;
+    for (; n < rawLen && n < ROUTE_KEY_MAX; n++)
+    {
+        key[n] = route_char(raw[n]);
+        changed = changed || key[n] != raw[n];
+    }
+    if (!changed)
+    {
+        return n;
+    }
+
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < rawLen; i++)
+    {
+        hash = (hash ^ (unsigned char)(raw[i])) * 1099511628211ull;
+    }
+
+    n = n < ROUTE_KEY_MAX - 17 ? n : ROUTE_KEY_MAX - 17;
+    key[n++] = '~';
+    for (int shift = 60; shift >= 0; shift -= 4)
+    {
+        key[n++] = "0123456789abcdef"[(hash >> shift) & 15];
+    }
+    return n;
+}
+
+// finds the routing field of a line and turns it into a key
+static inline size_t route_key(const char *line, size_t len, char *key)
+{
+    const char *end = line + len;
+    const char *field = find_field(line, len, router.field, router.delimiter);
+    if (field == NULL)
+    {
+        return 0;
+    }
+
+    const char *fieldEnd = field;
+    while (fieldEnd < end && *fieldEnd != router.delimiter && *fieldEnd != '\n' && *fieldEnd != '\r')
+    {
+        fieldEnd++;
+    }
+
+    return safe_key(field, (size_t)(fieldEnd - field), key);
+}
+
+static inline stream_t *add_route(const char *key, size_t len)
+{
+    if (router.count > router.maxRoutes)
+    {
+        if (!router.overflowed)
+        {
+            LOG("more than %zu routes, further keys go to the default file", router.maxRoutes);
+            router.overflowed = true;
+        }
+        return router.streams[0];
+    }
+
+    const size_t prefixLen = strlen(router.streams[0]->outFileName);
+    stream_t *s = (stream_t *)calloc(1, sizeof(stream_t));
+    char *name = (char *)malloc(prefixLen + 1 + len + 1);
+    if (s == NULL || name == NULL)
+    {
+        LOG("error allocating route");
+        free(s);
+        free(name);
+        return NULL;
+    }
+
+    memcpy(name, router.streams[0]->outFileName, prefixLen);
+    name[prefixLen] = '.';
+    memcpy(name + prefixLen + 1, key, len);
+    name[prefixLen + 1 + len] = '\0';
+    s->routeName = name;
+    s->outFileName = name;
+    s->key = name + prefixLen + 1;
+    s->keyLen = len;
+    s->outputBufferSize = router.bufferSize;
+
+    // a route that fails to start is still registered so it gets cleaned up with the others
+    router.streams[router.count++] = s;
+    atomic_store_explicit(&stats.routes, router.count, memory_order_relaxed);
+    return stream_init(s) == 0 ? s : NULL;
+}
+
+// the stream of key, started on first use
+static inline stream_t *find_route(const char *key, size_t keyLen)
+{
+    const stream_t *last = router.last;
+    if (last->keyLen == keyLen && memcmp(last->key, key, keyLen) == 0)
+    {
+        return router.last;
+    }
+
+    for (size_t i = 1; i < router.count; i++)
+    {
+        stream_t *s = router.streams[i];
+        if (s->keyLen == keyLen && memcmp(s->key, key, keyLen) == 0)
+        {
+            router.last = s;
+            return s;
+        }
+    }
+
+    stream_t *s = add_route(key, keyLen);
+    if (s != NULL)
+    {
+        router.last = s;
+    }
+    return s;
+}
+
+static inline stream_t *route(const char *line, size_t len)
+{
+    char key[ROUTE_KEY_MAX];
+    const size_t keyLen = route_key(line, len, key);
+    if (keyLen == 0)
+    {
+        return router.streams[0];
+    }
+
+    return find_route(key, keyLen);
+}
+
+static inline void router_free()
+{
+    for (size_t i = 0; i < router.count; i++)
+    {
+        stream_t *s = router.streams[i];
+        stream_close(s);
+        if (s->routeName != NULL)
+        {
+            free(s->routeName);
+            free(s);
+        }
+    }
+    router.count = 0;
+    free(router.streams);
+    router.streams = NULL;
+
+    ZSTD_freeThreadPool(router.pool);
+    router.pool = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+// --adaptive: every period the level goes down a step if input backed up, and up a step if the writer had to be
+// waited for or the input never queued up noticeably. zstd applies a new level at the next job (THREADS > 1) or frame,
+// which set_level then starts right away. a dictionary fixes the level, so it is not allowed with one
+typedef struct adaptive_t_
+{
+    bool enabled;
+    int min;
+    int max;
+    uint64_t period;
+
+    // stdin counts as backed up once this much is waiting in the pipe
+    size_t backlogLimit;
+
+    uint64_t periodStart;
+    size_t stallsBefore;
+    bool backedUp;
+    bool busy;
+} adaptive_t;
+
+static adaptive_t adaptive = {
+    .enabled = false,
+    .min = 1,
+    .max = 19,
+    .period = 500,
+    .backlogLimit = 32 * 1024,
+    .periodStart = 0,
+    .stallsBefore = 0,
+    .backedUp = false,
+    .busy = false};
+
+// parses the optional argument of --adaptive, "min=N,max=M" like zstd
+static inline int parse_adaptive(const char *arg)
+{
+    while (arg != NULL && *arg != '\0')
+    {
+        int *target = NULL;
+        if (strncmp(arg, "min=", 4) == 0)
+        {
+            target = &adaptive.min;
+        }
+        else if (strncmp(arg, "max=", 4) == 0)
+        {
+            target = &adaptive.max;
+        }
+        else
+        {
+            return -1;
+        }
+
+        char *end = NULL;
+        errno = 0;
+        const long value = strtol(arg + 4, &end, 10);
+        if (errno != 0 || end == arg + 4 || value < 1 || value > ZSTD_maxCLevel() || (*end != '\0' && *end != ','))
+        {
+            return -1;
+        }
+        *target = (int)(value);
+        arg = *end == ',' ? end + 1 : end;
+    }
+
+    return adaptive.min <= adaptive.max ? 0 : -1;
+}
+
+static inline void adaptive_init()
+{
+    const int pipeSize = fcntl(STDIN_FILENO, F_GETPIPE_SZ);
+    if (pipeSize > 0)
+    {
+        adaptive.backlogLimit = (size_t)(pipeSize) / 2;
+    }
+
+    config.level = config.level < adaptive.min ? adaptive.min : (config.level > adaptive.max ? adaptive.max : config.level);
+    adaptive.periodStart = now_ms();
+}
+
+// with worker threads zstd moves to the new level at its next job, without them only at the next frame, so the
+// current one is ended right away
+static inline int set_level(int level)
+{
+    for (size_t i = 0; i < router.count; i++)
+    {
+        stream_t *s = router.streams[i];
+        if (set_parameter(s->zctx, ZSTD_c_compressionLevel, level, "compression level") != 0 ||
+            (config.workers == 1 && s->frameInput > 0 && flush_zstd(s) != 0))
+        {
+            return -1;
+        }
+    }
+
+    config.level = level;
+    atomic_store_explicit(&stats.level, level, memory_order_relaxed);
+    return 0;
+}
+
+// samples the input backlog after every block and moves the level once a period is over,
+// queued is how many of the pipeline's blocks are waiting for the compressor
+static inline int adapt_level(size_t queued, size_t blockCount)
+{
+    int pending = 0;
+    if (ioctl(STDIN_FILENO, FIONREAD, &pending) == -1)
+    {
+        pending = 0;
+    }
+
+    if ((size_t)(pending) >= adaptive.backlogLimit || (blockCount > 0 && queued >= blockCount / 2))
+    {
+        adaptive.backedUp = true;
+    }
+    if ((size_t)(pending) >= adaptive.backlogLimit / 4 || queued > 1)
+    {
+        adaptive.busy = true;
+    }
+
+    const uint64_t now = now_ms();
+    if (now - adaptive.periodStart < adaptive.period)
+    {
+        return 0;
+    }
+
+    int level = config.level;
+    if (adaptive.backedUp)
+    {
+        level = level > adaptive.min ? level - 1 : level;
+    }
+    else if (writer.stalls != adaptive.stallsBefore || !adaptive.busy)
+    {
+        level = level < adaptive.max ? level + 1 : level;
+    }
+
+    adaptive.periodStart = now;
+    adaptive.stallsBefore = writer.stalls;
+    adaptive.backedUp = false;
+    adaptive.busy = false;
+
+    return level != config.level ? set_level(level) : 0;
+}
+
+// the lines of a block are part of an open transaction
+#define BLOCK_DEFER (1u << 0)
+// the transaction ends with this block
+#define BLOCK_COMMIT (1u << 1)
+// last block, the compressor stops after it
+#define BLOCK_EOF (1u << 2)
+// sent by the reader while stdin is idle so timers still fire
+#define BLOCK_TICK (1u << 3)
+// SIGHUP: start the next file before compressing anything else
+#define BLOCK_ROTATE (1u << 4)
+
+// a BEGIN or COMMIT line the reader left inside a pipeline block, at an offset from its data
+typedef struct mark_t_
+{
+    size_t at;
+    size_t len;
+} mark_t;
+
+// marks per pipeline block, one more hands the block off early
+#define BLOCK_MARKS 1024
+
+typedef struct block_t_
+{
+    // backing storage, owned by the block in pipeline mode
+    char *buffer;
+
+    const char *data;
+    size_t size;
+    unsigned flags;
+    // with --durability per-commit the replies for the block are held until this sequence is synced
+    uint64_t seq;
+    // --shard-output interleaved: place of the block's frame in the file, 0 for the copies that only stop a lane
+    uint64_t ticket;
+    // pipeline: counts the blocks handed out, the reader holds back replies until their block is done
+    uint64_t number;
+    // pipeline: transactions do not split blocks, their marks are cut out by the compressor
+    mark_t *marks;
+    size_t markCount;
+} block_t;
+
+// with --rotate-size lines are fed in steps of about this much, so a file is rotated near its size and not only
+// after a whole block
+#define ROTATE_STEP (64 * 1024)
+
+// compresses the lines of a block, in seekable mode a frame is ended at the first line boundary past the frame size.
+// with --accumulate it also has to fit the stage, and ends at the last line boundary that does. with --rotate-size
+// the file is rotated at the first line boundary after it got big enough
+static inline int compress_lines(stream_t *s, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        size_t len = size;
+        bool end = false;
+        if (config.seekableFrameSize > 0 && s->frameInput + size >= config.seekableFrameSize)
+        {
+            const size_t budget = config.seekableFrameSize > s->frameInput ? config.seekableFrameSize - s->frameInput : 1;
+            const char *nl = (const char *)memchr(data + budget - 1, '\n', size - (budget - 1));
+            // otherwise part of a line longer than a whole block, the frame ends after its newline
+            if (nl != NULL)
+            {
+                len = (size_t)(nl - data) + 1;
+                end = true;
+            }
+        }
+
+        if (s->stage != NULL && s->frameInput + len > config.accumulate)
+        {
+            const size_t room = config.accumulate - s->frameInput;
+            const char *nl = room > 0 ? (const char *)memrchr(data, '\n', room) : NULL;
+            // a line that does not even fit an empty stage is cut
+            len = nl != NULL ? (size_t)(nl - data) + 1 : (s->frameInput == 0 ? room : 0);
+            end = true;
+        }
+
+        if (config.rotateSize > 0 && len > ROTATE_STEP)
+        {
+            const char *nl = (const char *)memchr(data + ROTATE_STEP - 1, '\n', len - (ROTATE_STEP - 1));
+            if (nl != NULL && (size_t)(nl - data) + 1 < len)
+            {
+                len = (size_t)(nl - data) + 1;
+                end = false;
+            }
+        }
+
+        if (len > 0 && s->indexFile != NULL)
+        {
+            index_lines(s, data, len);
+        }
+        if ((len > 0 && compress_input(s, data, len) != 0) || (end && flush_zstd(s) != 0))
+        {
+            return -1;
+        }
+        data += len;
+        size -= len;
+
+        // what zstd still holds comes on top, but that is at most a block of its own
+        if (config.rotateSize > 0 && len > 0 && data[-1] == '\n' && s->fileBytes + s->zOutBuf.pos >= config.rotateSize &&
+            rotate(s) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// hands runs of consecutive lines with the same key to their stream
+static inline int route_lines(const char *data, size_t size)
+{
+    if (router.field == 0)
+    {
+        stream.touched = true;
+        return compress_lines(&stream, data, size);
+    }
+
+    stream_t *run = router.partial;
+    size_t runLen = 0;
+    size_t pos = 0;
+    while (pos < size)
+    {
+        const char *nl = (const char *)memchr(data + pos, '\n', size - pos);
+        const size_t len = nl == NULL ? size - pos : (size_t)(nl - (data + pos)) + 1;
+
+        // the rest of a line cut off by the previous block stays with the stream its start went to
+        stream_t *s = pos == 0 && router.partial != NULL ? router.partial : route(data + pos, len);
+        if (s == NULL)
+        {
+            return -1;
+        }
+
+        if (s != run && runLen > 0)
+        {
+            run->touched = true;
+            if (compress_lines(run, data + pos - runLen, runLen) != 0)
+            {
+                return -1;
+            }
+            runLen = 0;
+        }
+        run = s;
+        runLen += len;
+        pos += len;
+        router.partial = nl == NULL ? s : NULL;
+    }
+
+    if (runLen > 0)
+    {
+        run->touched = true;
+        return compress_lines(run, data + size - runLen, runLen);
+    }
+
+    return 0;
+}
+
+// with OUTPUT_SYNC zstd first has to give up what it still holds of the acknowledged lines
+static inline int commit_stream(stream_t *s, unsigned flags, uint64_t seq)
+{
+    if ((flags & OUTPUT_SYNC) && flush_stream(s) != 0)
+    {
+        return -1;
+    }
+
+    return submit_output_seq(s, flags, seq);
+}
+
+// ends a transaction or a batch on every stream that got lines, a commit with no lines still syncs the default one
+static inline int commit_streams(unsigned flags, uint64_t seq)
+{
+    bool any = false;
+    for (size_t i = 0; i < router.count; i++)
+    {
+        stream_t *s = router.streams[i];
+        if (s->touched)
+        {
+            s->touched = false;
+            any = true;
+            if (commit_stream(s, flags, seq) != 0)
+            {
+                return -1;
+            }
+        }
+    }
+
+    return any ? 0 : commit_stream(&stream, flags, seq);
+}
+
+// output held back while the writer was busy goes out as well
+static inline int write_streams()
+{
+    for (size_t i = 0; i < router.count; i++)
+    {
+        router.streams[i]->touched = false;
+        if (write_output(router.streams[i]) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// zstd's progress for the stats, only from the thread that compresses
+static inline void update_progress()
+{
+    ZSTD_frameProgression total = {0};
+    for (size_t i = 0; i < router.count; i++)
+    {
+        const ZSTD_frameProgression progress = ZSTD_getFrameProgression(router.streams[i]->zctx);
+        total.ingested += progress.ingested;
+        total.consumed += progress.consumed;
+        total.produced += progress.produced;
+        total.flushed += progress.flushed;
+        total.nbActiveWorkers += progress.nbActiveWorkers;
+    }
+
+    atomic_store_explicit(&stats.zstdIngested, total.ingested, memory_order_relaxed);
+    atomic_store_explicit(&stats.zstdConsumed, total.consumed, memory_order_relaxed);
+    atomic_store_explicit(&stats.zstdProduced, total.produced, memory_order_relaxed);
+    atomic_store_explicit(&stats.zstdFlushed, total.flushed, memory_order_relaxed);
+    atomic_store_explicit(&stats.zstdActiveWorkers, total.nbActiveWorkers, memory_order_relaxed);
+}
+
+// timers and rotation of every stream, and zstd's progress once the stats asked for it
+static inline int check_streams(bool requested)
+{
+    for (size_t i = 0; i < router.count; i++)
+    {
+        stream_t *s = router.streams[i];
+        if (check_flush_latency(s) != 0 || check_checkpoint(s) != 0 || check_sync(s) != 0 || check_rotation(s, requested) != 0)
+        {
+            return -1;
+        }
+    }
+
+    if (UNLIKELY(atomic_load_explicit(&stats.progressWanted, memory_order_relaxed)))
+    {
+        atomic_store_explicit(&stats.progressWanted, false, memory_order_relaxed);
+        update_progress();
+    }
+    return 0;
+}
+
+static inline int consume_block(const block_t *block)
+{
+    if (block->size > 0 && (sample_lines(block->data, block->size) != 0 || route_lines(block->data, block->size) != 0))
+    {
+        return -1;
+    }
+
+    if (block->seq != 0)
+    {
+        if (commit_streams(OUTPUT_FLUSH | OUTPUT_SYNC, block->seq) != 0)
+        {
+            LOG("error committing to disk, exiting");
+            return -1;
+        }
+    }
+    else if (block->flags & BLOCK_COMMIT)
+    {
+        // everything compressed during the batch goes out in one write
+        if (commit_streams(OUTPUT_FLUSH, 0) != 0)
+        {
+            LOG("error committing transaction, exiting");
+            return -1;
+        }
+    }
+    else if (!(block->flags & BLOCK_DEFER) && write_streams() != 0)
+    {
+        LOG("error writing compressed buffer to file, exiting");
+        return -1;
+    }
+
+    return check_streams((block->flags & BLOCK_ROTATE) != 0);
+}
+
+////////////////////////////////////////////////////////////////////////
+
+// a compressor thread and the blocks it is fed through. without --shards there is a single lane that routes
+// its blocks, with them every lane has a file of its own or a context whose frames go into the default file
+typedef struct lane_t_
+{
+    block_t *blocks;
+    // filled blocks travel reader -> compressor, empty ones compressor -> reader
+    ring_t full;
+    ring_t free;
+
+    pthread_t thread;
+    bool running;
+    // number of the last block the reader handed to the lane and of the last one its compressor is done with
+    uint64_t pushed;
+    _Atomic uint64_t done;
+
+    stream_t *stream;
+    // --shard-output interleaved: every block is compressed into a whole frame here first
+    ZSTD_CCtx *zctx;
+    arena_t *arena;
+    char *frame;
+    size_t frameCapacity;
+} lane_t;
+
+typedef struct pipeline_t_
+{
+    bool enabled;
+    // per lane
+    size_t bufferCount;
+    size_t bufferSize;
+
+    lane_t *lanes;
+    size_t laneCount;
+    // lane the block being filled goes to
+    size_t next;
+    // block the reader is currently filling
+    block_t *current;
+    // number of the last block handed out, and an eventfd the compressors signal after every block
+    uint64_t pushed;
+    int doneFd;
+
+    // --shard-output interleaved: lanes append their frames to the default file one at a time and in input order
+    pthread_mutex_t outputLock;
+    pthread_cond_t appendedChanged;
+    // last ticket handed out by the reader and last one appended
+    uint64_t ticket;
+    uint64_t appended;
+
+    _Atomic bool failed;
+} pipeline_t;
+
+static pipeline_t pipeline = {
+    .enabled = false,
+    .bufferCount = 16,
+    .bufferSize = 1024 * 1024,
+    .lanes = NULL,
+    .laneCount = 0,
+    .next = 0,
+    .current = NULL,
+    .pushed = 0,
+    .doneFd = -1,
+    .outputLock = PTHREAD_MUTEX_INITIALIZER,
+    .appendedChanged = PTHREAD_COND_INITIALIZER,
+    .ticket = 0,
+    .appended = 0};
+
+// --shard-output files: a lane compresses its blocks into its own file the way a single route would
+static inline int consume_shard(stream_t *s, const block_t *block)
+{
+    if (block->size > 0 && compress_lines(s, block->data, block->size) != 0)
+    {
+        return -1;
+    }
+
+    if (block->flags & BLOCK_COMMIT)
+    {
+        if (submit_output(s, OUTPUT_FLUSH) != 0)
+        {
+            LOG("error committing transaction, exiting");
+            return -1;
+        }
+    }
+    else if (!(block->flags & BLOCK_DEFER) && write_output(s) != 0)
+    {
+        LOG("error writing compressed buffer to file, exiting");
+        return -1;
+    }
+
+    return check_flush_latency(s) != 0 || check_checkpoint(s) != 0 || check_rotation(s, (block->flags & BLOCK_ROTATE) != 0) != 0
+               ? -1
+               : 0;
+}
+
+// --shard-output interleaved: a block becomes a frame of its own. compression runs in parallel, the frames are
+// appended in the order the reader handed out the blocks, so the file reads like the input
+static inline int consume_frame(lane_t *lane, const block_t *block)
+{
+    if (block->ticket == 0)
+    {
+        return 0;
+    }
+
+    int ret = 0;
+    size_t size = 0;
+    if (block->size > 0)
+    {
+        const uint64_t start = now_us();
+        size = ZSTD_compress2(lane->zctx, lane->frame, lane->frameCapacity, block->data, block->size);
+        observe(&stats.compressTime, now_us() - start, 1);
+        if (ZSTD_isError(size))
+        {
+            LOG("error compressing block: %s", ZSTD_getErrorName(size));
+            ret = -1;
+        }
+    }
+
+    stream_t *s = &stream;
+    pthread_mutex_lock(&pipeline.outputLock);
+    // a lane that failed never appends its frame, so nobody waits for it after that
+    while (ret == 0 && pipeline.appended + 1 != block->ticket && !atomic_load(&pipeline.failed))
+    {
+        pthread_cond_wait(&pipeline.appendedChanged, &pipeline.outputLock);
+    }
+    ret = ret == 0 && atomic_load(&pipeline.failed) ? -1 : ret;
+
+    if (ret == 0 && size > 0)
+    {
+        if (s->indexFile != NULL)
+        {
+            index_lines(s, block->data, block->size);
+        }
+        s->fileInput += block->size;
+        PROBE(frame__end, size, block->size);
+        if (append_output(s, lane->frame, size) != 0 ||
+            (config.seekableFrameSize > 0 && record_frame(s, size, block->size) != 0) ||
+            index_point(s, s->fileBytes + s->zOutBuf.pos, true) != 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (block->flags & BLOCK_COMMIT))
+    {
+        if (submit_output(s, OUTPUT_FLUSH) != 0)
+        {
+            LOG("error committing transaction, exiting");
+            ret = -1;
+        }
+    }
+    else if (ret == 0 && !(block->flags & BLOCK_DEFER) && write_output(s) != 0)
+    {
+        LOG("error writing compressed buffer to file, exiting");
+        ret = -1;
+    }
+
+    if (ret == 0 && check_rotation(s, (block->flags & BLOCK_ROTATE) != 0) != 0)
+    {
+        ret = -1;
+    }
+
+    if (ret != 0)
+    {
+        atomic_store(&pipeline.failed, true);
+    }
+    pipeline.appended = block->ticket;
+    pthread_cond_broadcast(&pipeline.appendedChanged);
+    pthread_mutex_unlock(&pipeline.outputLock);
+    return ret;
+}
+
+// squeezes the marks out of a block, every byte moves at most once
+static inline void drop_marks(block_t *block)
+{
+    char *data = block->buffer + (block->data - block->buffer);
+    size_t to = block->marks[0].at;
+    for (size_t i = 0; i < block->markCount; i++)
+    {
+        const size_t from = block->marks[i].at + block->marks[i].len;
+        const size_t end = i + 1 < block->markCount ? block->marks[i + 1].at : block->size;
+        memmove(data + to, data + from, end - from);
+        to += end - from;
+    }
+
+    block->size = to;
+    block->markCount = 0;
+}
+
+static void *compressor_main(void *arg)
+{
+    lane_t *lane = (lane_t *)arg;
+
+    bool eof = false;
+    while (!eof)
+    {
+        block_t *block = (block_t *)ring_pop(&lane->full);
+        eof = (block->flags & BLOCK_EOF) != 0;
+        if (block->markCount > 0)
+        {
+            drop_marks(block);
+        }
+
+        // after an error blocks are only recycled so the reader does not get stuck
+        if (!atomic_load_explicit(&pipeline.failed, memory_order_relaxed))
+        {
+            int ret = 0;
+            if (pipeline.laneCount == 1)
+            {
+                ret = consume_block(block) != 0 ||
+                              (adaptive.enabled && adapt_level(ring_count(&lane->full), pipeline.bufferCount) != 0)
+                          ? -1
+                          : 0;
+            }
+            else
+            {
+                ret = lane->zctx != NULL ? consume_frame(lane, block) : consume_shard(lane->stream, block);
+            }
+
+            if (ret != 0)
+            {
+                atomic_store(&pipeline.failed, true);
+            }
+        }
+
+        atomic_store_explicit(&lane->done, block->number, memory_order_release);
+        ring_push(&lane->free, block);
+        // only fails once the counter is full, and then the reader is woken anyway
+        const uint64_t one = 1;
+        ssize_t unused = write(pipeline.doneFd, &one, sizeof one);
+        (void)unused;
+    }
+
+    return NULL;
+}
+
+// buffers of a lane and, with --shards, its own file (lane 0 keeps the default one) or compression context
+static inline int lane_init(lane_t *lane, size_t index)
+{
+    const size_t capacity = ring_capacity_for(pipeline.bufferCount);
+
+    lane->blocks = (block_t *)calloc(pipeline.bufferCount, sizeof(block_t));
+    if (lane->blocks == NULL || ring_init(&lane->full, capacity) != 0 || ring_init(&lane->free, capacity) != 0)
+    {
+        LOG("error allocating pipeline");
+        return -1;
+    }
+
+    for (size_t i = 0; i < pipeline.bufferCount; i++)
+    {
+        lane->blocks[i].buffer = (char *)big_alloc(pipeline.bufferSize);
+        lane->blocks[i].marks = config.transactions ? (mark_t *)malloc(BLOCK_MARKS * sizeof(mark_t)) : NULL;
+        if (lane->blocks[i].buffer == NULL || (config.transactions && lane->blocks[i].marks == NULL))
+        {
+            LOG("error allocating pipeline buffer");
+            return -1;
+        }
+        ring_push(&lane->free, &lane->blocks[i]);
+    }
+
+    lane->stream = &stream;
+    if (pipeline.laneCount == 1)
+    {
+        return 0;
+    }
+
+    if (config.interleaved)
+    {
+        lane->zctx = create_context(&lane->arena);
+        if (lane->zctx == NULL)
+        {
+            return -1;
+        }
+
+        ZSTD_CDict *cdict = current_dictionary();
+        if (cdict != NULL && ZSTD_isError(ZSTD_CCtx_refCDict(lane->zctx, cdict)))
+        {
+            LOG("error referencing dictionary");
+            return -1;
+        }
+
+        lane->frameCapacity = ZSTD_compressBound(pipeline.bufferSize);
+        lane->frame = (char *)big_alloc(lane->frameCapacity);
+        if (lane->frame == NULL)
+        {
+            LOG("error allocating frame buffer");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (index > 0)
+    {
+        char key[32];
+        const int len = snprintf(key, sizeof key, "shard%zu", index);
+        lane->stream = add_route(key, (size_t)(len));
+        if (lane->stream == NULL)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static inline int pipeline_start()
+{
+    pipeline.laneCount = config.shards;
+    pipeline.lanes = (lane_t *)calloc(pipeline.laneCount, sizeof(lane_t));
+    if (pipeline.lanes == NULL)
+    {
+        LOG("error allocating pipeline");
+        return -1;
+    }
+
+    for (size_t i = 0; i < pipeline.laneCount; i++)
+    {
+        if (lane_init(&pipeline.lanes[i], i) != 0)
+        {
+            return -1;
+        }
+    }
+
+    atomic_init(&pipeline.failed, false);
+
+    pipeline.doneFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (pipeline.doneFd == -1)
+    {
+        LOG("error creating eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i < pipeline.laneCount; i++)
+    {
+        const int err = start_thread(&pipeline.lanes[i].thread, &affinity.compressor, compressor_main, &pipeline.lanes[i]);
+        if (err != 0)
+        {
+            LOG("error creating compressor thread: %s", strerror(err));
+            return -1;
+        }
+        pipeline.lanes[i].running = true;
+    }
+
+    pipeline.next = 0;
+    pipeline.current = (block_t *)ring_pop(&pipeline.lanes[0].free);
+    return 0;
+}
+
+// hands the current block to its lane and takes a fresh one from the next lane. lanes with files of their own
+// also get an empty copy of a commit, tick or rotation. a block ending inside a line keeps the rest of the line
+// on the same lane
+static inline void send_block(lane_t *lane, block_t *block)
+{
+    block->number = ++pipeline.pushed;
+    lane->pushed = block->number;
+    ring_push(&lane->full, block);
+}
+
+static inline void pipeline_push()
+{
+    block_t *block = pipeline.current;
+    const unsigned flags = block->flags;
+    const bool lineEnd = block->size > 0 && block->data[block->size - 1] == '\n';
+    block->ticket = config.interleaved ? ++pipeline.ticket : 0;
+    send_block(&pipeline.lanes[pipeline.next], block);
+
+    const unsigned broadcast = config.interleaved ? BLOCK_EOF : BLOCK_COMMIT | BLOCK_TICK | BLOCK_ROTATE | BLOCK_EOF;
+    if (flags & broadcast)
+    {
+        for (size_t i = 0; i < pipeline.laneCount; i++)
+        {
+            if (i == pipeline.next)
+            {
+                continue;
+            }
+
+            block_t *copy = (block_t *)ring_pop(&pipeline.lanes[i].free);
+            copy->data = copy->buffer;
+            copy->size = 0;
+            copy->flags = config.interleaved ? BLOCK_EOF : flags;
+            copy->seq = 0;
+            copy->ticket = 0;
+            copy->markCount = 0;
+            send_block(&pipeline.lanes[i], copy);
+        }
+    }
+
+    if (flags & BLOCK_EOF)
+    {
+        pipeline.current = NULL;
+        return;
+    }
+
+    if (lineEnd)
+    {
+        pipeline.next = (pipeline.next + 1) % pipeline.laneCount;
+    }
+    // waiting for a free buffer is our backpressure
+    pipeline.current = (block_t *)ring_pop(&pipeline.lanes[pipeline.next].free);
+}
+
+// sends the final block and waits until the compressors have consumed everything
+static inline int pipeline_stop()
+{
+    if (pipeline.lanes == NULL || !pipeline.lanes[0].running)
+    {
+        return 0;
+    }
+
+    if (pipeline.current == NULL)
+    {
+        pipeline.current = (block_t *)ring_pop(&pipeline.lanes[pipeline.next].free);
+    }
+    block_t *block = pipeline.current;
+    block->data = block->buffer;
+    block->size = 0;
+    block->flags = BLOCK_EOF;
+    block->seq = 0;
+    block->markCount = 0;
+    pipeline_push();
+
+    for (size_t i = 0; i < pipeline.laneCount && pipeline.lanes[i].running; i++)
+    {
+        const int err = pthread_join(pipeline.lanes[i].thread, NULL);
+        if (err != 0)
+        {
+            LOG("error joining compressor thread: %s", strerror(err));
+            return -1;
+        }
+        pipeline.lanes[i].running = false;
+    }
+
+    return atomic_load(&pipeline.failed) ? -1 : 0;
+}
+
+// every block handed out up to number is back from its compressor. a lane that is behind only holds things up
+// while it still has blocks up to number
+static inline bool pipeline_done(uint64_t number)
+{
+    for (size_t i = 0; i < pipeline.laneCount; i++)
+    {
+        const uint64_t done = atomic_load_explicit(&pipeline.lanes[i].done, memory_order_acquire);
+        if (done < number && done != pipeline.lanes[i].pushed)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static inline void pipeline_free()
+{
+    if (pipeline.lanes == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < pipeline.laneCount; i++)
+    {
+        lane_t *lane = &pipeline.lanes[i];
+        if (lane->blocks != NULL)
+        {
+            for (size_t j = 0; j < pipeline.bufferCount; j++)
+            {
+                big_free(lane->blocks[j].buffer, pipeline.bufferSize);
+                free(lane->blocks[j].marks);
+            }
+            free(lane->blocks);
+            ring_destroy(&lane->full);
+            ring_destroy(&lane->free);
+        }
+
+        ZSTD_freeCCtx(lane->zctx);
+        arena_destroy(lane->arena);
+        big_free(lane->frame, lane->frameCapacity);
+    }
+
+    free(pipeline.lanes);
+    pipeline.lanes = NULL;
+    if (pipeline.doneFd != -1)
+    {
+        close(pipeline.doneFd);
+        pipeline.doneFd = -1;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+
+// a run of equal replies that must not go out before the pipeline is done with a block and, with --durability
+// per-commit, a commit sequence is on disk
+typedef struct held_t_
+{
+    // last block the replies wait for, 0 = none, HELD_CURRENT = the one the reader is still filling
+    uint64_t block;
+    uint64_t seq;
+    size_t count;
+    bool defer;
+    // when the oldest of the acknowledged lines was read, 0 for the OK of a mark
+    uint64_t since;
+} held_t;
+
+#define HELD_MAX 4096
+#define HELD_CURRENT UINT64_MAX
+
+typedef struct input_t_
+{
+    size_t bufferSize;
+    char *buffer;
+
+    // lines in buffer[pending, start) are complete but not yet handed to the compressor,
+    // buffer[start, end) is not scanned yet
+    size_t pending;
+    size_t pendingLines;
+    size_t start;
+    size_t end;
+
+    // the first line in the buffer was already partially compressed
+    bool continuation;
+    bool inTransaction;
+    // pipeline: a commit mark went into the block being filled, and lines outside a transaction did
+    unsigned marked;
+    bool outside;
+
+    // last sequence handed out to a block that has to be durable before it is acknowledged
+    uint64_t commitSeq;
+
+    // SIGHUP and SIGUSR1 are blocked in every thread and read from here
+    int signalFd;
+
+    // when the oldest input that is not acknowledged yet was read, 0 = none
+    uint64_t receivedAt;
+    // OKs queued but not written yet, and when the oldest of their lines was read. their latency is taken once
+    // the reply is out
+    size_t ackLines;
+    uint64_t ackSince;
+
+    // replies are collected per read() and written with a single syscall
+    size_t replyLen;
+    char reply[4096];
+
+    // replies waiting for the compressor, in order. once one is held everything behind it is held too
+    size_t heldFirst;
+    size_t heldCount;
+    held_t held[HELD_MAX];
+} input_t;
+
+static input_t input = {
+    .bufferSize = 1024 * 1024 * 8,
+    .buffer = NULL,
+    .pending = 0,
+    .pendingLines = 0,
+    .start = 0,
+    .end = 0,
+    .continuation = false,
+    .inTransaction = false,
+    .marked = 0,
+    .outside = false,
+    .commitSeq = 0,
+    .signalFd = -1,
+    .receivedAt = 0,
+    .ackLines = 0,
+    .ackSince = 0,
+    .replyLen = 0,
+    .heldFirst = 0,
+    .heldCount = 0};
+
+static inline int flush_replies()
+{
+    size_t done = 0;
+    while (done < input.replyLen)
+    {
+        const ssize_t ret = write(STDOUT_FILENO, input.reply + done, input.replyLen - done);
+        if (ret == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            LOG("error writing reply to rsyslog: %s", strerror(errno));
+            return -1;
+        }
+        done += (size_t)(ret);
+    }
+
+    input.replyLen = 0;
+    if (input.ackLines > 0)
+    {
+        const uint64_t latency = now_us() - input.ackSince;
+        observe(&stats.ackLatency, latency, input.ackLines);
+        PROBE(ack, input.ackLines, latency);
+        input.ackLines = 0;
+    }
+    return 0;
+}
+
+static inline int queue_reply(const char *msg, size_t len)
+{
+    if (UNLIKELY(input.replyLen + len > sizeof input.reply) && flush_replies() != 0)
+    {
+        return -1;
+    }
+
+    memcpy(input.reply + input.replyLen, msg, len);
+    input.replyLen += len;
+    return 0;
+}
+
+#define REPLY(msg) queue_reply(msg "\n", sizeof(msg))
+
+static inline int put_replies(const held_t *h)
+{
+    for (size_t i = 0; i < h->count; i++)
+    {
+        if ((h->defer ? REPLY("DEFER_COMMIT") : REPLY("OK")) != 0)
+        {
+            return -1;
+        }
+    }
+
+    if (h->since != 0)
+    {
+        if (input.ackLines == 0)
+        {
+            input.ackSince = h->since;
+        }
+        input.ackLines += h->count;
+    }
+    return 0;
+}
+
+static inline bool held_ready(uint64_t block, uint64_t seq)
+{
+    return block != HELD_CURRENT && pipeline_done(block) && atomic_load(&durability.durable) >= seq;
+}
+
+// queues the held replies whose blocks are done. the writer syncs once for all commits queued behind each other,
+// so a whole group goes out here together
+static inline int release_replies()
+{
+    if (UNLIKELY(input.heldCount > 0 && atomic_load_explicit(&durability.failed, memory_order_relaxed)))
+    {
+        LOG("syncing output failed, exiting");
+        return -1;
+    }
+
+    while (input.heldCount > 0 && held_ready(input.held[input.heldFirst].block, input.held[input.heldFirst].seq))
+    {
+        if (put_replies(&input.held[input.heldFirst]) != 0)
+        {
+            return -1;
+        }
+        input.heldFirst = (input.heldFirst + 1) % HELD_MAX;
+        input.heldCount--;
+    }
+
+    return 0;
+}
+
+static inline void clear_done(int fd)
+{
+    uint64_t count;
+    ssize_t unused = read(fd, &count, sizeof count);
+    (void)unused;
+}
+
+// sleeps until a compressor is done with a block or a commit is synced, then queues what that released
+static inline int wait_done()
+{
+    struct pollfd pfds[2] = {
+        {.fd = pipeline.doneFd, .events = POLLIN, .revents = 0},
+        {.fd = durability.wakeFd, .events = POLLIN, .revents = 0}};
+    if (poll(pfds, 2, -1) == -1 && errno != EINTR)
+    {
+        LOG("error waiting for the compressor: %s", strerror(errno));
+        return -1;
+    }
+    for (size_t i = 0; i < 2; i++)
+    {
+        if (pfds[i].revents & POLLIN)
+        {
+            clear_done(pfds[i].fd);
+        }
+    }
+
+    return release_replies();
+}
+
+// queues count replies once the pipeline is done with block and seq is synced, in order behind those already held
+static inline int hold_replies(uint64_t block, uint64_t seq, size_t count, bool defer, uint64_t since)
+{
+    const held_t h = {.block = block, .seq = seq, .count = count, .defer = defer, .since = since};
+    if (count == 0)
+    {
+        return 0;
+    }
+    if (input.heldCount == 0 && held_ready(block, seq))
+    {
+        return put_replies(&h);
+    }
+
+    held_t *last = &input.held[(input.heldFirst + input.heldCount - 1) % HELD_MAX];
+    if (input.heldCount > 0 && last->block == block && last->seq == seq && last->defer == defer &&
+        (last->since != 0) == (since != 0))
+    {
+        last->count += count;
+        return 0;
+    }
+
+    while (input.heldCount == HELD_MAX)
+    {
+        if (wait_done() != 0)
+        {
+            return -1;
+        }
+    }
+    input.held[(input.heldFirst + input.heldCount) % HELD_MAX] = h;
+    input.heldCount++;
+    return 0;
+}
+
+// the block the reader was filling went out as number, to be synced as seq
+static inline void held_sent(uint64_t number, uint64_t seq)
+{
+    for (size_t i = 0; i < input.heldCount; i++)
+    {
+        held_t *h = &input.held[(input.heldFirst + i) % HELD_MAX];
+        if (h->block == HELD_CURRENT)
+        {
+            h->block = number;
+            h->seq = seq;
+        }
+    }
+}
+
+// waits until nothing is held anymore
+static inline int drain_replies()
+{
+    while (input.heldCount > 0)
+    {
+        if (wait_done() != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static inline bool is_any_mark(const char *line, size_t len)
+{
+    return is_mark(line, len, config.beginMark, config.beginMarkLen) ||
+           is_mark(line, len, config.commitMark, config.commitMarkLen);
+}
+
+// queues the replies for the lines counted since the last call
+static inline int reply_lines(uint64_t block, uint64_t seq)
+{
+    const size_t lines = input.pendingLines;
+    input.pendingLines = 0;
+    if (lines == 0)
+    {
+        return 0;
+    }
+
+    if (hold_replies(block, seq, lines, input.inTransaction, input.receivedAt) != 0)
+    {
+        return -1;
+    }
+
+    stats_add(&stats.lines, lines);
+    // what is left was read at the latest by now
+    input.receivedAt = input.end > input.start ? now_us() : 0;
+    return 0;
+}
+
+// hands buffer[pending, upTo) to the compressor and queues the replies for its lines.
+// in pipeline mode this moves the reader to a fresh buffer: all offsets shift down by *shift
+static inline int emit_block(size_t upTo, unsigned flags, size_t *shift)
+{
+    *shift = 0;
+
+    // in pipeline mode the replies are queued first and held until the compressor is done with the block
+    const uint64_t hold = durability.policy == DURABILITY_COMMIT ? HELD_CURRENT : 0;
+    input.outside = input.outside || (input.pendingLines > 0 && !input.inTransaction);
+    if (pipeline.enabled && reply_lines(hold, 0) != 0)
+    {
+        return -1;
+    }
+
+    uint64_t seq = 0;
+    flags |= input.marked;
+    if (upTo > input.pending || (flags & (BLOCK_COMMIT | BLOCK_TICK | BLOCK_ROTATE)))
+    {
+        block_t local = {.buffer = input.buffer, .markCount = 0};
+        block_t *block = pipeline.enabled ? pipeline.current : &local;
+
+        block->data = input.buffer + input.pending;
+        block->size = upTo - input.pending;
+        block->flags = flags | (input.inTransaction && !input.outside ? BLOCK_DEFER : 0);
+        block->seq = 0;
+        if (durability.policy == DURABILITY_COMMIT && ((flags & BLOCK_COMMIT) || input.outside))
+        {
+            block->seq = ++input.commitSeq;
+        }
+        seq = block->seq;
+        input.marked = 0;
+        input.outside = false;
+
+        if (pipeline.enabled)
+        {
+            if (UNLIKELY(atomic_load_explicit(&pipeline.failed, memory_order_relaxed)))
+            {
+                LOG("compressor failed, exiting");
+                return -1;
+            }
+
+            pipeline_push();
+            held_sent(pipeline.pushed, seq);
+            memcpy(pipeline.current->buffer, input.buffer + upTo, input.end - upTo);
+            input.buffer = pipeline.current->buffer;
+            input.start -= upTo;
+            input.end -= upTo;
+            *shift = upTo;
+            upTo = 0;
+        }
+        else if (consume_block(block) != 0 || (adaptive.enabled && adapt_level(0, 0) != 0))
+        {
+            return -1;
+        }
+    }
+
+    // the reader does not wait for the sync, the next commits pile up behind it and share the following one
+    input.pending = upTo;
+    return reply_lines(0, seq);
+}
+
+static inline int process_mark(size_t pos, size_t lineEnd)
+{
+    const bool begin = is_mark(input.buffer + pos, lineEnd - pos, config.beginMark, config.beginMarkLen);
+
+    size_t shift = 0;
+    if (!pipeline.enabled)
+    {
+        if (emit_block(pos, begin ? 0 : BLOCK_COMMIT, &shift) != 0)
+        {
+            return -1;
+        }
+
+        // skip the mark itself
+        input.pending = lineEnd;
+        input.inTransaction = begin;
+        return hold_replies(0, begin ? 0 : input.commitSeq, 1, false, 0);
+    }
+
+    // the mark stays in the block being filled. a block takes BLOCK_MARKS of them, and a mark queues at most two
+    // runs of replies here and one more in emit_block, which must never wait for the block that is not out yet
+    if ((pipeline.current->markCount == BLOCK_MARKS || input.heldCount + 3 >= HELD_MAX) &&
+        emit_block(pos, 0, &shift) != 0)
+    {
+        return -1;
+    }
+    pos -= shift;
+    lineEnd -= shift;
+
+    input.outside = input.outside || (input.pendingLines > 0 && !input.inTransaction);
+    if (reply_lines(durability.policy == DURABILITY_COMMIT ? HELD_CURRENT : 0, 0) != 0)
+    {
+        return -1;
+    }
+
+    block_t *block = pipeline.current;
+    block->marks[block->markCount++] = (mark_t){.at = pos - input.pending, .len = lineEnd - pos};
+    input.marked |= begin ? 0 : BLOCK_COMMIT;
+    input.inTransaction = begin;
+
+    // a commit is only acknowledged once its block is compressed
+    return hold_replies(begin ? 0 : HELD_CURRENT, 0, 1, false, 0);
+}
+
+// drops everything up to pending from the buffer
+static inline void compact_input()
+{
+    if (input.pending > 0)
+    {
+        memmove(input.buffer, input.buffer + input.pending, input.end - input.pending);
+        input.start -= input.pending;
+        input.end -= input.pending;
+        input.pending = 0;
+    }
+}
+
+// makes room at the end of the buffer for the next read
+static inline int make_room()
+{
+    size_t shift = 0;
+    if (input.start > input.pending && emit_block(input.start, 0, &shift) != 0)
+    {
+        return -1;
+    }
+
+    compact_input();
+
+    if (input.end == input.bufferSize)
+    {
+        // a single line fills the whole buffer: compress what we have and ack it once the newline shows up
+        input.start = input.end;
+        if (emit_block(input.end, 0, &shift) != 0)
+        {
+            return -1;
+        }
+        input.continuation = true;
+        compact_input();
+    }
+
+    return 0;
+}
+
+// scans all complete lines in the input buffer; at eof a trailing partial line counts as a line
+static inline int process_input(bool eof)
+{
+    const size_t maxMarkLen = (config.beginMarkLen > config.commitMarkLen ? config.beginMarkLen : config.commitMarkLen) + 2;
+
+    while (input.start < input.end)
+    {
+        const size_t pos = input.start;
+        const char *nl = memchr(input.buffer + pos, '\n', input.end - pos);
+        if (nl == NULL && !eof)
+        {
+            break;
+        }
+
+        const size_t lineEnd = nl == NULL ? input.end : (size_t)(nl - input.buffer) + 1;
+        input.start = lineEnd;
+        PROBE(line, lineEnd - pos);
+
+        if (config.transactions && !input.continuation && lineEnd - pos <= maxMarkLen &&
+            is_any_mark(input.buffer + pos, lineEnd - pos))
+        {
+            if (process_mark(pos, lineEnd) != 0)
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            input.pendingLines++;
+        }
+
+        input.continuation = false;
+    }
+
+    // without a pipeline every read is compressed right away
+    if (!pipeline.enabled || eof)
+    {
+        size_t shift = 0;
+        if (emit_block(input.start, 0, &shift) != 0)
+        {
+            return -1;
+        }
+    }
+
+    if (input.end == input.bufferSize || (!pipeline.enabled && input.pending > 0))
+    {
+        return make_room();
+    }
+
+    return 0;
+}
+
+// waits until stdin is readable. SIGHUP arrives through a signalfd and is forwarded to the compressor as a block,
+// so rotation always happens between two ZSTD calls. in pipeline mode lines are collected until stdin runs dry,
+// then handed off before we block. with timers configured an idle stdin sends a tick every config.tickMs
+static inline int wait_input()
+{
+    bool handOff = pipeline.enabled && input.start > input.pending;
+
+    while (1)
+    {
+        if (!handOff && (release_replies() != 0 || flush_replies() != 0))
+        {
+            return -1;
+        }
+
+        struct pollfd pfds[4] = {
+            {.fd = STDIN_FILENO, .events = POLLIN, .revents = 0},
+            {.fd = input.signalFd, .events = POLLIN, .revents = 0},
+            {.fd = input.heldCount > 0 ? pipeline.doneFd : -1, .events = POLLIN, .revents = 0},
+            {.fd = input.heldCount > 0 ? durability.wakeFd : -1, .events = POLLIN, .revents = 0}};
+        const int ret = poll(pfds, 4, handOff ? 0 : (config.tickMs > 0 ? config.tickMs : -1));
+        if (ret == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            LOG("error polling stdin: %s", strerror(errno));
+            return -1;
+        }
+
+        size_t shift = 0;
+
+        if (pfds[1].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            if (read(input.signalFd, &info, sizeof info) != (ssize_t)(sizeof info))
+            {
+                LOG("error reading signalfd: %s", strerror(errno));
+                return -1;
+            }
+
+            if (info.ssi_signo == SIGUSR1)
+            {
+                // in pipeline mode the compressor reads zstd's progress, the dump shows what it read last
+                if (!pipeline.enabled)
+                {
+                    update_progress();
+                }
+                dump_stats();
+            }
+            else
+            {
+                if (emit_block(input.start, BLOCK_ROTATE, &shift) != 0)
+                {
+                    return -1;
+                }
+                handOff = false;
+            }
+        }
+
+        for (size_t i = 2; i < 4; i++)
+        {
+            if (pfds[i].revents & POLLIN)
+            {
+                clear_done(pfds[i].fd);
+            }
+        }
+
+        if (pfds[0].revents != 0)
+        {
+            return 0;
+        }
+
+        if (ret == 0)
+        {
+            if (emit_block(input.start, handOff ? 0 : BLOCK_TICK, &shift) != 0)
+            {
+                return -1;
+            }
+            handOff = false;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+
+// --listen: one omzstd serves every sender of the box over a Unix socket, rsyslog runs `omzstd attach SOCKET NAME`
+// in its place. a client names its stream with a "STREAM NAME" line and then speaks the omprog protocol: an OK
+// once it is attached and one for every line. the streams are routes of the router and share its zstd worker pool,
+// so THREADS workers take the jobs of all of them, and every round reads at most one buffer from each client
+typedef struct client_t_
+{
+    int fd;
+    char *buffer;
+    // compressed up to start
+    size_t start;
+    size_t end;
+    // NULL until the STREAM line came in
+    stream_t *stream;
+    // bytes of "OK\n"s still owed, sent as the socket takes them
+    size_t replyBytes;
+    bool eof;
+    // dropped at the end of the round
+    bool failed;
+} client_t;
+
+// no more input is read from a client that does not pick up its replies
+#define CLIENT_REPLIES_MAX (3 * 64 * 1024)
+
+typedef struct server_t_
+{
+    const char *path;
+    int fd;
+    // every client gets one, a line longer than that is compressed in pieces
+    size_t bufferSize;
+    size_t maxClients;
+    client_t **clients;
+    size_t count;
+    // the round starts with the next client every time, so nobody is always served first
+    size_t next;
+    // a stream was let go by the client holding it, the clients waiting for it get another round right away
+    bool released;
+} server_t;
+
+static server_t server = {
+    .path = NULL,
+    .fd = -1,
+    .bufferSize = 1024 * 1024,
+    .maxClients = 1024,
+    .clients = NULL,
+    .count = 0,
+    .next = 0,
+    .released = false};
+
+// a socket left over by a daemon that is gone is replaced, one that still answers is not
+static inline int listen_socket(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof addr.sun_path)
+    {
+        LOG("socket path too long ('%s')", path);
+        return -1;
+    }
+    snprintf(addr.sun_path, sizeof addr.sun_path, "%s", path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        LOG("error creating socket: %s", strerror(errno));
+        return -1;
+    }
+
+    int bound = bind(fd, (const struct sockaddr *)(&addr), sizeof addr);
+    if (bound != 0 && errno == EADDRINUSE)
+    {
+        const int probeFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        const bool alive = probeFd != -1 && connect(probeFd, (const struct sockaddr *)(&addr), sizeof addr) == 0;
+        if (probeFd != -1)
+        {
+            close(probeFd);
+        }
+        if (alive)
+        {
+            LOG("another daemon is listening on '%s'", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+        bound = bind(fd, (const struct sockaddr *)(&addr), sizeof addr);
+    }
+
+    if (bound != 0 || listen(fd, 64) != 0)
+    {
+        LOG("error listening on '%s': %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static inline void client_free(client_t *c)
+{
+    close(c->fd);
+    free(c->buffer);
+    free(c);
+}
+
+// a client that goes away in the middle of a line leaves it cut off, ended so the next line of the stream
+// does not get glued to it
+static inline int drop_client(size_t i)
+{
+    client_t *c = server.clients[i];
+    int ret = 0;
+    if (c->stream != NULL && c->stream->holder == c)
+    {
+        LOG("client of stream %s went away in the middle of a line", c->stream->outFileName);
+        ret = compress_lines(c->stream, "\n", 1);
+        c->stream->holder = NULL;
+        server.released = true;
+    }
+    client_free(c);
+    server.clients[i] = server.clients[--server.count];
+    return ret;
+}
+
+static inline int accept_client()
+{
+    const int fd = accept4(server.fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1)
+    {
+        // the client may have given up already
+        if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+        {
+            LOG("error accepting client: %s", strerror(errno));
+        }
+        return 0;
+    }
+
+    if (server.count == server.maxClients)
+    {
+        LOG("more than %zu clients, turning one away", server.maxClients);
+        close(fd);
+        return 0;
+    }
+
+    client_t *c = (client_t *)calloc(1, sizeof(client_t));
+    char *buffer = (char *)malloc(server.bufferSize);
+    if (c == NULL || buffer == NULL)
+    {
+        LOG("error allocating client");
+        close(fd);
+        free(c);
+        free(buffer);
+        return -1;
+    }
+    c->fd = fd;
+    c->buffer = buffer;
+    server.clients[server.count++] = c;
+    return 0;
+}
+
+// STREAM NAME, the name is a route key. an empty one means the default file
+static inline int attach_stream(client_t *c)
+{
+    const char *nl = (const char *)memchr(c->buffer, '\n', c->end);
+    if (nl == NULL)
+    {
+        if (c->end == server.bufferSize || c->eof)
+        {
+            LOG("client did not name its stream");
+            return -1;
+        }
+        return 0;
+    }
+
+    const size_t lineEnd = (size_t)(nl - c->buffer) + 1;
+    size_t len = lineEnd - 1;
+    len -= len > 0 && c->buffer[len - 1] == '\r' ? 1 : 0;
+    if (len < 6 || memcmp(c->buffer, "STREAM", 6) != 0 || (len > 6 && c->buffer[6] != ' '))
+    {
+        LOG("client sent '%.*s' instead of STREAM NAME", (int)(len < 64 ? len : 64), c->buffer);
+        return -1;
+    }
+
+    char key[ROUTE_KEY_MAX];
+    const size_t keyLen = len > 7 ? safe_key(c->buffer + 7, len - 7, key) : 0;
+    c->stream = keyLen > 0 ? find_route(key, keyLen) : router.streams[0];
+    if (c->stream == NULL)
+    {
+        // a stream that can not be started is fatal, same as a route
+        return -2;
+    }
+
+    c->start = lineEnd;
+    c->replyBytes += 3;
+    return 0;
+}
+
+// compresses the complete lines a client has. a line that fills the whole buffer (or the rest at the end) goes
+// in as it is, holding the stream until the end of that line arrives. returns -1 to drop the client, -2 on errors
+static inline int serve_client(client_t *c)
+{
+    if (c->stream == NULL)
+    {
+        const int ret = attach_stream(c);
+        if (ret != 0 || c->stream == NULL)
+        {
+            return ret;
+        }
+    }
+
+    stream_t *s = c->stream;
+    if (s->holder != NULL && s->holder != c)
+    {
+        return 0;
+    }
+
+    const char *data = c->buffer + c->start;
+    const size_t size = c->end - c->start;
+    const char *last = (const char *)memrchr(data, '\n', size);
+    size_t len = last == NULL ? 0 : (size_t)(last - data) + 1;
+    if (len < size && (c->eof || (len == 0 && c->end == server.bufferSize)))
+    {
+        len = size;
+    }
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    size_t lines = 0;
+    for (const char *p = data; (p = (const char *)memchr(p, '\n', (size_t)(data + len - p))) != NULL; p++)
+    {
+        lines++;
+    }
+    // the end of a line that was cut off is only acknowledged at the end
+    const bool midLine = data[len - 1] != '\n';
+    lines += midLine && c->eof ? 1 : 0;
+
+    // other clients may go on with the stream, so the last line gets its newline
+    s->touched = true;
+    if (sample_lines(data, len) != 0 || compress_lines(s, data, len) != 0 ||
+        (midLine && c->eof && compress_lines(s, "\n", 1) != 0))
+    {
+        return -2;
+    }
+    if (s->holder == c && !midLine)
+    {
+        server.released = true;
+    }
+    s->holder = midLine && !c->eof ? c : NULL;
+
+    c->start += len;
+    c->replyBytes += 3 * lines;
+    stats_add(&stats.lines, lines);
+    return 0;
+}
+
+// the OKs are sent without waiting, what does not fit the socket is sent in a later round
+static inline int send_replies(client_t *c)
+{
+    static char oks[3 * 512];
+    if (oks[0] == '\0')
+    {
+        for (size_t i = 0; i < sizeof oks; i += 3)
+        {
+            memcpy(oks + i, "OK\n", 3);
+        }
+    }
+
+    while (c->replyBytes > 0)
+    {
+        // owed bytes always end with a whole OK
+        const size_t from = (3 - c->replyBytes % 3) % 3;
+        const size_t n = c->replyBytes < sizeof oks - from ? c->replyBytes : sizeof oks - from;
+        const ssize_t ret = send(c->fd, oks + from, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (ret == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        c->replyBytes -= (size_t)(ret);
+    }
+
+    return 0;
+}
+
+// reads from c if there is room, what was compressed makes room first
+static inline int read_client(client_t *c)
+{
+    if (c->start > 0)
+    {
+        memmove(c->buffer, c->buffer + c->start, c->end - c->start);
+        c->end -= c->start;
+        c->start = 0;
+    }
+
+    const ssize_t ret = read(c->fd, c->buffer + c->end, server.bufferSize - c->end);
+    if (ret == -1)
+    {
+        return errno == EINTR || errno == EAGAIN ? 0 : -1;
+    }
+    c->eof = ret == 0;
+    c->end += (size_t)(ret);
+    stats_add(&stats.inputBytes, (uint64_t)(ret));
+    PROBE(read, ret);
+    return 0;
+}
+
+static inline bool wants_input(const client_t *c)
+{
+    return !c->eof && c->replyBytes < CLIENT_REPLIES_MAX && (c->start > 0 || c->end < server.bufferSize);
+}
+
+// runs until SIGTERM or SIGINT. SIGHUP rotates every stream and SIGUSR1 dumps the statistics, as usual
+static inline int serve()
+{
+    server.fd = listen_socket(server.path);
+    server.clients = (client_t **)calloc(server.maxClients, sizeof(client_t *));
+    struct pollfd *pfds = (struct pollfd *)calloc(server.maxClients + 2, sizeof(struct pollfd));
+    if (server.fd == -1 || server.clients == NULL || pfds == NULL)
+    {
+        LOG("error starting daemon");
+        free(pfds);
+        return -1;
+    }
+    LOG("listening on '%s'", server.path);
+
+    int ret = 0;
+    while (ret == 0)
+    {
+        pfds[0] = (struct pollfd){.fd = server.fd, .events = POLLIN, .revents = 0};
+        pfds[1] = (struct pollfd){.fd = input.signalFd, .events = POLLIN, .revents = 0};
+        for (size_t i = 0; i < server.count; i++)
+        {
+            const client_t *c = server.clients[i];
+            pfds[i + 2] = (struct pollfd){
+                .fd = c->fd,
+                .events = (short)((wants_input(c) ? POLLIN : 0) | (c->replyBytes > 0 ? POLLOUT : 0)),
+                .revents = 0};
+        }
+        const size_t polled = server.count;
+
+        const int timeout = server.released ? 0 : (config.tickMs > 0 ? config.tickMs : -1);
+        server.released = false;
+        const int ready = poll(pfds, polled + 2, timeout);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            LOG("error polling clients: %s", strerror(errno));
+            ret = -1;
+            break;
+        }
+
+        bool rotation = false;
+        if (pfds[1].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            if (read(input.signalFd, &info, sizeof info) != (ssize_t)(sizeof info))
+            {
+                LOG("error reading signalfd: %s", strerror(errno));
+                ret = -1;
+                break;
+            }
+            if (info.ssi_signo == SIGUSR1)
+            {
+                update_progress();
+                dump_stats();
+            }
+            else if (info.ssi_signo == SIGHUP)
+            {
+                rotation = true;
+            }
+            else
+            {
+                LOG("terminated, exiting");
+                break;
+            }
+        }
+
+        for (size_t n = 0; n < polled && ret == 0; n++)
+        {
+            const size_t i = (server.next + n) % polled;
+            client_t *c = server.clients[i];
+            int served = (pfds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) && wants_input(c) ? read_client(c) : 0;
+            served = served == 0 ? serve_client(c) : served;
+            c->failed = served == -1;
+            ret = served == -2 ? -1 : 0;
+        }
+        server.next++;
+
+        // acknowledged once the lines are with the writer, like on stdin
+        if (ret != 0 || write_streams() != 0)
+        {
+            ret = -1;
+            break;
+        }
+        // dropped clients are replaced by the last one, going backwards visits that one first
+        for (size_t i = server.count; i > 0; i--)
+        {
+            client_t *c = server.clients[i - 1];
+            if ((c->failed || send_replies(c) != 0 || (c->eof && c->start == c->end && c->replyBytes == 0)) &&
+                drop_client(i - 1) != 0)
+            {
+                ret = -1;
+            }
+        }
+
+        if (ret != 0 || check_streams(rotation) != 0 || ((pfds[0].revents & POLLIN) && accept_client() != 0))
+        {
+            ret = -1;
+        }
+    }
+
+    for (size_t i = server.count; i > 0; i--)
+    {
+        ret = drop_client(i - 1) != 0 ? -1 : ret;
+    }
+    free(server.clients);
+    server.clients = NULL;
+    free(pfds);
+    close(server.fd);
+    unlink(server.path);
+    return ret;
+}
+
+// omzstd attach SOCKET NAME: relays stdin to the stream NAME of the daemon on SOCKET and its replies back, it is
+// what rsyslog's omprog runs instead of omzstd
+static inline int attach(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        LOG("usage: omzstd attach SOCKET NAME");
+        return 1;
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(argv[0]) >= sizeof addr.sun_path)
+    {
+        LOG("socket path too long ('%s')", argv[0]);
+        return 1;
+    }
+    snprintf(addr.sun_path, sizeof addr.sun_path, "%s", argv[0]);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (const struct sockaddr *)(&addr), sizeof addr) != 0)
+    {
+        LOG("error connecting to daemon ('%s'): %s", argv[0], strerror(errno));
+        return 1;
+    }
+
+    char buffer[64 * 1024];
+    int len = snprintf(buffer, sizeof buffer, "STREAM %s\n", argv[1]);
+    struct
+    {
+        int from;
+        int to;
+        bool open;
+    } ways[2] = {{STDIN_FILENO, fd, true}, {fd, STDOUT_FILENO, true}};
+
+    size_t pending = len > 0 && (size_t)(len) < sizeof buffer ? (size_t)(len) : 0;
+    for (size_t done = 0; done < pending;)
+    {
+        const ssize_t ret = send(fd, buffer + done, pending - done, MSG_NOSIGNAL);
+        if (ret == -1 && errno != EINTR)
+        {
+            LOG("error sending to daemon: %s", strerror(errno));
+            return 1;
+        }
+        done += ret > 0 ? (size_t)(ret) : 0;
+    }
+
+    // ends once the daemon closed its side, which it does after the last OK
+    while (ways[1].open)
+    {
+        struct pollfd pfds[2] = {
+            {.fd = ways[0].open ? ways[0].from : -1, .events = POLLIN, .revents = 0},
+            {.fd = ways[1].from, .events = POLLIN, .revents = 0}};
+        if (poll(pfds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            LOG("error polling: %s", strerror(errno));
+            return 1;
+        }
+
+        for (size_t w = 0; w < 2; w++)
+        {
+            if (!ways[w].open || pfds[w].revents == 0)
+            {
+                continue;
+            }
+
+            const ssize_t got = read(ways[w].from, buffer, sizeof buffer);
+            if (got == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got <= 0)
+            {
+                if (got == -1)
+                {
+                    LOG("error reading %s: %s", w == 0 ? "stdin" : "from daemon", strerror(errno));
+                    return 1;
+                }
+                ways[w].open = false;
+                if (w == 0 && shutdown(fd, SHUT_WR) != 0)
+                {
+                    LOG("error closing connection to daemon: %s", strerror(errno));
+                    return 1;
+                }
+                if (w == 1 && ways[0].open)
+                {
+                    LOG("daemon closed the connection");
+                    return 1;
+                }
+                continue;
+            }
+
+            for (size_t done = 0; done < (size_t)(got);)
+            {
+                const ssize_t ret = w == 0 ? send(fd, buffer + done, (size_t)(got) - done, MSG_NOSIGNAL)
+                                           : write(STDOUT_FILENO, buffer + done, (size_t)(got) - done);
+                if (ret == -1 && errno != EINTR)
+                {
+                    LOG("error writing %s: %s", w == 0 ? "to daemon" : "stdout", strerror(errno));
+                    return 1;
+                }
+                done += ret > 0 ? (size_t)(ret) : 0;
+            }
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+// --probe: compresses a sample with a few profiles at THREADS and LEVEL and prints speed and ratio of each
+// the tables of the level shrink along with the window, the way zstd does it for small inputs, unless they were
+// given explicitly
+static inline int table_log(const profile_t *p, ZSTD_cParameter param, unsigned levelLog, int windowLog)
+{
+    const int given = profile_get(p, param);
+    if (given > 0)
+    {
+        return given;
+    }
+    return (int)(levelLog) < windowLog + 1 ? (int)(levelLog) : windowLog + 1;
+}
+
+// zstd memory of one stream. ZSTD_estimateCStreamSize_usingCCtxParams only covers a single thread, with workers
+// each of them has a context and a job in flight on top of the shared window and the job being filled
+static inline size_t estimate_zstd(int level, const profile_t *p, int windowLog)
+{
+    const ZSTD_compressionParameters cparams = ZSTD_getCParams(level, ZSTD_CONTENTSIZE_UNKNOWN, 0);
+    ZSTD_CCtx_params *params = ZSTD_createCCtxParams();
+    if (params == NULL)
+    {
+        return SIZE_MAX;
+    }
+
+    ZSTD_CCtxParams_init(params, level);
+    for (size_t i = 0; i < p->count; i++)
+    {
+        ZSTD_CCtxParams_setParameter(params, p->params[i], p->values[i]);
+    }
+    ZSTD_CCtxParams_setParameter(params, ZSTD_c_windowLog, windowLog);
+    ZSTD_CCtxParams_setParameter(params, ZSTD_c_hashLog, table_log(p, ZSTD_c_hashLog, cparams.hashLog, windowLog));
+    ZSTD_CCtxParams_setParameter(params, ZSTD_c_chainLog, table_log(p, ZSTD_c_chainLog, cparams.chainLog, windowLog));
+    ZSTD_CCtxParams_setParameter(params, ZSTD_c_nbWorkers, 0);
+    const size_t single = ZSTD_estimateCStreamSize_usingCCtxParams(params);
+    ZSTD_freeCCtxParams(params);
+
+    if (ZSTD_isError(single))
+    {
+        return SIZE_MAX;
+    }
+    if (config.workers <= 1)
+    {
+        return single;
+    }
+
+    // zstd sizes jobs at 4 windows, but at least 1 MiB
+    const size_t window = (size_t)(1) << windowLog;
+    const int jobSize = profile_get(p, ZSTD_c_jobSize);
+    const size_t job = jobSize > 0 ? (size_t)(jobSize) : (window * 4 > (1u << 20) ? window * 4 : (1u << 20));
+    return (size_t)(config.workers) * (single + job + ZSTD_compressBound(job)) + window + job;
+}
+
+// --memory-limit: lowers windowLog, and hashLog and chainLog with it, until zstd fits into what the buffers of a
+// stream leave over. zstd then gets all of that as its arena
+static inline int fit_memory()
+{
+    // --shards: every lane has its buffers and context, and with separate files its own output buffer
+    const size_t readBytes = pipeline.enabled ? config.shards * pipeline.bufferCount * pipeline.bufferSize : input.bufferSize;
+    size_t outputBytes = config.mmap ? 0 : stream.outputBufferSize * (writer.enabled ? writer.bufferCount : 1);
+    if (config.shards > 1)
+    {
+        outputBytes = config.interleaved ? outputBytes + config.shards * ZSTD_compressBound(pipeline.bufferSize)
+                                         : outputBytes * config.shards;
+    }
+    // --sink: copies on their way out, for every stream
+    const size_t streamCount = router.field > 0 || router.named ? router.maxRoutes + 1 : config.shards;
+    outputBytes += sink_memory(streamCount);
+    // --accumulate: a stage for every stream as well, and --train-dictionary keeps its samples
+    const size_t inputBytes =
+        readBytes + streamCount * config.accumulate + (dictionary.trainPath != NULL ? samples_capacity() : 0);
+    if (inputBytes + outputBytes >= memory.limit)
+    {
+        LOG("buffers alone take %zu bytes of the %zu allowed by --memory-limit", inputBytes + outputBytes, memory.limit);
+        return -1;
+    }
+    const size_t budget = (memory.limit - inputBytes - outputBytes) / config.shards;
+
+    // sized for the highest level the stream can reach
+    const int level = adaptive.enabled ? adaptive.max : config.level;
+    const int given = profile_get(&profile, ZSTD_c_windowLog);
+    int windowLog = given > 0 ? given : (int)(ZSTD_getCParams(level, ZSTD_CONTENTSIZE_UNKNOWN, 0).windowLog);
+    size_t estimate = estimate_zstd(level, &profile, windowLog);
+    while (estimate > budget && windowLog > ZSTD_WINDOWLOG_MIN)
+    {
+        windowLog--;
+        estimate = estimate_zstd(level, &profile, windowLog);
+    }
+
+    if (estimate > budget)
+    {
+        LOG("zstd needs %zu bytes even with windowLog %d, --memory-limit leaves %zu", estimate, windowLog, budget);
+        return -1;
+    }
+
+    const ZSTD_compressionParameters cparams = ZSTD_getCParams(level, ZSTD_CONTENTSIZE_UNKNOWN, 0);
+    const int hashLog = table_log(&profile, ZSTD_c_hashLog, cparams.hashLog, windowLog);
+    const int chainLog = table_log(&profile, ZSTD_c_chainLog, cparams.chainLog, windowLog);
+    profile_set(&profile, ZSTD_c_windowLog, "windowLog", windowLog);
+    profile_set(&profile, ZSTD_c_hashLog, "hashLog", hashLog);
+    profile_set(&profile, ZSTD_c_chainLog, "chainLog", chainLog);
+    memory.arenaSize = budget;
+    LOG("memory limit %zu: buffers %zu, zstd %zu with windowLog %d (x%zu)", memory.limit, inputBytes + outputBytes,
+        estimate, windowLog, config.shards);
+    return 0;
+}
+
+static inline int probe(const char *path, const profile_t *extra, size_t extraCount)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        LOG("error opening probe sample ('%s'): %s", path, strerror(errno));
+        return -1;
+    }
+
+    char *sample = NULL;
+    size_t size = 0;
+    long len = -1;
+    if (fseek(file, 0, SEEK_END) == 0 && (len = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0)
+    {
+        size = (size_t)(len);
+        sample = (char *)malloc(size);
+    }
+    if (sample == NULL || fread(sample, 1, size, file) != size)
+    {
+        LOG("error reading probe sample ('%s')", path);
+        free(sample);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    static const char *const builtins[] = {
+        "",
+        "enableLongDistanceMatching=1",
+        "enableLongDistanceMatching=1,windowLog=27",
+        "strategy=lazy2",
+        "strategy=btopt",
+    };
+    const size_t builtinCount = sizeof builtins / sizeof builtins[0];
+
+    const size_t capacity = ZSTD_compressBound(size);
+    char *out = (char *)malloc(capacity);
+    ZSTD_CCtx *zctx = ZSTD_createCCtx();
+    if (out == NULL || zctx == NULL)
+    {
+        LOG("error allocating probe buffers");
+        free(sample);
+        free(out);
+        ZSTD_freeCCtx(zctx);
+        return -1;
+    }
+
+    printf("sample %s: %zu bytes, threads %d, level %d\n", path, size, config.workers, config.level);
+    printf("%10s %8s  %s\n", "MiB/s", "ratio", "profile");
+
+    int ret = 0;
+    for (size_t i = 0; i < builtinCount + extraCount; i++)
+    {
+        profile_t builtin = {.count = 0};
+        if (i < builtinCount && parse_profile(builtins[i], &builtin) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        const profile_t *p = i < builtinCount ? &builtin : &extra[i - builtinCount];
+
+        ZSTD_CCtx_reset(zctx, ZSTD_reset_session_and_parameters);
+        if (set_parameter(zctx, ZSTD_c_compressionLevel, config.level, "compression level") != 0 ||
+            set_parameter(zctx, ZSTD_c_checksumFlag, 1, "checksumming") != 0 ||
+            (config.workers != 1 && set_parameter(zctx, ZSTD_c_nbWorkers, config.workers, "threads") != 0) ||
+            apply_profile(zctx, p) != 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        // repeated for at least half a second so small samples still give a stable speed
+        size_t compressed = 0;
+        size_t rounds = 0;
+        const uint64_t start = now_us();
+        uint64_t elapsed = 0;
+        do
+        {
+            compressed = ZSTD_compress2(zctx, out, capacity, sample, size);
+            if (ZSTD_isError(compressed))
+            {
+                LOG("error compressing probe sample: %s", ZSTD_getErrorName(compressed));
+                ret = -1;
+                break;
+            }
+            rounds++;
+            elapsed = now_us() - start;
+        } while (elapsed < 500000);
+        if (ret != 0)
+        {
+            break;
+        }
+
+        char description[512] = "level only";
+        if (p->count > 0)
+        {
+            size_t used = 0;
+            for (size_t j = 0; j < p->count && used < sizeof description; j++)
+            {
+                const int n = p->params[j] == ZSTD_c_strategy
+                                  ? snprintf(description + used, sizeof description - used, "%s%s=%s", j > 0 ? "," : "",
+                                             p->names[j], STRATEGIES[p->values[j]])
+                                  : snprintf(description + used, sizeof description - used, "%s%s=%d", j > 0 ? "," : "",
+                                             p->names[j], p->values[j]);
+                used += n > 0 ? (size_t)(n) : 0;
+            }
+        }
+
+        printf("%10.1f %8.3f  %s\n", (double)(size * rounds) / (1024.0 * 1024) / ((double)(elapsed) / 1e6),
+               (double)(size) / (double)(compressed), description);
+        fflush(stdout);
+    }
+
+    free(sample);
+    free(out);
+    ZSTD_freeCCtx(zctx);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+// omzstd recover: finds where a file stops being valid by walking frame and block headers, nothing is
+// decompressed except a torn frame closed with --salvage
+
+#define BLOCK_HEADER_SIZE 3
+#define BLOCK_RLE 1
+#define BLOCK_RESERVED 3
+// bit of the frame header descriptor that announces a checksum after the last block
+#define FRAME_CHECKSUM_FLAG 0x04u
+
+// compressed bytes of one frame
+typedef struct span_t_
+{
+    off_t start;
+    off_t end;
+} span_t;
+
+typedef struct scan_t_
+{
+    off_t size;
+    // end of the last complete frame
+    off_t valid;
+    size_t frames;
+    size_t skippable;
+
+    // the frame cut short after valid: where its blocks start and where the last of them that is there in full ends
+    bool torn;
+    off_t tornBlocks;
+    off_t tornComplete;
+    // only a frame without a content size can be closed early
+    bool closable;
+
+    // with collect set every complete zstd frame is recorded
+    bool collect;
+    span_t *spans;
+    size_t spanCapacity;
+} scan_t;
+
+// returns the end of the frame whose blocks start at pos, or -1 if it is cut short. *complete follows the last
+// block that is there in full
+static inline off_t scan_blocks(int fd, off_t size, off_t pos, bool checksum, off_t *complete)
+{
+    *complete = pos;
+    while (1)
+    {
+        unsigned char raw[BLOCK_HEADER_SIZE];
+        if (pread(fd, raw, sizeof raw, pos) != (ssize_t)(sizeof raw))
+        {
+            return -1;
+        }
+
+        const uint32_t header = (uint32_t)(raw[0]) | (uint32_t)(raw[1]) << 8 | (uint32_t)(raw[2]) << 16;
+        const bool last = (header & 1) != 0;
+        const uint32_t type = (header >> 1) & 3;
+        const uint32_t blockSize = header >> 3;
+        // zeroes left behind by --preallocate or --mmap read as empty raw blocks, which zstd never writes
+        if (type == BLOCK_RESERVED || blockSize > ZSTD_BLOCKSIZE_MAX || header == 0)
+        {
+            return -1;
+        }
+
+        const off_t end = pos + BLOCK_HEADER_SIZE + (type == BLOCK_RLE ? 1 : (off_t)(blockSize));
+        if (end > size)
+        {
+            return -1;
+        }
+        pos = end;
+
+        if (last)
+        {
+            pos += checksum ? 4 : 0;
+            return pos <= size ? pos : -1;
+        }
+        *complete = pos;
+    }
+}
+
+// counts a complete frame, and records it with collect set
+static inline int scan_add(scan_t *scan, off_t start, off_t end)
+{
+    if (scan->collect)
+    {
+        if (scan->frames == scan->spanCapacity)
+        {
+            const size_t capacity = scan->spanCapacity == 0 ? 64 : scan->spanCapacity * 2;
+            span_t *spans = (span_t *)realloc(scan->spans, capacity * sizeof(span_t));
+            if (spans == NULL)
+            {
+                LOG("error growing frame list");
+                return -1;
+            }
+            scan->spans = spans;
+            scan->spanCapacity = capacity;
+        }
+        scan->spans[scan->frames] = (span_t){start, end};
+    }
+
+    scan->frames++;
+    scan->valid = end;
+    return 0;
+}
+
+// continues from valid, frames found in a seek table or index before are not walked again. a --transform marker
+// counts as the start of the frame behind it
+static inline int scan_frames(int fd, scan_t *scan)
+{
+    off_t pos = scan->valid;
+    off_t marker = -1;
+    while (pos < scan->size)
+    {
+        unsigned char head[ZSTD_FRAMEHEADERSIZE_MAX];
+        const ssize_t n = pread(fd, head, sizeof head, pos);
+        if (n < 4)
+        {
+            return 0;
+        }
+
+        const uint32_t magic = get_le32(head);
+        if ((magic & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START)
+        {
+            const off_t end = n >= 8 ? pos + 8 + (off_t)(get_le32(head + 4)) : scan->size + 1;
+            if (end > scan->size)
+            {
+                return 0;
+            }
+            bool midLine = false;
+            marker = transform_is_marker(head, (size_t)(n), &midLine) ? pos : -1;
+            scan->skippable++;
+            pos = scan->valid = end;
+            continue;
+        }
+
+        ZSTD_frameHeader header;
+        if (magic != ZSTD_MAGICNUMBER || ZSTD_getFrameHeader(&header, head, (size_t)(n)) != 0)
+        {
+            return 0;
+        }
+
+        const off_t blocks = pos + (off_t)(header.headerSize);
+        off_t complete = blocks;
+        const off_t end = scan_blocks(fd, scan->size, blocks, header.checksumFlag != 0, &complete);
+        if (end < 0)
+        {
+            scan->torn = true;
+            scan->tornBlocks = blocks;
+            scan->tornComplete = complete;
+            scan->closable = header.frameContentSize == ZSTD_CONTENTSIZE_UNKNOWN;
+            return 0;
+        }
+
+        if (scan_add(scan, marker >= 0 ? marker : pos, end) != 0)
+        {
+            return -1;
+        }
+        marker = -1;
+        pos = end;
+    }
+
+    return 0;
+}
+
+// decodes the frame at [start, end) without keeping anything, a frame that used a dictionary can not be checked
+static inline int verify_frame(int fd, off_t start, off_t end)
+{
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    const size_t inCapacity = ZSTD_DStreamInSize();
+    const size_t outCapacity = ZSTD_DStreamOutSize();
+    char *in = (char *)malloc(inCapacity);
+    char *out = (char *)malloc(outCapacity);
+    int ret = dctx != NULL && in != NULL && out != NULL &&
+                      !ZSTD_isError(ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, ZSTD_WINDOWLOG_MAX))
+                  ? 0
+                  : -1;
+
+    size_t remaining = 1;
+    for (off_t pos = start; ret == 0 && pos < end;)
+    {
+        const size_t want = (size_t)(end - pos) < inCapacity ? (size_t)(end - pos) : inCapacity;
+        const ssize_t n = pread(fd, in, want, pos);
+        if (n <= 0)
+        {
+            ret = -1;
+            break;
+        }
+        pos += n;
+
+        ZSTD_inBuffer zIn = {in, (size_t)(n), 0};
+        while (ret == 0 && zIn.pos < zIn.size)
+        {
+            ZSTD_outBuffer zOut = {out, outCapacity, 0};
+            remaining = ZSTD_decompressStream(dctx, &zOut, &zIn);
+            ret = ZSTD_isError(remaining) ? -1 : 0;
+        }
+    }
+
+    ZSTD_freeDCtx(dctx);
+    free(in);
+    free(out);
+    return ret == 0 && remaining == 0 ? 0 : -1;
+}
+
+// adds an empty last block to the torn frame and drops its checksum flag, the frame then ends after the last block
+// that made it to disk
+static inline int close_frame(int fd, const scan_t *scan)
+{
+    const off_t descriptor = scan->valid + 4;
+    unsigned char flags = 0;
+    if (pread(fd, &flags, 1, descriptor) != 1)
+    {
+        return -1;
+    }
+    flags = (unsigned char)(flags & ~FRAME_CHECKSUM_FLAG);
+
+    // raw, last, no content
+    static const unsigned char lastBlock[BLOCK_HEADER_SIZE] = {1, 0, 0};
+    if (ftruncate(fd, scan->tornComplete) != 0 || pwrite(fd, &flags, 1, descriptor) != 1 ||
+        pwrite(fd, lastBlock, sizeof lastBlock, scan->tornComplete) != (ssize_t)(sizeof lastBlock))
+    {
+        LOG("error closing torn frame: %s", strerror(errno));
+        return -1;
+    }
+
+    return verify_frame(fd, scan->valid, scan->tornComplete + BLOCK_HEADER_SIZE);
+}
+
+// drops the index lines of segments that no longer end inside the file
+static inline int trim_index(const char *path, off_t keep)
+{
+    char indexName[2048 + 4] = {0};
+    char tmpName[2048 + 8] = {0};
+    snprintf(indexName, sizeof indexName, "%s.idx", path);
+    snprintf(tmpName, sizeof tmpName, "%s.idx.tmp", path);
+
+    FILE *in = fopen(indexName, "rb");
+    if (in == NULL)
+    {
+        return errno == ENOENT ? 0 : -1;
+    }
+    FILE *out = fopen(tmpName, "wb");
+    if (out == NULL)
+    {
+        LOG("error creating index ('%s'): %s", tmpName, strerror(errno));
+        fclose(in);
+        return -1;
+    }
+
+    char line[512];
+    size_t dropped = 0;
+    while (fgets(line, sizeof line, in) != NULL)
+    {
+        unsigned long long offset = 0;
+        unsigned long long size = 0;
+        if (line[0] != '#' && (sscanf(line, "%llu\t%llu", &offset, &size) != 2 || offset + size > (unsigned long long)(keep)))
+        {
+            dropped++;
+            continue;
+        }
+        fputs(line, out);
+    }
+
+    const bool failed = ferror(in) || fflush(out) != 0 || fsync(fileno(out)) != 0;
+    fclose(in);
+    if (fclose(out) != 0 || failed || rename(tmpName, indexName) != 0)
+    {
+        LOG("error rewriting index ('%s'): %s", indexName, strerror(errno));
+        unlink(tmpName);
+        return -1;
+    }
+
+    printf("%s: dropped %zu index lines\n", indexName, dropped);
+    return 0;
+}
+
+static inline int recover_file(const char *path, bool salvage, bool dryRun)
+{
+    const int fd = open(path, (dryRun ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0)
+    {
+        LOG("error opening '%s': %s", path, strerror(errno));
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    scan_t scan = {.size = st.st_size, .collect = false};
+    scan_frames(fd, &scan);
+
+    printf("%s: %zu frames, %zu skippable, %lld of %lld bytes valid\n", path, scan.frames, scan.skippable,
+           (long long)(scan.valid), (long long)(scan.size));
+
+    int ret = 0;
+    if (scan.valid < scan.size && !dryRun)
+    {
+        off_t keep = scan.valid;
+        if (salvage && scan.torn && scan.closable && scan.tornComplete > scan.tornBlocks)
+        {
+            if (close_frame(fd, &scan) == 0)
+            {
+                keep = scan.tornComplete + BLOCK_HEADER_SIZE;
+                printf("%s: closed the torn frame after %lld bytes of blocks, it has no checksum\n", path,
+                       (long long)(scan.tornComplete - scan.tornBlocks));
+            }
+            else
+            {
+                printf("%s: the torn frame does not decode, dropping it\n", path);
+            }
+        }
+
+        if (ftruncate(fd, keep) != 0 || fsync(fd) != 0)
+        {
+            LOG("error truncating '%s': %s", path, strerror(errno));
+            ret = -1;
+        }
+        else
+        {
+            printf("%s: truncated to %lld bytes\n", path, (long long)(keep));
+            ret = trim_index(path, keep);
+        }
+    }
+
+    close(fd);
+    return ret;
+}
+
+// omzstd recover [--salvage] [--dry-run] FILE...
+static inline int recover(int argc, char **argv)
+{
+    bool salvage = false;
+    bool dryRun = false;
+    int first = 0;
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++)
+    {
+        if (strcmp(argv[first], "--salvage") == 0)
+        {
+            salvage = true;
+        }
+        else if (strcmp(argv[first], "--dry-run") == 0)
+        {
+            dryRun = true;
+        }
+        else
+        {
+            LOG("unknown recover option '%s'", argv[first]);
+            return 1;
+        }
+    }
+
+    if (first == argc)
+    {
+        LOG("usage: omzstd recover [--salvage] [--dry-run] FILE...");
+        return 1;
+    }
+
+    int ret = 0;
+    for (int i = first; i < argc; i++)
+    {
+        ret = recover_file(argv[i], salvage, dryRun) != 0 ? 1 : ret;
+    }
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+// omzstd grep: decompresses the frames of the given files on all cores and prints the matching lines in file order.
+// frames come from the seek table, the sidecar index or, for whatever those do not cover, a header scan
+
+typedef struct grep_job_t_
+{
+    size_t file;
+    span_t span;
+    bool firstOfFile;
+    bool lastOfFile;
+
+    // output up to and including the first newline, its line started in the frame before. newline is false while
+    // the whole frame is still part of that line
+    text_t head;
+    bool newline;
+    // matching lines that are entirely inside the frame
+    text_t matches;
+    // output after the last newline, its line goes on in the next frame
+    text_t tail;
+
+    bool done;
+    bool failed;
+} grep_job_t;
+
+typedef struct grep_t_
+{
+    const char *pattern;
+    size_t patternLen;
+    // --regex: POSIX extended regular expression instead of a fixed string
+    bool regex;
+    regex_t compiled;
+    // omzstd cat: every line, exactly as it was written
+    bool all;
+    // every --dictionary file, and those found in a --dictionary directory. zstd picks one by the frame's dict ID
+    ZSTD_DDict **ddicts;
+    size_t ddictCount;
+    size_t threads;
+
+    // more than one file: matches are prefixed with their file name like grep does
+    bool names;
+    char **paths;
+    int *fds;
+    size_t fileCount;
+
+    grep_job_t *jobs;
+    size_t jobCount;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    // next job for a worker, jobs before emitted are printed already
+    size_t nextJob;
+    size_t emitted;
+    // jobs at most decompressed ahead of the printer, bounds memory
+    size_t window;
+} grep_t;
+
+static grep_t grep = {
+    .pattern = NULL,
+    .patternLen = 0,
+    .regex = false,
+    .all = false,
+    .ddicts = NULL,
+    .ddictCount = 0,
+    .threads = 0,
+    .names = false,
+    .paths = NULL,
+    .fds = NULL,
+    .fileCount = 0,
+    .jobs = NULL,
+    .jobCount = 0,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER,
+    .nextJob = 0,
+    .emitted = 0,
+    .window = 0};
+
+// appends the matching lines of data, which holds whole lines except maybe for an unterminated last one.
+// fixed strings are searched across all lines at once with memmem, only a hit is widened to its line
+static inline int grep_lines(text_t *out, size_t file, const char *data, size_t size)
+{
+    if (grep.all)
+    {
+        return text_append(out, data, size);
+    }
+
+    const char *end = data + size;
+    const char *p = data;
+    while (p < end)
+    {
+        const char *lineStart = p;
+        const char *lineEnd = NULL;
+        if (!grep.regex)
+        {
+            const char *hit = (const char *)memmem(p, (size_t)(end - p), grep.pattern, grep.patternLen);
+            if (hit == NULL)
+            {
+                return 0;
+            }
+            const char *nl = (const char *)memrchr(p, '\n', (size_t)(hit - p));
+            lineStart = nl == NULL ? p : nl + 1;
+            nl = (const char *)memchr(hit, '\n', (size_t)(end - hit));
+            lineEnd = nl == NULL ? end : nl + 1;
+        }
+        else
+        {
+            const char *nl = (const char *)memchr(p, '\n', (size_t)(end - p));
+            lineEnd = nl == NULL ? end : nl + 1;
+            regmatch_t match = {.rm_so = 0, .rm_eo = (regoff_t)((nl == NULL ? end : nl) - p)};
+            if (regexec(&grep.compiled, p, 1, &match, REG_STARTEND) != 0)
+            {
+                p = lineEnd;
+                continue;
+            }
+        }
+
+        if ((grep.names && (text_append(out, grep.paths[file], strlen(grep.paths[file])) != 0 || text_append(out, ":", 1) != 0)) ||
+            text_append(out, lineStart, (size_t)(lineEnd - lineStart)) != 0 ||
+            (lineEnd[-1] != '\n' && text_append(out, "\n", 1) != 0))
+        {
+            return -1;
+        }
+        p = lineEnd;
+    }
+
+    return 0;
+}
+
+// sorts a piece of decompressed output into the head, the lines of the frame and the unterminated rest in line
+static inline int grep_chunk(grep_job_t *job, text_t *line, const char *data, size_t size)
+{
+    const char *end = data + size;
+    if (!job->newline)
+    {
+        const char *nl = (const char *)memchr(data, '\n', size);
+        const char *stop = nl == NULL ? end : nl + 1;
+        if (text_append(&job->head, data, (size_t)(stop - data)) != 0)
+        {
+            return -1;
+        }
+        if (nl == NULL)
+        {
+            return 0;
+        }
+        job->newline = true;
+        data = stop;
+    }
+
+    if (line->size > 0)
+    {
+        const char *nl = (const char *)memchr(data, '\n', (size_t)(end - data));
+        if (nl == NULL)
+        {
+            return text_append(line, data, (size_t)(end - data));
+        }
+        if (text_append(line, data, (size_t)(nl + 1 - data)) != 0 ||
+            grep_lines(&job->matches, job->file, line->data, line->size) != 0)
+        {
+            return -1;
+        }
+        line->size = 0;
+        data = nl + 1;
+    }
+
+    const char *last = (const char *)memrchr(data, '\n', (size_t)(end - data));
+    if (last == NULL)
+    {
+        return text_append(line, data, (size_t)(end - data));
+    }
+    if (grep_lines(&job->matches, job->file, data, (size_t)(last + 1 - data)) != 0)
+    {
+        return -1;
+    }
+    return text_append(line, last + 1, (size_t)(end - last - 1));
+}
+
+// a worker's decompression context and buffers
+typedef struct grep_worker_t_
+{
+    ZSTD_DCtx *dctx;
+    char *in;
+    size_t inCapacity;
+    char *out;
+    size_t outCapacity;
+    // frames written with --transform are decoded into plain first
+    transform_t *decoder;
+    text_t plain;
+} grep_worker_t;
+
+static inline int grep_frame(grep_worker_t *w, grep_job_t *job)
+{
+    ZSTD_DCtx_reset(w->dctx, ZSTD_reset_session_only);
+
+    const int fd = grep.fds[job->file];
+    unsigned char marker[TRANSFORM_MARKER_SIZE];
+    bool midLine = false;
+    const bool transformed = pread(fd, marker, sizeof marker, job->span.start) == (ssize_t)(sizeof marker) &&
+                             transform_is_marker(marker, sizeof marker, &midLine);
+    if (transformed)
+    {
+        transform_reset(w->decoder, midLine);
+    }
+
+    char *in = w->in;
+    const size_t inCapacity = w->inCapacity;
+    size_t remaining = 1;
+    for (off_t pos = job->span.start; pos < job->span.end;)
+    {
+        const size_t want = (size_t)(job->span.end - pos) < inCapacity ? (size_t)(job->span.end - pos) : inCapacity;
+        const ssize_t n = pread(fd, in, want, pos);
+        if (n <= 0)
+        {
+            LOG("error reading '%s': %s", grep.paths[job->file], n == 0 ? "file shrank" : strerror(errno));
+            return -1;
+        }
+        pos += n;
+
+        ZSTD_inBuffer zIn = {in, (size_t)(n), 0};
+        while (zIn.pos < zIn.size)
+        {
+            ZSTD_outBuffer zOut = {w->out, w->outCapacity, 0};
+            remaining = ZSTD_decompressStream(w->dctx, &zOut, &zIn);
+            if (ZSTD_isError(remaining))
+            {
+                LOG("error decompressing '%s' at %lld: %s", grep.paths[job->file], (long long)(job->span.start),
+                    ZSTD_getErrorName(remaining));
+                return -1;
+            }
+
+            const char *plain = w->out;
+            size_t plainSize = zOut.pos;
+            if (transformed)
+            {
+                w->plain.size = 0;
+                if (transform_decode(w->decoder, w->out, zOut.pos, &w->plain) != 0)
+                {
+                    LOG("error decoding transformed frame of '%s' at %lld", grep.paths[job->file],
+                        (long long)(job->span.start));
+                    return -1;
+                }
+                plain = w->plain.data;
+                plainSize = w->plain.size;
+            }
+            if (grep_chunk(job, &job->tail, plain, plainSize) != 0)
+            {
+                return -1;
+            }
+        }
+    }
+
+    if (remaining != 0)
+    {
+        LOG("frame of '%s' at %lld ends early", grep.paths[job->file], (long long)(job->span.start));
+        return -1;
+    }
+    return 0;
+}
+
+// quiet skips files that are no zstd dictionaries, for the ones found in a directory
+static inline int grep_add_dictionary(const char *path, bool quiet)
+{
+    size_t size = 0;
+    char *buffer = read_dictionary(path, &size);
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+    if (quiet && ZSTD_getDictID_fromDict(buffer, size) == 0)
+    {
+        free(buffer);
+        return 0;
+    }
+
+    ZSTD_DDict **ddicts = (ZSTD_DDict **)realloc(grep.ddicts, (grep.ddictCount + 1) * sizeof(ZSTD_DDict *));
+    ZSTD_DDict *ddict = ddicts != NULL ? ZSTD_createDDict(buffer, size) : NULL;
+    free(buffer);
+    if (ddicts != NULL)
+    {
+        grep.ddicts = ddicts;
+    }
+    if (ddict == NULL)
+    {
+        LOG("error creating dictionary from '%s'", path);
+        return -1;
+    }
+    grep.ddicts[grep.ddictCount++] = ddict;
+    return 0;
+}
+
+// a file, or a directory with the FILE.<dictID> dictionaries of --train-dictionary
+static inline int grep_load_dictionary(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        LOG("error opening dictionary ('%s'): %s", path, strerror(errno));
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+        return grep_add_dictionary(path, false);
+    }
+
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        LOG("error opening dictionary directory ('%s'): %s", path, strerror(errno));
+        return -1;
+    }
+
+    int ret = 0;
+    struct dirent *entry;
+    while (ret == 0 && (entry = readdir(dir)) != NULL)
+    {
+        const size_t len = strlen(entry->d_name);
+        char name[4096];
+        // half written ones of a running trainer
+        if (entry->d_name[0] == '.' || (len > 4 && strcmp(entry->d_name + len - 4, ".tmp") == 0) ||
+            (size_t)(snprintf(name, sizeof name, "%s/%s", path, entry->d_name)) >= sizeof name)
+        {
+            continue;
+        }
+        if (stat(name, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            ret = grep_add_dictionary(name, true);
+        }
+    }
+    closedir(dir);
+
+    return ret;
+}
+
+static inline bool grep_ref_dictionaries(ZSTD_DCtx *dctx)
+{
+    if (grep.ddictCount > 1 &&
+        ZSTD_isError(ZSTD_DCtx_setParameter(dctx, ZSTD_d_refMultipleDDicts, ZSTD_rmd_refMultipleDDicts)))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < grep.ddictCount; i++)
+    {
+        if (ZSTD_isError(ZSTD_DCtx_refDDict(dctx, grep.ddicts[i])))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void *grep_main(void *arg)
+{
+    (void)arg;
+
+    grep_worker_t w = {
+        .dctx = ZSTD_createDCtx(),
+        .inCapacity = ZSTD_DStreamInSize(),
+        .outCapacity = ZSTD_DStreamOutSize(),
+        .decoder = transform_new(false),
+        .plain = {NULL, 0, 0}};
+    w.in = (char *)malloc(w.inCapacity);
+    w.out = (char *)malloc(w.outCapacity);
+    const bool ready = w.dctx != NULL && w.in != NULL && w.out != NULL && w.decoder != NULL &&
+                       !ZSTD_isError(ZSTD_DCtx_setParameter(w.dctx, ZSTD_d_windowLogMax, ZSTD_WINDOWLOG_MAX)) &&
+                       grep_ref_dictionaries(w.dctx);
+    if (!ready)
+    {
+        LOG("error setting up decompression");
+    }
+
+    pthread_mutex_lock(&grep.lock);
+    while (1)
+    {
+        while (grep.nextJob < grep.jobCount && grep.nextJob >= grep.emitted + grep.window)
+        {
+            pthread_cond_wait(&grep.changed, &grep.lock);
+        }
+        if (grep.nextJob == grep.jobCount)
+        {
+            break;
+        }
+
+        grep_job_t *job = &grep.jobs[grep.nextJob++];
+        pthread_mutex_unlock(&grep.lock);
+        const bool failed = !ready || grep_frame(&w, job) != 0;
+        pthread_mutex_lock(&grep.lock);
+
+        job->failed = failed;
+        job->done = true;
+        pthread_cond_broadcast(&grep.changed);
+    }
+    pthread_mutex_unlock(&grep.lock);
+
+    ZSTD_freeDCtx(w.dctx);
+    free(w.in);
+    free(w.out);
+    transform_free(w.decoder);
+    text_free(&w.plain);
+    return NULL;
+}
+
+// frames from the seek table of a seekable file, 0 if there is none or it does not fit the file
+static inline int seek_table_frames(int fd, scan_t *scan)
+{
+    unsigned char footer[9];
+    if (scan->size < 17 || pread(fd, footer, sizeof footer, scan->size - 9) != (ssize_t)(sizeof footer) ||
+        get_le32(footer + 5) != SEEKABLE_MAGIC)
+    {
+        return 0;
+    }
+
+    const uint32_t count = get_le32(footer);
+    const off_t entrySize = (footer[4] & 0x80) ? 12 : 8;
+    const off_t tableSize = (off_t)(count)*entrySize + 9;
+    const off_t tableStart = scan->size - tableSize - 8;
+    unsigned char header[8];
+    if (tableStart < 0 || pread(fd, header, sizeof header, tableStart) != (ssize_t)(sizeof header) ||
+        get_le32(header) != SEEKABLE_SKIPPABLE_MAGIC || (off_t)(get_le32(header + 4)) != tableSize)
+    {
+        return 0;
+    }
+
+    unsigned char *entries = (unsigned char *)malloc((size_t)(tableSize));
+    if (entries == NULL || pread(fd, entries, (size_t)(tableSize), tableStart + 8) != (ssize_t)(tableSize))
+    {
+        free(entries);
+        return 0;
+    }
+
+    off_t pos = 0;
+    for (uint32_t i = 0; i < count && pos <= tableStart; i++)
+    {
+        const off_t end = pos + (off_t)(get_le32(entries + (off_t)(i)*entrySize));
+        if (end > tableStart || scan_add(scan, pos, end) != 0)
+        {
+            break;
+        }
+        pos = end;
+    }
+    free(entries);
+
+    // a table that does not add up is ignored, the scan finds the frames instead
+    if (pos != tableStart)
+    {
+        scan->frames = 0;
+        scan->valid = 0;
+        return 0;
+    }
+    return 1;
+}
+
+// frames from the sidecar index, every segment with frame_start set begins one. each start is checked for a
+// frame magic, anything the index stops short of is left to the scan
+static inline int index_frames(const char *path, int fd, scan_t *scan)
+{
+    char indexName[2048 + 4] = {0};
+    snprintf(indexName, sizeof indexName, "%s.idx", path);
+    FILE *file = fopen(indexName, "rb");
+    if (file == NULL)
+    {
+        return 0;
+    }
+
+    char line[512];
+    off_t start = -1;
+    off_t end = 0;
+    bool valid = true;
+    while (valid && fgets(line, sizeof line, file) != NULL)
+    {
+        unsigned long long offset = 0;
+        unsigned long long size = 0;
+        int frameStart = 0;
+        if (line[0] == '#')
+        {
+            continue;
+        }
+        if (sscanf(line, "%llu\t%llu\t%*s\t%*s\t%*s\t%*s\t%*s\t%d", &offset, &size, &frameStart) != 3 ||
+            (off_t)(offset) != end || (off_t)(offset + size) > scan->size)
+        {
+            valid = false;
+            break;
+        }
+
+        if (frameStart)
+        {
+            unsigned char magic[4];
+            valid = pread(fd, magic, sizeof magic, (off_t)(offset)) == (ssize_t)(sizeof magic) &&
+                    (get_le32(magic) == ZSTD_MAGICNUMBER || get_le32(magic) == TRANSFORM_MAGIC) &&
+                    (start < 0 || scan_add(scan, start, (off_t)(offset)) == 0);
+            start = (off_t)(offset);
+        }
+        end = (off_t)(offset + size);
+    }
+    fclose(file);
+
+    // the last frame ends where its last segment does, unless the index ends inside it
+    if (valid && start >= 0)
+    {
+        unsigned char next[4];
+        const bool frameEnd = end == scan->size ||
+                              (pread(fd, next, sizeof next, end) == (ssize_t)(sizeof next) &&
+                               (get_le32(next) == ZSTD_MAGICNUMBER ||
+                                (get_le32(next) & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START));
+        if (frameEnd && scan_add(scan, start, end) != 0)
+        {
+            valid = false;
+        }
+    }
+
+    if (!valid)
+    {
+        scan->frames = 0;
+        scan->valid = 0;
+        return 0;
+    }
+    return 1;
+}
+
+// one job per frame of every file, in file order
+static inline int grep_plan()
+{
+    for (size_t i = 0; i < grep.fileCount; i++)
+    {
+        const char *path = grep.paths[i];
+        struct stat st;
+        grep.fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+        if (grep.fds[i] == -1 || fstat(grep.fds[i], &st) != 0)
+        {
+            LOG("error opening '%s': %s", path, strerror(errno));
+            return -1;
+        }
+
+        scan_t scan = {.size = st.st_size, .collect = true};
+        if ((seek_table_frames(grep.fds[i], &scan) == 0 && index_frames(path, grep.fds[i], &scan) < 0) ||
+            scan_frames(grep.fds[i], &scan) != 0)
+        {
+            free(scan.spans);
+            return -1;
+        }
+        if (scan.valid < scan.size)
+        {
+            LOG("'%s': ignoring %lld bytes after the last complete frame", path, (long long)(scan.size - scan.valid));
+        }
+
+        grep_job_t *jobs = (grep_job_t *)realloc(grep.jobs, (grep.jobCount + scan.frames) * sizeof(grep_job_t));
+        if (jobs == NULL && scan.frames > 0)
+        {
+            LOG("error allocating grep jobs");
+            free(scan.spans);
+            return -1;
+        }
+        grep.jobs = jobs;
+
+        for (size_t j = 0; j < scan.frames; j++)
+        {
+            grep.jobs[grep.jobCount++] = (grep_job_t){
+                .file = i,
+                .span = scan.spans[j],
+                .firstOfFile = j == 0,
+                .lastOfFile = j + 1 == scan.frames};
+        }
+        free(scan.spans);
+    }
+
+    return 0;
+}
+
+// prints a finished job, its head completes the line left over from the frame before
+static inline int grep_emit(grep_job_t *job, text_t *carry, text_t *scratch, bool *matched)
+{
+    if (job->firstOfFile)
+    {
+        carry->size = 0;
+    }
+
+    scratch->size = 0;
+    if (text_append(carry, job->head.data, job->head.size) != 0)
+    {
+        return -1;
+    }
+    if (job->newline)
+    {
+        if (grep_lines(scratch, job->file, carry->data, carry->size) != 0)
+        {
+            return -1;
+        }
+        carry->size = 0;
+        if (text_append(scratch, job->matches.data, job->matches.size) != 0 ||
+            text_append(carry, job->tail.data, job->tail.size) != 0)
+        {
+            return -1;
+        }
+    }
+    if (job->lastOfFile && carry->size > 0)
+    {
+        if (grep_lines(scratch, job->file, carry->data, carry->size) != 0)
+        {
+            return -1;
+        }
+        carry->size = 0;
+    }
+
+    *matched = *matched || scratch->size > 0;
+    if (scratch->size > 0 && fwrite(scratch->data, 1, scratch->size, stdout) != scratch->size)
+    {
+        LOG("error writing matches: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// omzstd grep [--regex] [--threads N] [--dictionary FILE|DIR]... PATTERN FILE..., exits 0 on a match, 1 without, 2 on errors.
+// omzstd cat takes the same options but no pattern and prints everything, undoing --transform
+static inline int grep_files(int argc, char **argv, bool all)
+{
+    grep.all = all;
+    int first = 0;
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++)
+    {
+        if (strcmp(argv[first], "--regex") == 0)
+        {
+            grep.regex = true;
+        }
+        else if (strcmp(argv[first], "--threads") == 0 && first + 1 < argc)
+        {
+            if (parse_size(argv[++first], &grep.threads) != 0 || grep.threads < 1 || grep.threads > 1024)
+            {
+                LOG("invalid grep threads '%s' (1-1024)", argv[first]);
+                return 2;
+            }
+        }
+        else if (strcmp(argv[first], "--dictionary") == 0 && first + 1 < argc)
+        {
+            if (grep_load_dictionary(argv[++first]) != 0)
+            {
+                return 2;
+            }
+        }
+        else
+        {
+            LOG("unknown grep option '%s'", argv[first]);
+            return 2;
+        }
+    }
+
+    if (argc - first < (all ? 1 : 2))
+    {
+        LOG(all ? "usage: omzstd cat [--threads N] [--dictionary FILE|DIR]... FILE..."
+                : "usage: omzstd grep [--regex] [--threads N] [--dictionary FILE|DIR]... PATTERN FILE...");
+        return 2;
+    }
+
+    // cat matches everything, its file names start where the pattern would be
+    const int files = all ? first : first + 1;
+    grep.pattern = all ? "" : argv[first];
+    grep.patternLen = strlen(grep.pattern);
+    if (grep.regex)
+    {
+        const int err = regcomp(&grep.compiled, grep.pattern, REG_EXTENDED | REG_NOSUB);
+        if (err != 0)
+        {
+            char message[256];
+            regerror(err, &grep.compiled, message, sizeof message);
+            LOG("invalid regex '%s': %s", grep.pattern, message);
+            return 2;
+        }
+    }
+
+    grep.paths = argv + files;
+    grep.fileCount = (size_t)(argc - files);
+    grep.names = grep.fileCount > 1 && !all;
+    grep.fds = (int *)malloc(grep.fileCount * sizeof(int));
+    if (grep.fds == NULL || grep_plan() != 0)
+    {
+        return 2;
+    }
+
+    if (grep.threads == 0)
+    {
+        const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        grep.threads = cores > 0 ? (size_t)(cores) : 1;
+    }
+    grep.threads = grep.threads < grep.jobCount ? grep.threads : (grep.jobCount > 0 ? grep.jobCount : 1);
+    grep.window = grep.threads * 4;
+
+    pthread_t *workers = (pthread_t *)calloc(grep.threads, sizeof(pthread_t));
+    size_t started = 0;
+    for (; workers != NULL && started < grep.threads; started++)
+    {
+        const int err = pthread_create(&workers[started], NULL, grep_main, NULL);
+        if (err != 0)
+        {
+            LOG("error creating grep thread: %s", strerror(err));
+            break;
+        }
+    }
+
+    static char outBuffer[1 << 20];
+    setvbuf(stdout, outBuffer, _IOFBF, sizeof outBuffer);
+
+    int ret = started > 0 ? 0 : 2;
+    bool matched = false;
+    text_t carry = {NULL, 0, 0};
+    text_t scratch = {NULL, 0, 0};
+    for (size_t i = 0; ret == 0 && i < grep.jobCount; i++)
+    {
+        grep_job_t *job = &grep.jobs[i];
+        pthread_mutex_lock(&grep.lock);
+        while (!job->done)
+        {
+            pthread_cond_wait(&grep.changed, &grep.lock);
+        }
+        pthread_mutex_unlock(&grep.lock);
+
+        ret = job->failed || grep_emit(job, &carry, &scratch, &matched) != 0 ? 2 : 0;
+        text_free(&job->head);
+        text_free(&job->matches);
+        text_free(&job->tail);
+
+        pthread_mutex_lock(&grep.lock);
+        grep.emitted = i + 1;
+        pthread_cond_broadcast(&grep.changed);
+        pthread_mutex_unlock(&grep.lock);
+    }
+
+    // after an error the workers are told there is nothing left to take
+    pthread_mutex_lock(&grep.lock);
+    grep.jobCount = grep.nextJob;
+    pthread_cond_broadcast(&grep.changed);
+    pthread_mutex_unlock(&grep.lock);
+    for (size_t i = 0; i < started; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+
+    if (fflush(stdout) != 0)
+    {
+        ret = 2;
+    }
+
+    for (size_t i = 0; i < grep.jobCount; i++)
+    {
+        text_free(&grep.jobs[i].head);
+        text_free(&grep.jobs[i].matches);
+        text_free(&grep.jobs[i].tail);
+    }
+    text_free(&carry);
+    text_free(&scratch);
+    free(workers);
+    free(grep.jobs);
+    for (size_t i = 0; i < grep.fileCount; i++)
+    {
+        close(grep.fds[i]);
+    }
+    free(grep.fds);
+    for (size_t i = 0; i < grep.ddictCount; i++)
+    {
+        ZSTD_freeDDict(grep.ddicts[i]);
+    }
+    free(grep.ddicts);
+    if (grep.regex)
+    {
+        regfree(&grep.compiled);
+    }
+
+    return ret != 0 ? ret : (matched || all ? 0 : 1);
+}
+
+int main(int argc, char **argv)
+{
+    myPid = getpid();
+    stats.startedAt = now_ms();
+
+    if (argc >= 2 && strcmp(argv[1], "recover") == 0)
+    {
+        return recover(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "grep") == 0)
+    {
+        return grep_files(argc - 2, argv + 2, false);
+    }
+    if (argc >= 2 && strcmp(argv[1], "cat") == 0)
+    {
+        return grep_files(argc - 2, argv + 2, true);
+    }
+    if (argc >= 2 && strcmp(argv[1], "attach") == 0)
+    {
+        return attach(argc - 2, argv + 2);
+    }
+
+    enum
+    {
+        OPT_TRANSACTIONS = 256,
+        OPT_BEGIN_MARK,
+        OPT_COMMIT_MARK,
+        OPT_PIPELINE,
+        OPT_PIPELINE_BUFFERS,
+        OPT_PIPELINE_BUFFER_SIZE,
+        OPT_SHARDS,
+        OPT_SHARD_OUTPUT,
+        OPT_TRANSFORM,
+        OPT_WRITER,
+        OPT_WRITER_BUFFERS,
+        OPT_ROTATE_SIZE,
+        OPT_ROTATE_INTERVAL,
+        OPT_SEEKABLE,
+        OPT_ACCUMULATE,
+        OPT_DICTIONARY,
+        OPT_TRAIN_DICTIONARY,
+        OPT_DICTIONARY_SIZE,
+        OPT_MAX_FLUSH_LATENCY,
+        OPT_CHECKPOINT_INTERVAL,
+        OPT_DURABILITY,
+        OPT_SYNC_INTERVAL,
+        OPT_SYNC_BYTES,
+        OPT_ROUTE_FIELD,
+        OPT_ROUTE_DELIMITER,
+        OPT_MAX_ROUTES,
+        OPT_ADAPTIVE,
+        OPT_STATS_SOCKET,
+        OPT_PREALLOCATE,
+        OPT_DROP_CACHE,
+        OPT_PART,
+        OPT_MMAP,
+        OPT_SINK,
+        OPT_SINK_IN_FLIGHT,
+        OPT_SINK_PART_SIZE,
+        OPT_LISTEN,
+        OPT_MAX_CLIENTS,
+        OPT_INPUT_BUFFER_SIZE,
+        OPT_OUTPUT_BUFFER_SIZE,
+        OPT_MEMORY_LIMIT,
+        OPT_HUGE_PAGES,
+        OPT_READER_CPUS,
+        OPT_COMPRESSOR_CPUS,
+        OPT_WRITER_CPUS,
+        OPT_NUMA_NODE,
+        OPT_INDEX,
+        OPT_INDEX_TIME_FIELD,
+        OPT_INDEX_TIME_FORMAT,
+        OPT_PARAM,
+        OPT_PARAM_FILE,
+        OPT_PROBE,
+        OPT_PROBE_PROFILE,
+    };
+
+    static const struct option longOptions[] = {
+        {"transactions", no_argument, NULL, OPT_TRANSACTIONS},
+        {"begin-mark", required_argument, NULL, OPT_BEGIN_MARK},
+        {"commit-mark", required_argument, NULL, OPT_COMMIT_MARK},
+        {"pipeline", no_argument, NULL, OPT_PIPELINE},
+        {"pipeline-buffers", required_argument, NULL, OPT_PIPELINE_BUFFERS},
+        {"pipeline-buffer-size", required_argument, NULL, OPT_PIPELINE_BUFFER_SIZE},
+        {"shards", required_argument, NULL, OPT_SHARDS},
+        {"shard-output", required_argument, NULL, OPT_SHARD_OUTPUT},
+        {"transform", no_argument, NULL, OPT_TRANSFORM},
+        {"writer", no_argument, NULL, OPT_WRITER},
+        {"writer-buffers", required_argument, NULL, OPT_WRITER_BUFFERS},
+        {"rotate-size", required_argument, NULL, OPT_ROTATE_SIZE},
+        {"rotate-interval", required_argument, NULL, OPT_ROTATE_INTERVAL},
+        {"seekable", required_argument, NULL, OPT_SEEKABLE},
+        {"accumulate", required_argument, NULL, OPT_ACCUMULATE},
+        {"dictionary", required_argument, NULL, OPT_DICTIONARY},
+        {"train-dictionary", required_argument, NULL, OPT_TRAIN_DICTIONARY},
+        {"dictionary-size", required_argument, NULL, OPT_DICTIONARY_SIZE},
+        {"max-flush-latency", required_argument, NULL, OPT_MAX_FLUSH_LATENCY},
+        {"checkpoint-interval", required_argument, NULL, OPT_CHECKPOINT_INTERVAL},
+        {"durability", required_argument, NULL, OPT_DURABILITY},
+        {"sync-interval", required_argument, NULL, OPT_SYNC_INTERVAL},
+        {"sync-bytes", required_argument, NULL, OPT_SYNC_BYTES},
+        {"route-field", required_argument, NULL, OPT_ROUTE_FIELD},
+        {"route-delimiter", required_argument, NULL, OPT_ROUTE_DELIMITER},
+        {"max-routes", required_argument, NULL, OPT_MAX_ROUTES},
+        {"adaptive", optional_argument, NULL, OPT_ADAPTIVE},
+        {"stats-socket", required_argument, NULL, OPT_STATS_SOCKET},
+        {"preallocate", no_argument, NULL, OPT_PREALLOCATE},
+        {"drop-cache", no_argument, NULL, OPT_DROP_CACHE},
+        {"part", no_argument, NULL, OPT_PART},
+        {"mmap", no_argument, NULL, OPT_MMAP},
+        {"sink", required_argument, NULL, OPT_SINK},
+        {"sink-in-flight", required_argument, NULL, OPT_SINK_IN_FLIGHT},
+        {"sink-part-size", required_argument, NULL, OPT_SINK_PART_SIZE},
+        {"listen", required_argument, NULL, OPT_LISTEN},
+        {"max-clients", required_argument, NULL, OPT_MAX_CLIENTS},
+        {"input-buffer-size", required_argument, NULL, OPT_INPUT_BUFFER_SIZE},
+        {"output-buffer-size", required_argument, NULL, OPT_OUTPUT_BUFFER_SIZE},
+        {"memory-limit", required_argument, NULL, OPT_MEMORY_LIMIT},
+        {"huge-pages", optional_argument, NULL, OPT_HUGE_PAGES},
+        {"reader-cpus", required_argument, NULL, OPT_READER_CPUS},
+        {"compressor-cpus", required_argument, NULL, OPT_COMPRESSOR_CPUS},
+        {"writer-cpus", required_argument, NULL, OPT_WRITER_CPUS},
+        {"numa-node", required_argument, NULL, OPT_NUMA_NODE},
+        {"index", no_argument, NULL, OPT_INDEX},
+        {"index-time-field", required_argument, NULL, OPT_INDEX_TIME_FIELD},
+        {"index-time-format", required_argument, NULL, OPT_INDEX_TIME_FORMAT},
+        {"param", required_argument, NULL, OPT_PARAM},
+        {"param-file", required_argument, NULL, OPT_PARAM_FILE},
+        {"probe", required_argument, NULL, OPT_PROBE},
+        {"probe-profile", required_argument, NULL, OPT_PROBE_PROFILE},
+        {NULL, 0, NULL, 0}};
+
+    const char *probePath = NULL;
+    profile_t probeProfiles[16];
+    memset(probeProfiles, 0, sizeof probeProfiles);
+    size_t probeCount = 0;
+
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case OPT_TRANSACTIONS:
+            config.transactions = true;
+            break;
+        case OPT_BEGIN_MARK:
+            config.beginMark = optarg;
+            config.beginMarkLen = strlen(optarg);
+            break;
+        case OPT_COMMIT_MARK:
+            config.commitMark = optarg;
+            config.commitMarkLen = strlen(optarg);
+            break;
+        case OPT_PIPELINE:
+            pipeline.enabled = true;
+            break;
+        case OPT_PIPELINE_BUFFERS:
+            if (parse_size(optarg, &pipeline.bufferCount) != 0 || pipeline.bufferCount < 2)
+            {
+                LOG("invalid pipeline buffer count '%s' (at least 2)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_PIPELINE_BUFFER_SIZE:
+            if (parse_size(optarg, &pipeline.bufferSize) != 0 || pipeline.bufferSize < 4096)
+            {
+                LOG("invalid pipeline buffer size '%s' (at least 4K)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_SHARDS:
+            if (parse_size(optarg, &config.shards) != 0 || config.shards < 1 || config.shards > 64)
+            {
+                LOG("invalid shard count '%s' (1-64)", optarg);
+                exit(1);
+            }
+            pipeline.enabled = true;
+            break;
+        case OPT_SHARD_OUTPUT:
+            if (strcmp(optarg, "files") == 0)
+            {
+                config.interleaved = false;
+            }
+            else if (strcmp(optarg, "interleaved") == 0)
+            {
+                config.interleaved = true;
+            }
+            else
+            {
+                LOG("invalid shard output '%s' (files|interleaved)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_TRANSFORM:
+            config.transform = true;
+            break;
+        case OPT_WRITER:
+            writer.enabled = true;
+            break;
+        case OPT_WRITER_BUFFERS:
+            if (parse_size(optarg, &writer.bufferCount) != 0 || writer.bufferCount < 2)
+            {
+                LOG("invalid writer buffer count '%s' (at least 2)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_ROTATE_SIZE:
+            if (parse_size(optarg, &config.rotateSize) != 0)
+            {
+                LOG("invalid rotation size '%s'", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_ROTATE_INTERVAL:
+            if (parse_duration(optarg, &config.rotateInterval) != 0)
+            {
+                LOG("invalid rotation interval '%s'", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_SEEKABLE:
+            // seek table entries are 32 bit
+            if (parse_size(optarg, &config.seekableFrameSize) != 0 || config.seekableFrameSize < 1 ||
+                config.seekableFrameSize > 1024 * 1024 * 1024)
+            {
+                LOG("invalid seekable frame size '%s' (up to 1G)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_ACCUMULATE:
+            if (parse_size(optarg, &config.accumulate) != 0 || config.accumulate < 4096 ||
+                config.accumulate > 1024 * 1024 * 1024)
+            {
+                LOG("invalid accumulation size '%s' (4K to 1G)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_DICTIONARY:
+            dictionary.path = optarg;
+            break;
+        case OPT_TRAIN_DICTIONARY:
+            dictionary.trainPath = optarg;
+            break;
+        case OPT_DICTIONARY_SIZE:
+            if (parse_size(optarg, &dictionary.size) != 0 || dictionary.size < 1024 || dictionary.size > 16 * 1024 * 1024)
+            {
+                LOG("invalid dictionary size '%s' (1K-16M)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_MAX_FLUSH_LATENCY:
+            if (parse_duration(optarg, &config.maxFlushLatency) != 0)
+            {
+                LOG("invalid flush latency '%s'", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_CHECKPOINT_INTERVAL:
+            if (parse_duration(optarg, &config.checkpointInterval) != 0)
+            {
+                LOG("invalid checkpoint interval '%s'", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_DURABILITY:
+            if (strcmp(optarg, "none") == 0)
+            {
+                durability.policy = DURABILITY_NONE;
+            }
+            else if (strcmp(optarg, "interval") == 0)
+            {
+                durability.policy = DURABILITY_INTERVAL;
+            }
+            else if (strcmp(optarg, "bytes") == 0)
+            {
+                durability.policy = DURABILITY_BYTES;
+            }
+            else if (strcmp(optarg, "per-commit") == 0)
+            {
+                durability.policy = DURABILITY_COMMIT;
+            }
+            else
+            {
+                LOG("invalid durability policy '%s' (none, interval, bytes, per-commit)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_SYNC_INTERVAL:
+            if (parse_duration(optarg, &durability.interval) != 0 || durability.interval == 0)
+            {
+                LOG("invalid sync interval '%s'", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_SYNC_BYTES:
+            if (parse_size(optarg, &durability.bytes) != 0 || durability.bytes == 0)
+            {
+                LOG("invalid sync size '%s'", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_ROUTE_FIELD:
+            if (parse_size(optarg, &router.field) != 0 || router.field < 1 || router.field > 1024)
+            {
+                LOG("invalid route field '%s' (1-1024)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_ROUTE_DELIMITER:
+            if (strlen(optarg) != 1 || optarg[0] == '\n')
+            {
+                LOG("invalid route delimiter '%s' (a single character)", optarg);
+                exit(1);
+            }
+            router.delimiter = optarg[0];
+            break;
+        case OPT_MAX_ROUTES:
+            if (parse_size(optarg, &router.maxRoutes) != 0 || router.maxRoutes < 1 || router.maxRoutes > 4096)
+            {
+                LOG("invalid route count '%s' (1-4096)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_ADAPTIVE:
+            adaptive.enabled = true;
+            if (parse_adaptive(optarg) != 0)
+            {
+                LOG("invalid adaptive range '%s' (min=N,max=M)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_STATS_SOCKET:
+            stats.socketPath = optarg;
+            break;
+        case OPT_PREALLOCATE:
+            config.preallocate = true;
+            break;
+        case OPT_DROP_CACHE:
+            config.dropCache = true;
+            break;
+        case OPT_PART:
+            config.part = true;
+            break;
+        case OPT_MMAP:
+            config.mmap = true;
+            break;
+        case OPT_SINK:
+            if (parse_sink(optarg) != 0)
+            {
+                LOG("invalid sink '%s' (tcp:HOST:PORT, unix:PATH or object:COMMAND)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_SINK_IN_FLIGHT:
+            if (parse_size(optarg, &sink.inFlight) != 0 || sink.inFlight < 1 || sink.inFlight > 64)
+            {
+                LOG("invalid sink in-flight count '%s' (1-64)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_LISTEN:
+            server.path = optarg;
+            router.named = true;
+            break;
+        case OPT_MAX_CLIENTS:
+            if (parse_size(optarg, &server.maxClients) != 0 || server.maxClients < 1 || server.maxClients > 65536)
+            {
+                LOG("invalid client count '%s' (1-65536)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_SINK_PART_SIZE:
+            if (parse_size(optarg, &sink.partSize) != 0 || sink.partSize < 4096)
+            {
+                LOG("invalid sink part size '%s' (at least 4K)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_INPUT_BUFFER_SIZE:
+            if (parse_size(optarg, &input.bufferSize) != 0 || input.bufferSize < 4096)
+            {
+                LOG("invalid input buffer size '%s' (at least 4K)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_OUTPUT_BUFFER_SIZE:
+            // every stream, routes included
+            if (parse_size(optarg, &stream.outputBufferSize) != 0 || stream.outputBufferSize < 4096)
+            {
+                LOG("invalid output buffer size '%s' (at least 4K)", optarg);
+                exit(1);
+            }
+            router.bufferSize = stream.outputBufferSize;
+            break;
+        case OPT_MEMORY_LIMIT:
+            if (parse_size(optarg, &memory.limit) != 0 || memory.limit == 0)
+            {
+                LOG("invalid memory limit '%s'", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_HUGE_PAGES:
+            if (optarg == NULL || strcmp(optarg, "transparent") == 0)
+            {
+                memory.hugePages = HUGE_PAGES_TRANSPARENT;
+            }
+            else if (strcmp(optarg, "explicit") == 0)
+            {
+                memory.hugePages = HUGE_PAGES_EXPLICIT;
+            }
+            else
+            {
+                LOG("invalid huge pages mode '%s' (transparent|explicit)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_READER_CPUS:
+        case OPT_COMPRESSOR_CPUS:
+        case OPT_WRITER_CPUS:
+        {
+            cpu_set_t *set = opt == OPT_READER_CPUS ? &affinity.reader
+                             : opt == OPT_COMPRESSOR_CPUS ? &affinity.compressor
+                                                          : &affinity.writer;
+            if (parse_cpus(optarg, set) != 0 || CPU_COUNT(set) == 0)
+            {
+                LOG("invalid CPU list '%s' (like 0-3,8)", optarg);
+                exit(1);
+            }
+            break;
+        }
+        case OPT_NUMA_NODE:
+        {
+            size_t node = 0;
+            // one word of node mask for set_mempolicy
+            if (parse_size(optarg, &node) != 0 || node >= 8 * sizeof(unsigned long))
+            {
+                LOG("invalid NUMA node '%s' (0-63)", optarg);
+                exit(1);
+            }
+            affinity.node = (int)(node);
+            break;
+        }
+        case OPT_INDEX:
+            sidecar.enabled = true;
+            break;
+        case OPT_INDEX_TIME_FIELD:
+            if (parse_size(optarg, &sidecar.field) != 0 || sidecar.field < 1 || sidecar.field > 1024)
+            {
+                LOG("invalid index time field '%s' (1-1024)", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_INDEX_TIME_FORMAT:
+            sidecar.format = optarg;
+            break;
+        case OPT_PARAM:
+            if (parse_profile(optarg, &profile) != 0)
+            {
+                exit(1);
+            }
+            break;
+        case OPT_PARAM_FILE:
+            if (load_profile(optarg, &profile) != 0)
+            {
+                exit(1);
+            }
+            break;
+        case OPT_PROBE:
+            probePath = optarg;
+            break;
+        case OPT_PROBE_PROFILE:
+            if (probeCount == sizeof probeProfiles / sizeof probeProfiles[0])
+            {
+                LOG("too many probe profiles (at most %zu)", sizeof probeProfiles / sizeof probeProfiles[0]);
+                exit(1);
+            }
+            if (parse_profile(optarg, &probeProfiles[probeCount]) != 0)
+            {
+                exit(1);
+            }
+            probeCount++;
+            break;
+        default:
+            LOG("unknown option");
+            exit(1);
+        }
+    }
+
+    // probing only needs THREADS and LEVEL
+    if (probePath != NULL && argc - optind >= 2)
+    {
+        config.workers = (int)(strtol(argv[optind], NULL, 10));
+        config.level = (int)(strtol(argv[optind + 1], NULL, 10));
+        if (config.workers < 1 || config.level < 1)
+        {
+            LOG("invalid threads count or compression level");
+            exit(1);
+        }
+
+        // the profile given with --param is probed as well
+        if (profile.count > 0 && probeCount < sizeof probeProfiles / sizeof probeProfiles[0])
+        {
+            probeProfiles[probeCount++] = profile;
+        }
+        exit(probe(probePath, probeProfiles, probeCount) != 0 ? 1 : 0);
+    }
+
+    if (argc - optind != 3)
+    {
+        LOG("usage: omzstd [--transactions] [--begin-mark MARK] [--commit-mark MARK] "
+            "[--pipeline] [--pipeline-buffers N] [--pipeline-buffer-size SIZE] [--shards N] [--shard-output files|interleaved] [--transform] "
+            "[--writer] [--writer-buffers N] [--rotate-size SIZE] [--rotate-interval DURATION] [--seekable FRAME_SIZE] [--accumulate SIZE] "
+            "[--dictionary FILE] [--train-dictionary FILE] [--dictionary-size SIZE] [--max-flush-latency DURATION] [--checkpoint-interval DURATION] "
+            "[--durability none|interval|bytes|per-commit] [--sync-interval DURATION] [--sync-bytes SIZE] "
+            "[--route-field N] [--route-delimiter CHAR] [--max-routes N] [--adaptive[=min=N,max=M]] [--stats-socket PATH] "
+            "[--preallocate] [--drop-cache] [--part] [--mmap] "
+            "[--sink tcp:HOST:PORT|unix:PATH|object:COMMAND] [--sink-in-flight N] [--sink-part-size SIZE] "
+            "[--listen SOCKET] [--max-clients N] "
+            "[--input-buffer-size SIZE] [--output-buffer-size SIZE] [--memory-limit SIZE] [--huge-pages[=transparent|explicit]] "
+            "[--reader-cpus LIST] [--compressor-cpus LIST] [--writer-cpus LIST] [--numa-node N] "
+            "[--index] [--index-time-field N] [--index-time-format FORMAT|epoch] "
+            "[--param KEY=VALUE[,...]] [--param-file FILE] [--probe SAMPLE [--probe-profile KEY=VALUE[,...]]] "
+            "THREADS LEVEL PATH_PREFIX");
+        LOG("       omzstd recover [--salvage] [--dry-run] FILE...");
+        LOG("       omzstd grep [--regex] [--threads N] [--dictionary FILE|DIR]... PATTERN FILE...");
+        LOG("       omzstd cat [--threads N] [--dictionary FILE|DIR]... FILE...");
+        LOG("       omzstd attach SOCKET NAME");
+        exit(1);
+    }
+
+    if (config.mmap && writer.enabled)
+    {
+        // zstd already writes into the file, there is nothing left for a writer thread to do
+        LOG("--mmap can not be combined with --writer");
+        exit(1);
+    }
+
+    if (sink.kind != SINK_FILE &&
+        (config.mmap || config.part || config.preallocate || config.dropCache || durability.policy != DURABILITY_NONE ||
+         sidecar.enabled))
+    {
+        // all of these are about a file on the local disk
+        LOG("--sink can not be combined with --mmap, --part, --preallocate, --drop-cache, --durability or --index");
+        exit(1);
+    }
+
+    if (config.shards > 1)
+    {
+        // shards commit, route and adapt independently of each other, none of these could keep its promise
+        if (writer.enabled || durability.policy != DURABILITY_NONE || router.field > 0 || adaptive.enabled ||
+            dictionary.trainPath != NULL)
+        {
+            LOG("--shards can not be combined with --writer, --durability, --route-field, --adaptive or --train-dictionary");
+            exit(1);
+        }
+        router.maxRoutes = router.maxRoutes > config.shards ? router.maxRoutes : config.shards;
+        stream.framesOnly = config.interleaved;
+    }
+
+    if (server.path != NULL && (config.transactions || pipeline.enabled || config.shards > 1 || router.field > 0 ||
+                                 adaptive.enabled || durability.policy == DURABILITY_COMMIT))
+    {
+        // clients have their own connection instead of stdin, the streams are named by them
+        LOG("--listen can not be combined with --transactions, --pipeline, --shards, --route-field, --adaptive or "
+            "--durability per-commit");
+        exit(1);
+    }
+
+    if (adaptive.enabled && (dictionary.path != NULL || dictionary.trainPath != NULL))
+    {
+        // zstd compresses at the level the dictionary was built for, whatever the context is set to
+        LOG("--adaptive can not be combined with --dictionary or --train-dictionary");
+        exit(1);
+    }
+
+    if (config.transform && config.shards > 1 && config.interleaved)
+    {
+        // a block compressed on its own has no idea what the lines before it were
+        LOG("--transform can not be combined with --shard-output interleaved");
+        exit(1);
+    }
+
+    if (config.accumulate > 0)
+    {
+        // coded lines may outgrow the stage, --mmap moves its window under zstd, and interleaved shards already
+        // compress every block in a single call
+        if (config.transform || config.mmap || (config.shards > 1 && config.interleaved))
+        {
+            LOG("--accumulate can not be combined with --transform, --mmap or --shard-output interleaved");
+            exit(1);
+        }
+
+        // a whole frame is written in one go
+        const size_t bound = ZSTD_compressBound(config.accumulate);
+        if (stable_output())
+        {
+            stream.outputBufferSize = stream.outputBufferSize > bound ? stream.outputBufferSize : bound;
+            router.bufferSize = router.bufferSize > bound ? router.bufferSize : bound;
+        }
+    }
+
+    if (affinity_init(pipeline.enabled) != 0)
+    {
+        exit(1);
+    }
+
+    {
+        // SIGHUP and SIGUSR1 are turned into events on the reader, so they have to be blocked before any thread is created.
+        // a daemon has no stdin that closes, it stops on SIGTERM and SIGINT
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGHUP);
+        sigaddset(&set, SIGUSR1);
+        if (server.path != NULL)
+        {
+            sigaddset(&set, SIGTERM);
+            sigaddset(&set, SIGINT);
+        }
+        if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+        {
+            LOG("error blocking SIGHUP and SIGUSR1");
+            exit(1);
+        }
+
+        input.signalFd = signalfd(-1, &set, SFD_CLOEXEC);
+        if (input.signalFd == -1)
+        {
+            LOG("error creating signalfd: %s", strerror(errno));
+            exit(1);
+        }
+    }
+
+    if (durability.policy == DURABILITY_COMMIT)
+    {
+        durability.wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (durability.wakeFd == -1)
+        {
+            LOG("error creating eventfd: %s", strerror(errno));
+            exit(1);
+        }
+    }
+
+    if (reaper_start() != 0 || sink_start() != 0 || (stats.socketPath != NULL && stats_start() != 0))
+    {
+        exit(1);
+    }
+
+    // timers are checked a few times per period while stdin is idle, but at least once a second
+    const uint64_t periods[] = {
+        config.rotateInterval,
+        config.maxFlushLatency,
+        config.checkpointInterval,
+        durability.policy == DURABILITY_INTERVAL ? durability.interval : 0,
+        adaptive.enabled ? adaptive.period : 0};
+    for (size_t i = 0; i < sizeof periods / sizeof periods[0]; i++)
+    {
+        if (periods[i] > 0)
+        {
+            uint64_t tick = periods[i] / 4 < 1000 ? periods[i] / 4 : 1000;
+            tick = tick > 0 ? tick : 1;
+            if (config.tickMs == 0 || (uint64_t)(config.tickMs) > tick)
+            {
+                config.tickMs = (int)(tick);
+            }
+        }
+    }
+
+    const long workers = strtol(argv[optind], NULL, 10);
+    if (workers < 1)
+    {
+        LOG("invalid threads count");
+        exit(1);
+    }
+    config.workers = (int)(workers);
+
+    const long level = strtol(argv[optind + 1], NULL, 10);
+    if (level < 1)
+    {
+        LOG("invalid compression level (1-19, default: 3)");
+        exit(1);
+    }
+    config.level = (int)(level);
+    if (adaptive.enabled)
+    {
+        adaptive_init();
+    }
+    atomic_store_explicit(&stats.level, config.level, memory_order_relaxed);
+
+    if (memory.limit > 0 && fit_memory() != 0)
+    {
+        exit(1);
+    }
+
+    stream.outFileName = argv[optind + 2];
+
+    if (!pipeline.enabled && server.path == NULL)
+    {
+        input.buffer = (char *)big_alloc(input.bufferSize);
+        if (input.buffer == NULL)
+        {
+            LOG("error allocating input buffer");
+            exit(1);
+        }
+    }
+
+    if (writer.enabled && writer_start(router.field > 0 || router.named ? router.maxRoutes + 1 : 1) != 0)
+    {
+        exit(1);
+    }
+
+    dictionary.level = config.level;
+    if (dictionary_init() != 0)
+    {
+        exit(1);
+    }
+
+    if (router_init(&stream) != 0 || stream_init(&stream) != 0)
+    {
+        exit(1);
+    }
+
+    if (pipeline.enabled)
+    {
+        if (pipeline_start() != 0)
+        {
+            exit(1);
+        }
+        input.buffer = pipeline.current->buffer;
+        input.bufferSize = pipeline.bufferSize;
+    }
+
+    if (server.path != NULL)
+    {
+        if (serve() != 0)
+        {
+            LOG("daemon stopped with an error");
+        }
+        goto flush;
+    }
+
+    if (REPLY("OK") != 0 || flush_replies() != 0)
+    {
+        LOG("error writing initial OK");
+        exit(1);
+    }
+
+    while (1)
+    {
+        if (wait_input() != 0)
+        {
+            goto flush;
+        }
+
+        const ssize_t ret = read(STDIN_FILENO, input.buffer + input.end, input.bufferSize - input.end);
+        if (UNLIKELY(ret < 1))
+        {
+            if (ret == 0)
+            {
+                if (process_input(true) != 0 || drain_replies() != 0 || flush_replies() != 0)
+                {
+                    goto flush;
+                }
+                LOG("stdin closed, exiting");
+                goto flush;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            LOG("error reading stdin: %s", strerror(errno));
+            break;
+        }
+
+        input.end += (size_t)(ret);
+        stats_add(&stats.inputBytes, (uint64_t)(ret));
+        PROBE(read, ret);
+        if (input.receivedAt == 0)
+        {
+            input.receivedAt = now_us();
+        }
+
+        if (process_input(false) != 0)
+        {
+            goto flush;
+        }
+    }
+
+flush:
+    if (pipeline_stop() != 0)
+    {
+        LOG("compressor stopped with an error");
+    }
+
+    for (size_t i = 0; i < router.count; i++)
+    {
+        if (finish_file(router.streams[i]) != 0)
+        {
+            LOG("can not flush ZSTD buffer");
+        }
+    }
+
+    if (writer_stop() != 0)
+    {
+        LOG("writer stopped with an error");
+    }
+
+    if (reaper_stop() != 0)
+    {
+        LOG("closing a rotated output file failed");
+    }
+
+    stats_stop();
+cleanup:
+
+    router_free();
+    sink_stop();
+
+    if (pipeline.enabled)
+    {
+        pipeline_free();
+        input.buffer = NULL;
+    }
+    else if (input.buffer != NULL)
+    {
+        big_free(input.buffer, input.bufferSize);
+        input.buffer = NULL;
+        input.bufferSize = 0;
+    }
+
+    if (writer.enabled)
+    {
+        writer_free();
+    }
+
+    dictionary_finish();
+
     return 0;
 }
\ No newline at end of file